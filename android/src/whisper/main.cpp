@@ -1,10 +1,13 @@
 #include "main.h"
 #include "whisper.cpp/whisper.h"
+#include "whisper_ggml_model_cache.h"
 
 #define DR_WAV_IMPLEMENTATION
 #include "whisper.cpp/examples/dr_wav.h"
 
 #include <cstdio>
+#include <cstdlib>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
@@ -73,6 +76,70 @@ struct whisper_print_user_data
     const std::vector<std::vector<float>> *pcmf32s;
 };
 
+// Resident Model Cache (see src/whisper_ggml_model_cache.h)
+
+static whisper_model_cache &model_cache()
+{
+    static whisper_model_cache cache;
+    return cache;
+}
+
+static json model_cache_stats()
+{
+    json models = json::array();
+    const whisper_model_cache_counters counters = model_cache().visit([&](whisper_model_cache_entry &entry)
+                                                                      {
+                                                                          json model;
+                                                                          model["path"] = entry.path;
+                                                                          model["size_bytes"] = entry.size_bytes;
+                                                                          model["users"] = entry.n_users;
+                                                                          models.push_back(model);
+                                                                      });
+
+    json result;
+    result["budget_bytes"] = counters.budget_bytes;
+    result["total_bytes"] = counters.total_bytes;
+    result["hits"] = counters.n_hits;
+    result["misses"] = counters.n_misses;
+    result["evictions"] = counters.n_evictions;
+    result["models"] = models;
+
+    return result;
+}
+
+// Scoped lease on a cached model plus a private whisper_state for the duration of one request
+struct whisper_model_lease
+{
+    whisper_model_cache_entry *model = nullptr;
+    struct whisper_context *ctx = nullptr;
+    struct whisper_state *state = nullptr;
+
+    explicit whisper_model_lease(const std::string &path)
+    {
+        model = model_cache().acquire(path);
+        if (model != nullptr)
+        {
+            ctx = model->ctx;
+            state = whisper_init_state(ctx);
+        }
+    }
+
+    ~whisper_model_lease()
+    {
+        if (state != nullptr)
+        {
+            whisper_free_state(state);
+        }
+        if (model != nullptr)
+        {
+            model_cache().release(model);
+        }
+    }
+
+    whisper_model_lease(const whisper_model_lease &) = delete;
+    whisper_model_lease &operator=(const whisper_model_lease &) = delete;
+};
+
 json transcribe(json jsonBody) noexcept
 {
     whisper_params params;
@@ -102,7 +169,15 @@ json transcribe(json jsonBody) noexcept
     }
 
     // whisper init
-    struct whisper_context *ctx = whisper_init_from_file(params.model.c_str());
+    whisper_model_lease lease(params.model);
+    struct whisper_context *ctx = lease.ctx;
+    struct whisper_state *state = lease.state;
+    if (ctx == nullptr || state == nullptr)
+    {
+        jsonResult["@type"] = "error";
+        jsonResult["message"] = "failed to initialize model";
+        return jsonResult;
+    }
     std::string text_result = "";
     const auto fname_inp = params.audio;
     // WAV input
@@ -187,7 +262,7 @@ json transcribe(json jsonBody) noexcept
             wparams.token_timestamps = true;
         }
 
-        if (whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size()) != 0)
+        if (whisper_full_with_state(ctx, state, wparams, pcmf32.data(), pcmf32.size()) != 0)
         {
             jsonResult["@type"] = "error";
             jsonResult["message"] = "failed to process audio";
@@ -200,13 +275,13 @@ json transcribe(json jsonBody) noexcept
         if (!wparams.print_realtime)
         {
 
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(state);
 
             std::vector<json> segmentsJson = {};
 
             for (int i = 0; i < n_segments; ++i)
             {
-                const char *text = whisper_full_get_segment_text(ctx, i);
+                const char *text = whisper_full_get_segment_text_from_state(state, i);
 
                 std::string str(text);
                 text_result += str;
@@ -216,8 +291,8 @@ json transcribe(json jsonBody) noexcept
                     // fflush(stdout);
                 } else {
                     json jsonSegment;
-                    const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                    const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                    const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+                    const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
 
                     // printf("[%s --> %s]  %s\n", to_timestamp(t0).c_str(), to_timestamp(t1).c_str(), text);
 
@@ -235,8 +310,7 @@ json transcribe(json jsonBody) noexcept
         }
     }
     jsonResult["text"] = text_result;
-    
-    whisper_free(ctx);
+
     return jsonResult;
 }
 extern "C"
@@ -262,6 +336,20 @@ extern "C"
                     return jsonToChar(jsonResult);
                 }
             }
+            if (jsonBody["@type"] == "setModelCacheBudget")
+            {
+                const size_t max_bytes = jsonBody["max_bytes"];
+                model_cache().set_budget(max_bytes);
+                jsonResult["@type"] = "setModelCacheBudget";
+                jsonResult["cache"] = model_cache_stats();
+                return jsonToChar(jsonResult);
+            }
+            if (jsonBody["@type"] == "getModelCacheStats")
+            {
+                jsonResult["@type"] = "getModelCacheStats";
+                jsonResult["cache"] = model_cache_stats();
+                return jsonToChar(jsonResult);
+            }
             if (jsonBody["@type"] == "getVersion")
             {
                 jsonResult["@type"] = "version";
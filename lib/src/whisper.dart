@@ -21,6 +21,10 @@ export 'whisper_audio_convert.dart';
 /// Native request type
 typedef WReqNative = Pointer<Utf8> Function(Pointer<Utf8> body);
 
+/// Native result release type (Linux only)
+typedef WFreeNative = Void Function(Pointer<Utf8> result);
+typedef WFreeDart = void Function(Pointer<Utf8> result);
+
 /// Entry point
 class Whisper {
   /// [model] is required
@@ -69,8 +73,9 @@ class Whisper {
   }) async {
     return Isolate.run(
       () async {
+        final DynamicLibrary lib = _openLib();
         final Pointer<Utf8> data = whisperRequest.toRequestString().toNativeUtf8();
-        final Pointer<Utf8> res = _openLib()
+        final Pointer<Utf8> res = lib
             .lookupFunction<WReqNative, WReqNative>('request')
             .call(data);
 
@@ -79,6 +84,12 @@ class Whisper {
         ) as Map<String, dynamic>;
 
         malloc.free(data);
+
+        // The Linux library exports an explicit release for its results
+        if (Platform.isLinux) {
+          lib.lookupFunction<WFreeNative, WFreeDart>('whisper_ggml_free_result')
+              .call(res);
+        }
         return result;
       },
     );
@@ -90,12 +101,19 @@ class Whisper {
     required String modelPath,
   }) async {
     try {
+      // The Linux library decodes WAV and FLAC files of any rate, sample
+      // format and channel count itself, so only other formats need ffmpeg
+      final String extension = transcribeRequest.audio.toLowerCase();
+      final bool nativeInput = Platform.isLinux &&
+          (extension.endsWith('.wav') || extension.endsWith('.flac'));
+
       final WhisperAudioConvert converter = WhisperAudioConvert(
         audioInput: File(transcribeRequest.audio),
         audioOutput: File('${transcribeRequest.audio}.wav'),
       );
 
-      final File? convertedFile = await converter.convert();
+      final File? convertedFile =
+          nativeInput ? null : await converter.convert();
 
       final TranscribeRequest req = transcribeRequest.copyWith(
         audio: convertedFile?.path ?? transcribeRequest.audio,
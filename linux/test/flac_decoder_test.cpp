@@ -0,0 +1,765 @@
+// Checks whisper_flac_decoder against the PCM it was given to encode. The streams are written by a
+// small encoder in this file, which covers every subframe type, stereo mode and residual coding
+// the decoder supports, so no fixture files or external tools are needed.
+
+#include "../whisper_ggml_flac.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct bit_writer {
+    std::vector<uint8_t> bytes;
+
+    uint32_t acc = 0;
+    int n_bits = 0;
+
+    void put_bit(uint32_t bit) {
+        acc = (acc << 1) | (bit & 1);
+        if (++n_bits == 8) {
+            bytes.push_back((uint8_t) acc);
+            acc = 0;
+            n_bits = 0;
+        }
+    }
+
+    void put(uint64_t value, int n) {
+        for (int i = n - 1; i >= 0; --i) {
+            put_bit((uint32_t) (value >> i));
+        }
+    }
+
+    void put_signed(int64_t value, int n) {
+        put((uint64_t) value & ((1ull << n) - 1), n);
+    }
+
+    void put_unary(uint32_t q) {
+        for (uint32_t i = 0; i < q; ++i) {
+            put_bit(0);
+        }
+        put_bit(1);
+    }
+
+    void align() {
+        while (n_bits != 0) {
+            put_bit(0);
+        }
+    }
+};
+
+// bits needed to store v as a signed integer
+int signed_bits(int64_t v) {
+    int n = 1;
+    while (v < -(1ll << (n - 1)) || v >= (1ll << (n - 1))) {
+        n++;
+    }
+    return n;
+}
+
+enum subframe_type {
+    SUBFRAME_CONSTANT,
+    SUBFRAME_VERBATIM,
+    SUBFRAME_FIXED,
+    SUBFRAME_LPC,
+};
+
+struct subframe_options {
+    subframe_type type = SUBFRAME_VERBATIM;
+    int  order = 0;             // fixed: 0..4, LPC: 1..32
+    bool wasted = false;        // use the wasted bits of the samples, if any
+    int  method = 0;            // residual coding method: 0 for 4-bit, 1 for 5-bit Rice parameters
+    int  partition_order = 0;
+    bool escape = false;        // code every partition as escaped raw samples
+};
+
+void put_residual(bit_writer & bw, const std::vector<int64_t> & res, int block_size, int order, const subframe_options & opt) {
+    const int param_bits = opt.method == 0 ? 4 : 5;
+    const int escape     = opt.method == 0 ? 15 : 31;
+
+    bw.put(opt.method, 2);
+    bw.put(opt.partition_order, 4);
+
+    const int n_partitions   = 1 << opt.partition_order;
+    const int partition_size = block_size >> opt.partition_order;
+
+    int i = order;
+    for (int p = 0; p < n_partitions; ++p) {
+        const int n = p == 0 ? partition_size - order : partition_size;
+
+        uint64_t max_u  = 0;
+        int      n_raw  = 0;
+        for (int j = 0; j < n; ++j) {
+            const int64_t r = res[i + j];
+            max_u = std::max(max_u, (uint64_t) (r >= 0 ? 2*r : -2*r - 1));
+            if (r != 0) {
+                n_raw = std::max(n_raw, signed_bits(r));
+            }
+        }
+
+        // a parameter that keeps the quotients short
+        int k = 0;
+        while ((max_u >> k) > 16) {
+            k++;
+        }
+
+        if (opt.escape || k >= escape) {
+            bw.put(escape, param_bits);
+            bw.put(n_raw, 5);
+            for (int j = 0; j < n; ++j) {
+                if (n_raw > 0) {
+                    bw.put_signed(res[i + j], n_raw);
+                }
+            }
+        } else {
+            bw.put(k, param_bits);
+            for (int j = 0; j < n; ++j) {
+                const int64_t  r = res[i + j];
+                const uint64_t u = r >= 0 ? 2*r : -2*r - 1;
+                bw.put_unary((uint32_t) (u >> k));
+                bw.put(u & ((1ull << k) - 1), k);
+            }
+        }
+
+        i += n;
+    }
+}
+
+void put_subframe(bit_writer & bw, const int32_t * x, int block_size, int bps, const subframe_options & opt, std::mt19937 & rng) {
+    // common trailing zero bits of the samples, at most bps - 1
+    int wasted = 0;
+    if (opt.wasted) {
+        uint32_t all = 0;
+        for (int i = 0; i < block_size; ++i) {
+            all |= (uint32_t) x[i];
+        }
+        while (all != 0 && wasted < bps - 1 && !(all & (1u << wasted))) {
+            wasted++;
+        }
+    }
+
+    std::vector<int64_t> s(block_size);
+    for (int i = 0; i < block_size; ++i) {
+        s[i] = (int64_t) x[i] >> wasted;
+    }
+    bps -= wasted;
+
+    const int type =
+        opt.type == SUBFRAME_CONSTANT ? 0 :
+        opt.type == SUBFRAME_VERBATIM ? 1 :
+        opt.type == SUBFRAME_FIXED    ? 8 + opt.order : 32 + opt.order - 1;
+
+    bw.put(0, 1);
+    bw.put(type, 6);
+    if (wasted > 0) {
+        bw.put(1, 1);
+        bw.put_unary(wasted - 1);
+    } else {
+        bw.put(0, 1);
+    }
+
+    if (opt.type == SUBFRAME_CONSTANT) {
+        bw.put_signed(s[0], bps);
+        return;
+    }
+
+    if (opt.type == SUBFRAME_VERBATIM) {
+        for (int i = 0; i < block_size; ++i) {
+            bw.put_signed(s[i], bps);
+        }
+        return;
+    }
+
+    for (int i = 0; i < opt.order; ++i) {
+        bw.put_signed(s[i], bps);
+    }
+
+    std::vector<int64_t> res(block_size, 0);
+
+    if (opt.type == SUBFRAME_FIXED) {
+        for (int i = opt.order; i < block_size; ++i) {
+            switch (opt.order) {
+                case 0: res[i] = s[i]; break;
+                case 1: res[i] = s[i] - s[i - 1]; break;
+                case 2: res[i] = s[i] - 2*s[i - 1] + s[i - 2]; break;
+                case 3: res[i] = s[i] - 3*s[i - 1] + 3*s[i - 2] - s[i - 3]; break;
+                case 4: res[i] = s[i] - 4*s[i - 1] + 6*s[i - 2] - 4*s[i - 3] + s[i - 4]; break;
+            }
+        }
+    } else {
+        // any coefficients give an exact stream; these roughly follow the previous sample
+        const int precision = 12;
+        const int shift     = 10;
+
+        std::vector<int32_t> coefs(opt.order);
+        for (int j = 0; j < opt.order; ++j) {
+            coefs[j] = j == 0 ? 900 : (int32_t) (rng() % 257) - 128;
+        }
+
+        bw.put(precision - 1, 4);
+        bw.put_signed(shift, 5);
+        for (int j = 0; j < opt.order; ++j) {
+            bw.put_signed(coefs[j], precision);
+        }
+
+        for (int i = opt.order; i < block_size; ++i) {
+            int64_t sum = 0;
+            for (int j = 0; j < opt.order; ++j) {
+                sum += (int64_t) coefs[j]*s[i - j - 1];
+            }
+            res[i] = s[i] - (sum >> shift);
+        }
+    }
+
+    put_residual(bw, res, block_size, opt.order, opt);
+}
+
+// frame and sample numbers are coded like UTF-8
+void put_utf8(bit_writer & bw, uint32_t v) {
+    if (v < 0x80) {
+        bw.put(v, 8);
+        return;
+    }
+
+    int n_extra = 1;
+    while (v >= (1u << (5*n_extra + 6))) {
+        n_extra++;
+    }
+
+    // n_extra + 1 one bits, a zero bit and the high bits of the value
+    bw.put((1u << (n_extra + 1)) - 1, n_extra + 1);
+    bw.put(0, 1);
+    bw.put(v >> (6*n_extra), 6 - n_extra);
+    for (int i = n_extra - 1; i >= 0; --i) {
+        bw.put(0x80 | ((v >> (6*i)) & 0x3f), 8);
+    }
+}
+
+struct frame_options {
+    int channel_assignment = 1; // 0..7 independent, 8 left/side, 9 side/right, 10 mid/side
+    bool explicit_bps = false;  // sample size in the frame header instead of STREAMINFO
+    int sample_rate_code = 0;   // 0, 12, 13 or 14
+    subframe_options sub[2];
+};
+
+// pcm holds one vector per channel, block_size samples from `offset` are written
+void put_frame(bit_writer & bw, const std::vector<std::vector<int32_t>> & pcm, int offset, int block_size, int bps, uint32_t frame_number, const frame_options & opt, std::mt19937 & rng) {
+    bw.put(0xfff8, 16);
+
+    int block_size_code = 7;
+    if (block_size == 192) {
+        block_size_code = 1;
+    } else if (block_size == 576 || block_size == 1152 || block_size == 2304 || block_size == 4608) {
+        block_size_code = 2 + (block_size == 1152) + 2*(block_size == 2304) + 3*(block_size == 4608);
+    } else if (block_size == 4096) {
+        block_size_code = 12;
+    } else if (block_size <= 256) {
+        block_size_code = 6;
+    }
+
+    int sample_size_code = 0;
+    if (opt.explicit_bps) {
+        switch (bps) {
+            case 8:  sample_size_code = 1; break;
+            case 12: sample_size_code = 2; break;
+            case 16: sample_size_code = 4; break;
+            case 20: sample_size_code = 5; break;
+            case 24: sample_size_code = 6; break;
+            case 32: sample_size_code = 7; break;
+        }
+    }
+
+    bw.put(block_size_code, 4);
+    bw.put(opt.sample_rate_code, 4);
+    bw.put(opt.channel_assignment, 4);
+    bw.put(sample_size_code, 3);
+    bw.put(0, 1);
+
+    put_utf8(bw, frame_number);
+
+    if (block_size_code == 6) {
+        bw.put(block_size - 1, 8);
+    } else if (block_size_code == 7) {
+        bw.put(block_size - 1, 16);
+    }
+
+    if (opt.sample_rate_code == 12) {
+        bw.put(16, 8);
+    } else if (opt.sample_rate_code == 13 || opt.sample_rate_code == 14) {
+        bw.put(opt.sample_rate_code == 13 ? 16000 : 1600, 16);
+    }
+
+    bw.put(0, 8); // CRC-8, not checked by the decoder
+
+    const int n_channels = (int) pcm.size();
+
+    if (opt.channel_assignment < 8) {
+        for (int c = 0; c < n_channels; ++c) {
+            put_subframe(bw, pcm[c].data() + offset, block_size, bps, opt.sub[c], rng);
+        }
+    } else {
+        const int32_t * l = pcm[0].data() + offset;
+        const int32_t * r = pcm[1].data() + offset;
+
+        std::vector<int32_t> side(block_size);
+        std::vector<int32_t> mid (block_size);
+        for (int i = 0; i < block_size; ++i) {
+            side[i] = l[i] - r[i];
+            mid [i] = (int32_t) (((int64_t) l[i] + r[i]) >> 1);
+        }
+
+        switch (opt.channel_assignment) {
+            case 8:
+                put_subframe(bw, l,           block_size, bps,     opt.sub[0], rng);
+                put_subframe(bw, side.data(), block_size, bps + 1, opt.sub[1], rng);
+                break;
+            case 9:
+                put_subframe(bw, side.data(), block_size, bps + 1, opt.sub[0], rng);
+                put_subframe(bw, r,           block_size, bps,     opt.sub[1], rng);
+                break;
+            case 10:
+                put_subframe(bw, mid.data(),  block_size, bps,     opt.sub[0], rng);
+                put_subframe(bw, side.data(), block_size, bps + 1, opt.sub[1], rng);
+                break;
+        }
+    }
+
+    bw.align();
+    bw.put(0, 16); // CRC-16, not checked by the decoder
+}
+
+void put_stream_header(bit_writer & bw, int n_channels, int bps, uint64_t total_samples, int id3_size, bool id3_footer) {
+    if (id3_size >= 0) {
+        bw.put('I', 8);
+        bw.put('D', 8);
+        bw.put('3', 8);
+        bw.put(4, 8);
+        bw.put(0, 8);
+        bw.put(id3_footer ? 0x10 : 0x00, 8);
+        for (int shift = 21; shift >= 0; shift -= 7) {
+            bw.put((id3_size >> shift) & 0x7f, 8);
+        }
+        // tag contents that look like a stream marker and a frame sync code
+        const int n_bytes = id3_size + (id3_footer ? 10 : 0);
+        for (int i = 0; i < n_bytes; ++i) {
+            static const uint8_t junk[] = { 'f', 'L', 'a', 'C', 0xff, 0xf8 };
+            bw.put(junk[i % sizeof(junk)], 8);
+        }
+    }
+
+    bw.put('f', 8);
+    bw.put('L', 8);
+    bw.put('a', 8);
+    bw.put('C', 8);
+
+    // STREAMINFO
+    bw.put(0, 1);
+    bw.put(0, 7);
+    bw.put(34, 24);
+    bw.put(16, 16);
+    bw.put(65535, 16);
+    bw.put(0, 24);
+    bw.put(0, 24);
+    bw.put(16000, 20);
+    bw.put(n_channels - 1, 3);
+    bw.put(bps - 1, 5);
+    bw.put(total_samples, 36);
+    for (int i = 0; i < 16; ++i) {
+        bw.put(0, 8); // MD5
+    }
+
+    // PADDING, skipped by the decoder
+    bw.put(1, 1);
+    bw.put(1, 7);
+    bw.put(100, 24);
+    for (int i = 0; i < 100; ++i) {
+        bw.put(0xff, 8);
+    }
+}
+
+struct temp_file {
+    std::string path;
+
+    explicit temp_file(const std::vector<uint8_t> & bytes) {
+        char name[] = "/tmp/flac_decoder_test_XXXXXX";
+        const int fd = mkstemp(name);
+        if (fd < 0) {
+            perror("mkstemp");
+            exit(1);
+        }
+        path = name;
+
+        FILE * f = fdopen(fd, "wb");
+        fwrite(bytes.data(), 1, bytes.size(), f);
+        fclose(f);
+    }
+
+    ~temp_file() {
+        unlink(path.c_str());
+    }
+};
+
+// decode the stream and compare it with pcm; returns the number of failures
+int check(const char * name, const std::vector<uint8_t> & bytes, const std::vector<std::vector<int32_t>> & pcm, int bps) {
+    temp_file file(bytes);
+
+    whisper_flac_decoder dec;
+    if (!dec.open(file.path.c_str())) {
+        fprintf(stderr, "%s: open failed\n", name);
+        return 1;
+    }
+
+    const int n_channels = (int) pcm.size();
+    const int n_samples  = (int) pcm[0].size();
+
+    if ((int) dec.channels != n_channels || (int) dec.bits_per_sample != bps || dec.sample_rate != 16000 || (int) dec.total_samples != n_samples) {
+        fprintf(stderr, "%s: STREAMINFO %u channels, %u bits, %u Hz, %llu samples\n", name,
+                dec.channels, dec.bits_per_sample, dec.sample_rate, (unsigned long long) dec.total_samples);
+        return 1;
+    }
+
+    int pos = 0;
+    while (true) {
+        const int n = dec.decode_frame();
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            fprintf(stderr, "%s: corrupt frame at sample %d\n", name, pos);
+            return 1;
+        }
+        if (pos + n > n_samples || (int) dec.frame_bits() != bps) {
+            fprintf(stderr, "%s: frame of %d samples and %u bits at sample %d\n", name, n, dec.frame_bits(), pos);
+            return 1;
+        }
+
+        for (int c = 0; c < n_channels; ++c) {
+            for (int i = 0; i < n; ++i) {
+                if (dec.channel(c)[i] != pcm[c][pos + i]) {
+                    fprintf(stderr, "%s: channel %d, sample %d: %d, expected %d\n", name, c, pos + i, dec.channel(c)[i], pcm[c][pos + i]);
+                    return 1;
+                }
+            }
+        }
+
+        pos += n;
+    }
+
+    if (pos != n_samples) {
+        fprintf(stderr, "%s: decoded %d of %d samples\n", name, pos, n_samples);
+        return 1;
+    }
+
+    return 0;
+}
+
+// a random walk, so that the predictors have something to predict
+std::vector<int32_t> make_signal(int n_samples, int bps, std::mt19937 & rng) {
+    const int64_t lo = -(1ll << (bps - 1));
+    const int64_t hi =  (1ll << (bps - 1)) - 1;
+
+    const int64_t step = 1ll << (bps - 6);
+
+    std::vector<int32_t> x(n_samples);
+    int64_t v = 0;
+    for (int i = 0; i < n_samples; ++i) {
+        v += (int64_t) (rng() % (2*step + 1)) - step;
+        v  = std::max(lo, std::min(hi, v));
+        x[i] = (int32_t) v;
+    }
+    return x;
+}
+
+subframe_options random_subframe(int block_size, std::mt19937 & rng) {
+    subframe_options opt;
+
+    switch (rng() % 4) {
+        case 0: opt.type = SUBFRAME_VERBATIM; break;
+        case 1: opt.type = SUBFRAME_FIXED;    opt.order = rng() % 5;  break;
+        case 2: opt.type = SUBFRAME_LPC;      opt.order = 1 + rng() % 32; break;
+        case 3: opt.type = SUBFRAME_FIXED;    opt.order = 2; break;
+    }
+    opt.order  = std::min(opt.order, block_size);
+    if (opt.type == SUBFRAME_LPC && opt.order == 0) {
+        opt.type = SUBFRAME_VERBATIM;
+    }
+    opt.wasted = rng() % 3 == 0;
+    opt.method = rng() % 2;
+    opt.escape = rng() % 5 == 0;
+
+    // the largest partition order that divides the block and leaves room for the warm-up samples
+    std::vector<int> orders;
+    for (int p = 0; p <= 8; ++p) {
+        if ((block_size >> p) << p == block_size && (block_size >> p) >= opt.order) {
+            orders.push_back(p);
+        }
+    }
+    opt.partition_order = orders[rng() % orders.size()];
+
+    return opt;
+}
+
+// every subframe type, stereo mode and residual coding, chosen per frame
+int test_random() {
+    std::mt19937 rng(42);
+
+    int n_fail = 0;
+
+    for (int bps : { 8, 12, 16, 20, 24 }) {
+        for (int n_channels : { 1, 2 }) {
+            const int n_samples = 30000 + rng() % 1000;
+
+            std::vector<std::vector<int32_t>> pcm;
+            for (int c = 0; c < n_channels; ++c) {
+                pcm.push_back(make_signal(n_samples, bps, rng));
+            }
+
+            // blocks of constant and wasted-bit samples
+            for (int c = 0; c < n_channels; ++c) {
+                for (int i = 1000; i < 1500; ++i) {
+                    pcm[c][i] = pcm[c][1000];
+                }
+                for (int i = 2000; i < 3000; ++i) {
+                    pcm[c][i] &= ~7;
+                }
+            }
+
+            bit_writer bw;
+            put_stream_header(bw, n_channels, bps, n_samples, -1, false);
+
+            int offset = 0;
+            uint32_t frame_number = 0;
+            while (offset < n_samples) {
+                static const int sizes[] = { 192, 256, 576, 1152, 2304, 4096, 4608, 17, 1, 100 };
+                const int block_size = std::min(n_samples - offset, sizes[rng() % 10]);
+
+                frame_options opt;
+                opt.channel_assignment = n_channels == 1 ? 0 : (rng() % 2 ? 1 : 8 + rng() % 3);
+                opt.explicit_bps = rng() % 2;
+                static const int sample_rate_codes[] = { 0, 12, 13, 14 };
+                opt.sample_rate_code = sample_rate_codes[rng() % 4];
+
+                for (int c = 0; c < n_channels; ++c) {
+                    opt.sub[c] = random_subframe(block_size, rng);
+
+                    bool constant = true;
+                    for (int i = 1; i < block_size && constant; ++i) {
+                        constant = pcm[c][offset + i] == pcm[c][offset];
+                    }
+                    if (constant && opt.channel_assignment < 8) {
+                        opt.sub[c].type = SUBFRAME_CONSTANT;
+                    }
+                }
+
+                // frame numbers past 127 take several bytes
+                put_frame(bw, pcm, offset, block_size, bps, frame_number + (frame_number % 7 == 0 ? 100000 : 0), opt, rng);
+
+                offset += block_size;
+                frame_number++;
+            }
+
+            char name[64];
+            snprintf(name, sizeof(name), "random %d-bit %d-channel", bps, n_channels);
+            n_fail += check(name, bw.bytes, pcm, bps);
+        }
+    }
+
+    return n_fail;
+}
+
+// one frame per subframe type and stereo mode, so that a failure names what broke
+int test_cases() {
+    std::mt19937 rng(7);
+
+    const int bps        = 16;
+    const int block_size = 1152;
+
+    std::vector<std::vector<int32_t>> pcm = { make_signal(block_size, bps, rng), make_signal(block_size, bps, rng) };
+
+    struct test_case {
+        const char * name;
+        int channel_assignment;
+        subframe_options sub;
+        std::vector<std::vector<int32_t>> pcm;
+    };
+
+    auto with = [](subframe_type type, int order, int partition_order, bool escape, bool wasted, int method) {
+        subframe_options opt;
+        opt.type = type;
+        opt.order = order;
+        opt.partition_order = partition_order;
+        opt.escape = escape;
+        opt.wasted = wasted;
+        opt.method = method;
+        return opt;
+    };
+
+    std::vector<std::vector<int32_t>> constant = { std::vector<int32_t>(block_size, -1234), std::vector<int32_t>(block_size, 77) };
+    std::vector<std::vector<int32_t>> wasted = pcm;
+    std::vector<std::vector<int32_t>> zeros  = { std::vector<int32_t>(block_size, 0), std::vector<int32_t>(block_size, 0) };
+    for (auto & ch : wasted) {
+        for (auto & v : ch) {
+            v &= ~31;
+        }
+    }
+
+    const std::vector<test_case> cases = {
+        { "constant",              1,  with(SUBFRAME_CONSTANT, 0, 0, false, false, 0), constant },
+        { "verbatim",              1,  with(SUBFRAME_VERBATIM, 0, 0, false, false, 0), pcm },
+        { "fixed order 0",         1,  with(SUBFRAME_FIXED,    0, 0, false, false, 0), pcm },
+        { "fixed order 1",         1,  with(SUBFRAME_FIXED,    1, 2, false, false, 0), pcm },
+        { "fixed order 2",         1,  with(SUBFRAME_FIXED,    2, 3, false, false, 1), pcm },
+        { "fixed order 3",         1,  with(SUBFRAME_FIXED,    3, 4, false, false, 0), pcm },
+        { "fixed order 4",         1,  with(SUBFRAME_FIXED,    4, 7, false, false, 1), pcm },
+        { "lpc order 1",           1,  with(SUBFRAME_LPC,      1, 0, false, false, 0), pcm },
+        { "lpc order 8",           1,  with(SUBFRAME_LPC,      8, 5, false, false, 1), pcm },
+        { "lpc order 32",          1,  with(SUBFRAME_LPC,     32, 5, false, false, 0), pcm },
+        { "left/side",             8,  with(SUBFRAME_FIXED,    2, 2, false, false, 0), pcm },
+        { "side/right",            9,  with(SUBFRAME_FIXED,    2, 2, false, false, 0), pcm },
+        { "mid/side",              10, with(SUBFRAME_LPC,      4, 2, false, false, 0), pcm },
+        { "wasted bits",           1,  with(SUBFRAME_FIXED,    2, 0, false, true,  0), wasted },
+        { "wasted bits mid/side",  10, with(SUBFRAME_VERBATIM, 0, 0, false, true,  0), wasted },
+        { "escape 4-bit",          1,  with(SUBFRAME_FIXED,    1, 3, true,  false, 0), pcm },
+        { "escape 5-bit",          1,  with(SUBFRAME_LPC,      3, 3, true,  false, 1), pcm },
+        { "escape zeros",          1,  with(SUBFRAME_FIXED,    1, 1, true,  false, 0), zeros },
+    };
+
+    int n_fail = 0;
+
+    for (const auto & c : cases) {
+        bit_writer bw;
+        put_stream_header(bw, 2, bps, block_size, -1, false);
+
+        frame_options opt;
+        opt.channel_assignment = c.channel_assignment;
+        opt.sub[0] = c.sub;
+        opt.sub[1] = c.sub;
+        put_frame(bw, c.pcm, 0, block_size, bps, 0, opt, rng);
+
+        n_fail += check(c.name, bw.bytes, c.pcm, bps);
+    }
+
+    return n_fail;
+}
+
+// an ID3v2 tag in front of the stream marker, with and without a footer
+int test_id3() {
+    std::mt19937 rng(11);
+
+    const int bps = 16;
+    std::vector<std::vector<int32_t>> pcm = { make_signal(4096, bps, rng) };
+
+    int n_fail = 0;
+
+    for (bool footer : { false, true }) {
+        // larger than the read buffer, so that part of the tag is skipped with a seek
+        for (int size : { 0, 37, 200000 }) {
+            bit_writer bw;
+            put_stream_header(bw, 1, bps, pcm[0].size(), size, footer);
+
+            frame_options opt;
+            opt.channel_assignment = 0;
+            opt.sub[0] = random_subframe(4096, rng);
+            put_frame(bw, pcm, 0, 4096, bps, 0, opt, rng);
+
+            char name[64];
+            snprintf(name, sizeof(name), "id3 %d bytes%s", size, footer ? " with footer" : "");
+            n_fail += check(name, bw.bytes, pcm, bps);
+        }
+    }
+
+    return n_fail;
+}
+
+// 32-bit samples decode as is, but a 32-bit side channel would need 33 bits and is rejected
+int test_32_bit() {
+    std::mt19937 rng(13);
+
+    const int bps        = 32;
+    const int block_size = 256;
+
+    std::vector<std::vector<int32_t>> pcm(2, std::vector<int32_t>(block_size));
+    for (auto & ch : pcm) {
+        for (auto & v : ch) {
+            v = (int32_t) rng();
+        }
+    }
+
+    int n_fail = 0;
+
+    {
+        bit_writer bw;
+        put_stream_header(bw, 2, bps, block_size, -1, false);
+
+        frame_options opt;
+        opt.channel_assignment = 1;
+        opt.explicit_bps = true;
+        put_frame(bw, pcm, 0, block_size, bps, 0, opt, rng);
+
+        n_fail += check("32-bit independent", bw.bytes, pcm, bps);
+    }
+
+    for (int channel_assignment : { 8, 9, 10 }) {
+        // followed by constant zero subframes, which would decode if the frame was not rejected
+        bit_writer bw;
+        put_stream_header(bw, 2, bps, block_size, -1, false);
+        bw.put(0xfff8, 16);
+        bw.put(6, 4);
+        bw.put(0, 4);
+        bw.put(channel_assignment, 4);
+        bw.put(7, 3);
+        bw.put(0, 1);
+        bw.put(0, 8);
+        bw.put(block_size - 1, 8);
+        bw.put(0, 8);
+        for (int i = 0; i < 32; ++i) {
+            bw.put(0, 8);
+        }
+
+        temp_file file(bw.bytes);
+
+        whisper_flac_decoder dec;
+        if (!dec.open(file.path.c_str()) || dec.decode_frame() != -1) {
+            fprintf(stderr, "32-bit channel assignment %d: not rejected\n", channel_assignment);
+            n_fail++;
+        }
+    }
+
+    return n_fail;
+}
+
+int test_not_flac() {
+    bit_writer bw;
+    for (const char * p = "RIFF\x24\0\0\0WAVEfmt "; *p; ++p) {
+        bw.put((uint8_t) *p, 8);
+    }
+
+    temp_file file(bw.bytes);
+
+    whisper_flac_decoder dec;
+    if (dec.open(file.path.c_str())) {
+        fprintf(stderr, "not flac: opened\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+} // namespace
+
+int main() {
+    const int n_fail = test_cases() + test_random() + test_id3() + test_32_bit() + test_not_flac();
+
+    if (n_fail > 0) {
+        fprintf(stderr, "flac_decoder_test: %d failures\n", n_fail);
+        return 1;
+    }
+
+    printf("flac_decoder_test: OK\n");
+    return 0;
+}
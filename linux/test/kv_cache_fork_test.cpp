@@ -0,0 +1,261 @@
+// Checks the copy-on-write forks of the paged self-attention KV caches (kv_cache_fork(),
+// kv_cache_blocks_write()) against a reference that copies the whole cache of the parent.
+//
+// The functions under test are internal to whisper.cpp, so the translation unit is included
+// directly. No model is needed: the caches are allocated with small hyperparameters.
+
+#include "../whisper.cpp/whisper.cpp"
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace {
+
+const int N_DECODERS = 4;
+
+struct fork_test {
+    whisper_context ctx;
+    whisper_state * state = new whisper_state;
+
+    // reference contents of the K and V tensors of each decoder, updated by full copies
+    std::vector<uint8_t> ref_k[N_DECODERS];
+    std::vector<uint8_t> ref_v[N_DECODERS];
+
+    std::vector<uint8_t> kv_buf;
+    std::mt19937 rng{42};
+
+    int n_fail = 0;
+
+    fork_test() {
+        auto & hparams = ctx.model.hparams;
+        hparams.n_text_ctx   = 96;
+        hparams.n_text_state = 8;
+        hparams.n_text_layer = 2;
+
+        // K and V plus the ggml object headers
+        const size_t n_bytes = 2*hparams.n_text_layer*hparams.n_text_ctx*hparams.n_text_state*sizeof(ggml_fp16_t) + 4096;
+
+        for (int j = 0; j < N_DECODERS; ++j) {
+            auto & cache = state->decoders[j].kv_self;
+            WHISPER_ASSERT(kv_cache_init(hparams, n_bytes, cache, GGML_TYPE_F16, hparams.n_text_ctx));
+            cache.n = 0;
+            kv_cache_blocks_reset(cache);
+
+            ref_k[j].assign(ggml_nbytes(cache.k), 0);
+            ref_v[j].assign(ggml_nbytes(cache.v), 0);
+            memset(cache.k->data, 0, ggml_nbytes(cache.k));
+            memset(cache.v->data, 0, ggml_nbytes(cache.v));
+        }
+    }
+
+    ~fork_test() {
+        for (int j = 0; j < N_DECODERS; ++j) {
+            kv_cache_free(state->decoders[j].kv_self);
+        }
+        delete state;
+    }
+
+    // decoder j evaluates n_tokens new tokens: random keys and values at [n, n + n_tokens)
+    void write(int j, int n_tokens) {
+        const auto & hparams = ctx.model.hparams;
+        auto & cache = state->decoders[j].kv_self;
+
+        const int n_past = cache.n;
+        WHISPER_ASSERT(n_past + n_tokens <= hparams.n_text_ctx);
+
+        if (n_tokens == 0) {
+            return;
+        }
+
+        const int b0 = n_past/WHISPER_KV_BLOCK;
+        const int b1 = (n_past + n_tokens + WHISPER_KV_BLOCK - 1)/WHISPER_KV_BLOCK;
+        for (int b = b0; b < b1; ++b) {
+            // only the positions in [n_past, n_past + n_tokens) of the block are new
+            kv_cache_block_ranges(hparams, cache, b, n_past + n_tokens, [&](bool is_v, size_t offs, size_t size) {
+                const size_t es    = ggml_element_size(cache.k);
+                const size_t n_pos = is_v ? size/es : size/(es*hparams.n_text_state);
+                const int    p0    = b*WHISPER_KV_BLOCK;
+
+                for (size_t i = 0; i < n_pos; ++i) {
+                    if (p0 + (int) i < n_past) {
+                        continue;
+                    }
+
+                    const size_t stride = is_v ? es : es*hparams.n_text_state;
+                    auto & ref = is_v ? ref_v[j] : ref_k[j];
+                    uint8_t * dst = (uint8_t *) (is_v ? cache.v : cache.k)->data + offs + i*stride;
+
+                    for (size_t k = 0; k < stride; ++k) {
+                        dst[k] = (uint8_t) rng();
+                        ref[offs + i*stride + k] = dst[k];
+                    }
+                }
+            });
+        }
+
+        kv_cache_blocks_write(*state, cache, n_past, n_tokens);
+        cache.n = n_past + n_tokens;
+    }
+
+    void fork(const std::vector<int> & parents) {
+        std::vector<uint8_t> new_k[N_DECODERS];
+        std::vector<uint8_t> new_v[N_DECODERS];
+        for (int j = 0; j < N_DECODERS; ++j) {
+            const int p = j < (int) parents.size() && parents[j] >= 0 ? parents[j] : j;
+            new_k[j] = ref_k[p];
+            new_v[j] = ref_v[p];
+        }
+        for (int j = 0; j < N_DECODERS; ++j) {
+            ref_k[j].swap(new_k[j]);
+            ref_v[j].swap(new_v[j]);
+        }
+
+        kv_cache_fork(ctx, *state, parents, kv_buf);
+    }
+
+    // the first n positions of every decoder must match the reference
+    void check(const char * name) {
+        const auto & hparams = ctx.model.hparams;
+
+        for (int j = 0; j < N_DECODERS; ++j) {
+            const auto & cache = state->decoders[j].kv_self;
+
+            bool ok = true;
+            for (int b = 0; b*WHISPER_KV_BLOCK < cache.n; ++b) {
+                kv_cache_block_ranges(hparams, cache, b, cache.n, [&](bool is_v, size_t offs, size_t size) {
+                    const uint8_t * data = (const uint8_t *) (is_v ? cache.v : cache.k)->data + offs;
+                    const uint8_t * ref  = (is_v ? ref_v[j] : ref_k[j]).data() + offs;
+                    ok = ok && memcmp(data, ref, size) == 0;
+                });
+            }
+
+            if (!ok) {
+                fprintf(stderr, "%s: decoder %d differs from the full copy (n = %d)\n", name, j, cache.n);
+                n_fail++;
+            }
+        }
+    }
+};
+
+// all decoders share a prompt that ends in a partial block, then diverge by a few tokens each
+void prepare(fork_test & t, int n_prompt) {
+    t.write(0, n_prompt);
+    t.fork({ -1, 0, 0, 0 });
+    for (int j = 0; j < N_DECODERS; ++j) {
+        t.write(j, 1 + j*7);
+    }
+}
+
+int test_forks() {
+    struct test_case {
+        const char * name;
+        std::vector<int> parents;
+    };
+
+    const test_case cases[] = {
+        { "swap",          { 1, 0, -1, -1 } },
+        { "cycle",         { 2, 0, 1, -1 } },
+        { "chain",         { -1, 0, 1, 2 } },
+        { "all from last", { 3, 3, 3, -1 } },
+        { "identity",      { 0, 1, 2, 3 } },
+    };
+
+    int n_fail = 0;
+
+    for (const auto & c : cases) {
+        for (int n_prompt : { 5, WHISPER_KV_BLOCK, 2*WHISPER_KV_BLOCK + 3 }) {
+            fork_test t;
+            prepare(t, n_prompt);
+            t.check(c.name);
+
+            t.fork(c.parents);
+            t.check(c.name);
+
+            // writing after the fork must not change the decoders that share the blocks
+            for (int j = 0; j < N_DECODERS; ++j) {
+                t.write(j, 3);
+            }
+            t.check(c.name);
+
+            n_fail += t.n_fail;
+        }
+    }
+
+    return n_fail;
+}
+
+// random parents and token counts, including decoders that are parents and children in one fork
+int test_random() {
+    fork_test t;
+    prepare(t, 9);
+
+    std::mt19937 rng(7);
+
+    for (int it = 0; it < 200 && t.n_fail == 0; ++it) {
+        std::vector<int> parents(N_DECODERS);
+        for (int j = 0; j < N_DECODERS; ++j) {
+            parents[j] = (int) (rng() % (N_DECODERS + 1)) - 1;
+        }
+        t.fork(parents);
+        t.check("random fork");
+
+        for (int j = 0; j < N_DECODERS; ++j) {
+            auto & cache = t.state->decoders[j].kv_self;
+            const int n_tokens = rng() % 4;
+            if (cache.n + n_tokens > t.ctx.model.hparams.n_text_ctx) {
+                // restart the sequences, as a new window does
+                for (int i = 0; i < N_DECODERS; ++i) {
+                    t.state->decoders[i].kv_self.n = 0;
+                    kv_cache_blocks_reset(t.state->decoders[i].kv_self);
+                }
+                prepare(t, 1 + rng() % 40);
+                break;
+            }
+            t.write(j, n_tokens);
+        }
+        t.check("random write");
+    }
+
+    return t.n_fail;
+}
+
+// whisper_state_reset() restarts the block ids of a pooled state
+int test_reset() {
+    fork_test t;
+    prepare(t, 20);
+
+    WHISPER_ASSERT(t.state->kv_block_id > 0);
+    whisper_state_reset(t.state);
+
+    int n_fail = 0;
+    if (t.state->kv_block_id != 0 || t.state->n_kv_block_cp != 0) {
+        fprintf(stderr, "reset: kv_block_id = %d, n_kv_block_cp = %lld\n", t.state->kv_block_id, (long long) t.state->n_kv_block_cp);
+        n_fail++;
+    }
+    for (int j = 0; j < N_DECODERS; ++j) {
+        for (int32_t id : t.state->decoders[j].kv_self.blocks) {
+            if (id >= 0) {
+                fprintf(stderr, "reset: decoder %d keeps block id %d\n", j, id);
+                n_fail++;
+                break;
+            }
+        }
+    }
+
+    return n_fail;
+}
+
+} // namespace
+
+int main() {
+    const int n_fail = test_forks() + test_random() + test_reset();
+
+    if (n_fail > 0) {
+        fprintf(stderr, "kv_cache_fork_test: %d failures\n", n_fail);
+        return 1;
+    }
+
+    printf("kv_cache_fork_test: OK\n");
+    return 0;
+}
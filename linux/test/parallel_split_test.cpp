@@ -0,0 +1,147 @@
+// Checks the split points chosen by whisper_full_parallel() (whisper_parallel_splits()): they
+// stay inside the audio, never make a chunk negative, and land in quiet regions when there is room.
+//
+// The functions under test are internal to whisper.cpp, so the translation unit is included
+// directly. No model is needed. The samples are placed between two inaccessible pages, so a read
+// outside of the audio crashes the test instead of passing unnoticed.
+
+#include "../whisper.cpp/whisper.cpp"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace {
+
+// n_samples floats that end right before an inaccessible page, with another one in front
+struct guarded_samples {
+    float * data = nullptr;
+
+    void * base = nullptr;
+    size_t size = 0;
+
+    explicit guarded_samples(int n_samples) {
+        const size_t page    = sysconf(_SC_PAGESIZE);
+        const size_t n_bytes = ((n_samples*sizeof(float) + page - 1)/page)*page;
+
+        size = n_bytes + 2*page;
+        base = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        WHISPER_ASSERT(base != MAP_FAILED);
+        WHISPER_ASSERT(mprotect((uint8_t *) base + page, n_bytes, PROT_READ | PROT_WRITE) == 0);
+
+        data = (float *) ((uint8_t *) base + page + n_bytes) - n_samples;
+    }
+
+    ~guarded_samples() {
+        munmap(base, size);
+    }
+};
+
+// noise with digital silence in [quiet0, quiet1)
+void fill(float * samples, int n_samples, int quiet0, int quiet1, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+    for (int i = 0; i < n_samples; ++i) {
+        samples[i] = i >= quiet0 && i < quiet1 ? 0.0f : dist(rng);
+    }
+}
+
+int check(const char * name, const std::vector<int> & split, int n_samples, int offset_samples, int n_processors) {
+    int n_fail = 0;
+
+    if ((int) split.size() != n_processors + 1 || split.back() != n_samples) {
+        fprintf(stderr, "%s: %zu splits, last %d, expected %d and %d\n", name, split.size(), split.back(), n_processors + 1, n_samples);
+        return 1;
+    }
+
+    if (split[0] != std::max(0, std::min(offset_samples, n_samples))) {
+        fprintf(stderr, "%s: first split %d for offset %d\n", name, split[0], offset_samples);
+        n_fail++;
+    }
+
+    for (int i = 1; i <= n_processors; ++i) {
+        if (split[i] < split[i - 1] || split[i] > n_samples) {
+            fprintf(stderr, "%s: n_samples = %d, n_processors = %d: split %d = %d after %d\n", name, n_samples, n_processors, i, split[i], split[i - 1]);
+            n_fail++;
+        }
+    }
+
+    return n_fail;
+}
+
+// short inputs with many processors, where a chunk is shorter than the search radius
+int test_bounds() {
+    std::mt19937 rng(1);
+
+    int n_fail = 0;
+
+    for (int n_samples : { 0, 1, 100, 3200, 8000, 16000, 48000, 100000 }) {
+        guarded_samples samples(n_samples);
+
+        for (int n_processors = 2; n_processors <= 16; ++n_processors) {
+            for (int offset_samples : { 0, 1000, n_samples/2, n_samples + 1000 }) {
+                // quiet stretches at the start, the end and in between move the splits around
+                for (int quiet0 : { 0, n_samples/3, (n_samples*13)/24, n_samples - 3200 }) {
+                    fill(samples.data, n_samples, quiet0, quiet0 + 3200, rng);
+
+                    const auto split = whisper_parallel_splits(samples.data, n_samples, offset_samples, n_processors);
+                    n_fail += check("bounds", split, n_samples, offset_samples, n_processors);
+                }
+            }
+        }
+    }
+
+    return n_fail;
+}
+
+// 48000 samples on 4 processors with a quiet spot near 2.6 s: the second split must not move past
+// the third nominal one
+int test_late_quiet() {
+    std::mt19937 rng(2);
+
+    const int n_samples = 48000;
+    guarded_samples samples(n_samples);
+    fill(samples.data, n_samples, 41000, 43000, rng);
+
+    const auto split = whisper_parallel_splits(samples.data, n_samples, 0, 4);
+    return check("late quiet", split, n_samples, 0, 4);
+}
+
+// with room to search, the split lands in the silence closest to the nominal cut
+int test_quiet() {
+    std::mt19937 rng(3);
+
+    const int n_samples = 60*WHISPER_SAMPLE_RATE;
+    guarded_samples samples(n_samples);
+
+    // silence from 31.0 s to 31.5 s, the nominal cut is at 30 s
+    const int quiet0 = 31*WHISPER_SAMPLE_RATE;
+    const int quiet1 = quiet0 + WHISPER_SAMPLE_RATE/2;
+    fill(samples.data, n_samples, quiet0, quiet1, rng);
+
+    const auto split = whisper_parallel_splits(samples.data, n_samples, 0, 2);
+
+    int n_fail = check("quiet", split, n_samples, 0, 2);
+    if (split[1] < quiet0 || split[1] >= quiet1) {
+        fprintf(stderr, "quiet: split at %d, outside of the silence [%d, %d)\n", split[1], quiet0, quiet1);
+        n_fail++;
+    }
+
+    return n_fail;
+}
+
+} // namespace
+
+int main() {
+    const int n_fail = test_bounds() + test_late_quiet() + test_quiet();
+
+    if (n_fail > 0) {
+        fprintf(stderr, "parallel_split_test: %d failures\n", n_fail);
+        return 1;
+    }
+
+    printf("parallel_split_test: OK\n");
+    return 0;
+}
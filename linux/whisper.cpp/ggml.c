@@ -86,6 +86,53 @@ static int sched_yield (void) {
     Sleep (0);
     return 0;
 }
+
+typedef SRWLOCK pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+#define PTHREAD_MUTEX_INITIALIZER SRWLOCK_INIT
+#define PTHREAD_COND_INITIALIZER  CONDITION_VARIABLE_INIT
+
+static int pthread_mutex_init(pthread_mutex_t* mutex, void* unused) {
+    (void) unused;
+    InitializeSRWLock(mutex);
+    return 0;
+}
+
+static int pthread_mutex_destroy(pthread_mutex_t* mutex) {
+    (void) mutex;
+    return 0;
+}
+
+static int pthread_mutex_lock(pthread_mutex_t* mutex) {
+    AcquireSRWLockExclusive(mutex);
+    return 0;
+}
+
+static int pthread_mutex_unlock(pthread_mutex_t* mutex) {
+    ReleaseSRWLockExclusive(mutex);
+    return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t* cond, void* unused) {
+    (void) unused;
+    InitializeConditionVariable(cond);
+    return 0;
+}
+
+static int pthread_cond_destroy(pthread_cond_t* cond) {
+    (void) cond;
+    return 0;
+}
+
+static int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+    return SleepConditionVariableSRW(cond, mutex, INFINITE, 0) ? 0 : EINVAL;
+}
+
+static int pthread_cond_broadcast(pthread_cond_t* cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
 #else
 #include <pthread.h>
 #include <stdatomic.h>
@@ -16300,6 +16347,97 @@ void set_numa_thread_affinity(int thread_n, int n_threads) { UNUSED(thread_n); U
 void clear_numa_thread_affinity(void) {}
 #endif
 
+//
+// waiting for another thread
+//
+// a waiting thread spins and yields for up to GGML_SPIN_US microseconds, which covers the time
+// between two graph nodes, and then sleeps on a condition variable so that idle threads do not
+// burn a core
+//
+
+#ifndef GGML_SPIN_US
+#define GGML_SPIN_US 200
+#endif
+
+#if defined(__x86_64__) || (defined(_MSC_VER) && defined(_M_AMD64))
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+#include <emmintrin.h> // _mm_pause is SSE2, which every x86_64 target has
+#endif
+#define ggml_cpu_relax() _mm_pause()
+#elif defined(__aarch64__) && defined(__GNUC__)
+#define ggml_cpu_relax() __asm__ __volatile__("yield")
+#else
+#define ggml_cpu_relax() ((void) 0)
+#endif
+
+struct ggml_wait {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    atomic_int      n_sleeping;
+};
+
+static void ggml_wait_init(struct ggml_wait * wait) {
+    pthread_mutex_init(&wait->mutex, NULL);
+    pthread_cond_init(&wait->cond, NULL);
+    atomic_store(&wait->n_sleeping, 0);
+}
+
+static void ggml_wait_free(struct ggml_wait * wait) {
+    pthread_cond_destroy(&wait->cond);
+    pthread_mutex_destroy(&wait->mutex);
+}
+
+// block until *value != last and return the new value
+static int ggml_wait_for_change(struct ggml_wait * wait, atomic_int * value, int last) {
+    int cur = atomic_load(value);
+    if (cur != last) {
+        return cur;
+    }
+
+    // pause briefly, then yield so that the thread being waited for can run when the cores
+    // are oversubscribed
+    const int64_t t_start = ggml_time_us();
+    for (int i = 1; ; ++i) {
+        if (i < 64) {
+            ggml_cpu_relax();
+        } else {
+            sched_yield();
+        }
+
+        cur = atomic_load(value);
+        if (cur != last) {
+            return cur;
+        }
+
+        if (i % 64 == 0 && ggml_time_us() - t_start > GGML_SPIN_US) {
+            break;
+        }
+    }
+
+    // the sleeper count is raised before the value is checked again, and ggml_wait_store
+    // stores the value before it reads the count, so a wake-up cannot be missed
+    pthread_mutex_lock(&wait->mutex);
+    atomic_fetch_add(&wait->n_sleeping, 1);
+    while ((cur = atomic_load(value)) == last) {
+        pthread_cond_wait(&wait->cond, &wait->mutex);
+    }
+    atomic_fetch_sub(&wait->n_sleeping, 1);
+    pthread_mutex_unlock(&wait->mutex);
+
+    return cur;
+}
+
+// store a new value and wake up the threads sleeping on it
+static void ggml_wait_store(struct ggml_wait * wait, atomic_int * value, int new_value) {
+    atomic_store(value, new_value);
+
+    if (atomic_load(&wait->n_sleeping) > 0) {
+        pthread_mutex_lock(&wait->mutex);
+        pthread_cond_broadcast(&wait->cond);
+        pthread_mutex_unlock(&wait->mutex);
+    }
+}
+
 struct ggml_compute_state_shared {
     struct ggml_cgraph * cgraph;
 
@@ -16309,12 +16447,14 @@ struct ggml_compute_state_shared {
     int n_threads;
 
     // synchronization primitives
-    atomic_int n_active; // num active threads
-    atomic_int node_n;   // active graph node
+    atomic_int n_active;   // num active threads
+    atomic_int node_n;     // active graph node
+    atomic_int n_finished; // num pool workers done with the graph
+
+    struct ggml_wait wait; // for node_n
 };
 
 struct ggml_compute_state {
-    ggml_thread_t thrd;
     int ith;
     struct ggml_compute_state_shared * shared;
 };
@@ -16393,14 +16533,10 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
             }
 
             atomic_store(&state->shared->n_active, n_threads);
-            atomic_store(&state->shared->node_n,   node_n);
+            ggml_wait_store(&state->shared->wait, &state->shared->node_n, node_n);
         } else {
             // wait for other threads to finish
-            const int last = node_n;
-            do {
-                sched_yield();
-                node_n = atomic_load(&state->shared->node_n);
-            } while (node_n == last);
+            node_n = ggml_wait_for_change(&state->shared->wait, &state->shared->node_n, node_n);
         }
 
         // check if we should stop
@@ -16425,8 +16561,214 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     return 0;
 }
 
+//
+// persistent compute threads
+//
+// ggml_graph_compute runs a graph on the calling thread plus n_threads - 1 workers taken from a
+// process-wide pool. workers are created on first use and kept for later graphs, so decoding a
+// token does not create and join threads. idle workers sleep after GGML_SPIN_US
+//
+
+struct ggml_threadpool_worker {
+    ggml_thread_t thrd;
+    int  id;
+    bool pin;
+
+    struct ggml_wait wait;
+    atomic_int       seq;           // bumped to hand over a graph
+    struct ggml_compute_state * state; // NULL stops the worker
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  released; // workers returned to the pool
+
+    int  max_workers; // 0 - no limit
+    bool pin;
+    bool draining;    // ggml_threadpool_init/free are waiting for busy workers
+
+    int n_workers;
+    int n_idle;
+    int n_alloc;
+
+    struct ggml_threadpool_worker ** workers;
+    struct ggml_threadpool_worker ** idle;
+} g_threadpool = {
+    /*.mutex       =*/ PTHREAD_MUTEX_INITIALIZER,
+    /*.released    =*/ PTHREAD_COND_INITIALIZER,
+    /*.max_workers =*/ 0,
+    /*.pin         =*/ false,
+    /*.draining    =*/ false,
+    /*.n_workers   =*/ 0,
+    /*.n_idle      =*/ 0,
+    /*.n_alloc     =*/ 0,
+    /*.workers     =*/ NULL,
+    /*.idle        =*/ NULL,
+};
+
+// pin worker id to the (id + 1)-th CPU the process may run on, leaving the first one to the caller
+static void ggml_threadpool_pin(int id) {
+#if defined(__linux__) && !defined(__BIONIC__)
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+
+    int k = (id + 1) % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed) || k-- > 0) {
+            continue;
+        }
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+
+        int rv = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (rv) {
+            fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n",
+                    strerror(rv));
+        }
+        break;
+    }
+#else
+    UNUSED(id);
+#endif
+}
+
+static thread_ret_t ggml_threadpool_worker_main(void * data) {
+    struct ggml_threadpool_worker * worker = (struct ggml_threadpool_worker *) data;
+
+    if (worker->pin) {
+        ggml_threadpool_pin(worker->id);
+    }
+
+    int seq = 0;
+    while (true) {
+        seq = ggml_wait_for_change(&worker->wait, &worker->seq, seq);
+
+        struct ggml_compute_state * state = worker->state;
+        if (state == NULL) {
+            break;
+        }
+
+        ggml_graph_compute_thread(state);
+
+        // last access to the graph's shared state, which lives on the caller's stack
+        atomic_fetch_add(&state->shared->n_finished, 1);
+    }
+
+    return 0;
+}
+
+// must be called with g_threadpool.mutex held
+static void ggml_threadpool_spawn(void) {
+    if (g_threadpool.n_workers == g_threadpool.n_alloc) {
+        g_threadpool.n_alloc = MAX(8, 2*g_threadpool.n_alloc);
+        g_threadpool.workers = realloc(g_threadpool.workers, sizeof(struct ggml_threadpool_worker *)*g_threadpool.n_alloc);
+        g_threadpool.idle    = realloc(g_threadpool.idle,    sizeof(struct ggml_threadpool_worker *)*g_threadpool.n_alloc);
+        GGML_ASSERT(g_threadpool.workers != NULL && g_threadpool.idle != NULL);
+    }
+
+    struct ggml_threadpool_worker * worker = malloc(sizeof(struct ggml_threadpool_worker));
+    GGML_ASSERT(worker != NULL);
+
+    worker->id    = g_threadpool.n_workers;
+    worker->pin   = g_threadpool.pin;
+    worker->state = NULL;
+    atomic_store(&worker->seq, 0);
+    ggml_wait_init(&worker->wait);
+
+    const int rc = ggml_thread_create(&worker->thrd, NULL, ggml_threadpool_worker_main, worker);
+    GGML_ASSERT(rc == 0);
+
+    g_threadpool.workers[g_threadpool.n_workers++] = worker;
+    g_threadpool.idle[g_threadpool.n_idle++]       = worker;
+}
+
+// take up to n idle workers, creating new ones up to the limit. returns the number taken
+static int ggml_threadpool_acquire(struct ggml_threadpool_worker ** workers, int n) {
+    pthread_mutex_lock(&g_threadpool.mutex);
+
+    if (g_threadpool.draining) {
+        n = 0;
+    }
+
+    while (g_threadpool.n_idle < n && (g_threadpool.max_workers == 0 || g_threadpool.n_workers < g_threadpool.max_workers)) {
+        ggml_threadpool_spawn();
+    }
+
+    n = MIN(n, g_threadpool.n_idle);
+    for (int i = 0; i < n; ++i) {
+        workers[i] = g_threadpool.idle[--g_threadpool.n_idle];
+    }
+
+    pthread_mutex_unlock(&g_threadpool.mutex);
+
+    return n;
+}
+
+static void ggml_threadpool_release(struct ggml_threadpool_worker ** workers, int n) {
+    pthread_mutex_lock(&g_threadpool.mutex);
+
+    for (int i = 0; i < n; ++i) {
+        g_threadpool.idle[g_threadpool.n_idle++] = workers[i];
+    }
+
+    pthread_cond_broadcast(&g_threadpool.released);
+    pthread_mutex_unlock(&g_threadpool.mutex);
+}
+
+// must be called with g_threadpool.mutex held. graphs that start meanwhile run on the calling thread only
+static void ggml_threadpool_free_locked(void) {
+    g_threadpool.draining = true;
+    while (g_threadpool.n_idle < g_threadpool.n_workers) {
+        pthread_cond_wait(&g_threadpool.released, &g_threadpool.mutex);
+    }
+    g_threadpool.draining = false;
+
+    for (int i = 0; i < g_threadpool.n_workers; ++i) {
+        struct ggml_threadpool_worker * worker = g_threadpool.workers[i];
+
+        worker->state = NULL;
+        ggml_wait_store(&worker->wait, &worker->seq, atomic_load(&worker->seq) + 1);
+
+        const int rc = ggml_thread_join(worker->thrd, NULL);
+        GGML_ASSERT(rc == 0);
+
+        ggml_wait_free(&worker->wait);
+        free(worker);
+    }
+
+    g_threadpool.n_workers = 0;
+    g_threadpool.n_idle    = 0;
+}
+
+void ggml_threadpool_init(int n_workers, bool pin) {
+    pthread_mutex_lock(&g_threadpool.mutex);
+
+    ggml_threadpool_free_locked();
+
+    g_threadpool.max_workers = MAX(0, n_workers);
+    g_threadpool.pin         = pin;
+
+    for (int i = 0; i < g_threadpool.max_workers; ++i) {
+        ggml_threadpool_spawn();
+    }
+
+    pthread_mutex_unlock(&g_threadpool.mutex);
+}
+
+void ggml_threadpool_free(void) {
+    pthread_mutex_lock(&g_threadpool.mutex);
+    ggml_threadpool_free_locked();
+    pthread_mutex_unlock(&g_threadpool.mutex);
+}
+
 void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
-    const int n_threads = cgraph->n_threads;
+    // when the pool is limited and busy, the graph runs on fewer threads
+    struct ggml_threadpool_worker ** pool = alloca(sizeof(struct ggml_threadpool_worker *)*MAX(1, cgraph->n_threads));
+    const int n_threads = 1 + (cgraph->n_threads > 1 ? ggml_threadpool_acquire(pool, cgraph->n_threads - 1) : 0);
 
     struct ggml_compute_state_shared state_shared = {
         /*.cgraph                  =*/ cgraph,
@@ -16435,7 +16777,11 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         /*.n_threads               =*/ n_threads,
         /*.n_active                =*/ n_threads,
         /*.node_n                  =*/ -1,
+        /*.n_finished              =*/ 0,
+        /*.wait                    =*/ { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 }, // set up by ggml_wait_init
     };
+    ggml_wait_init(&state_shared.wait);
+
     struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
 
     // initialize tasks + work buffer
@@ -16786,17 +17132,18 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         }
     }
 
-    // create thread pool
+    // hand the graph to the pool workers
     if (n_threads > 1) {
         for (int j = 1; j < n_threads; ++j) {
             workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
                 .ith = j,
                 .shared = &state_shared,
             };
 
-            const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            GGML_ASSERT(rc == 0);
+            struct ggml_threadpool_worker * worker = pool[j - 1];
+
+            worker->state = &workers[j];
+            ggml_wait_store(&worker->wait, &worker->seq, atomic_load(&worker->seq) + 1);
         }
     }
     workers[0].ith = 0;
@@ -16811,14 +17158,17 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
-    // join thread pool
+    // wait until the workers are done with state_shared and return them to the pool
     if (n_threads > 1) {
-        for (int j = 1; j < n_threads; j++) {
-            const int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
+        while (atomic_load(&state_shared.n_finished) < n_threads - 1) {
+            sched_yield();
         }
+
+        ggml_threadpool_release(pool, n_threads - 1);
     }
 
+    ggml_wait_free(&state_shared.wait);
+
     // performance stats (graph)
     {
         int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
@@ -1298,6 +1298,14 @@ extern "C" {
     GGML_API struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep);
 
     GGML_API void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
+
+    // ggml_graph_compute runs on the calling thread plus workers from a process-wide pool, which
+    // are created on first use. this creates n_workers workers up front and limits the pool to
+    // them (0 - no limit); a graph that finds all workers busy runs on fewer threads
+    // pin: bind each worker to its own CPU
+    // both functions wait for graphs that are being computed to release their workers
+    GGML_API void ggml_threadpool_init(int n_workers, bool pin);
+    GGML_API void ggml_threadpool_free(void);
     GGML_API void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
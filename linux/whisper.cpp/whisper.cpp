@@ -16,14 +16,36 @@
 #include <cstdio>
 #include <cstdarg>
 #include <cstring>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
 #include <regex>
 #include <random>
 
+// model files are memory-mapped where available, see whisper_init_from_file_no_state()
+#if !defined(WHISPER_NO_MMAP) && !defined(GGML_BIG_ENDIAN) && (defined(__unix__) || defined(__APPLE__))
+#define WHISPER_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// SIMD for the per-token passes over the logits, see whisper_process_logits()
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
@@ -114,9 +136,32 @@ static void byteswap_tensor(ggml_tensor * tensor) {
 //#define WHISPER_USE_FLASH_FF
 #define WHISPER_MAX_DECODERS 16
 
+// number of positions per block of the self-attention KV caches, see kv_cache_fork()
+#define WHISPER_KV_BLOCK 16
+
+// maximum number of windows evaluated in one encoder graph, see whisper_encode_batch_internal()
+// the state that evaluates the batch grows its buffers by about 23 activations per additional window
+#define WHISPER_ENCODE_BATCH_MAX 4
+
 #define WHISPER_USE_SCRATCH
 #define WHISPER_MAX_SCRATCH_BUFFERS 16
 
+// tensors whose data starts at a multiple of this offset in a memory-mapped model file are used in
+// place, the others are copied. whisper_model_align() writes files in which all tensors are aligned
+#define WHISPER_MMAP_ALIGN 32
+
+// automatic audio_ctx (params.audio_ctx = -1): encoder positions kept after the end of the audio,
+// the granularity of the context size and its minimum
+#define WHISPER_AUDIO_CTX_MARGIN 50
+#define WHISPER_AUDIO_CTX_STEP   64
+#define WHISPER_AUDIO_CTX_MIN    256
+
+// whisper_full_parallel: distance from the nominal cut searched for a quiet split point,
+// length of the quiet stretch looked for, and audio decoded past the split by each chunk
+#define WHISPER_PARALLEL_SEARCH_MS  2000
+#define WHISPER_PARALLEL_QUIET_MS   200
+#define WHISPER_PARALLEL_OVERLAP_MS 1000
+
 // available whisper models
 enum e_model {
     MODEL_UNKNOWN,
@@ -367,6 +412,24 @@ struct whisper_mel {
     int n_mel;
 
     std::vector<float> data;
+
+    // lazy spectrogram (whisper_full): frames are computed from the input samples when a window
+    // is encoded, and the frames [ring_begin, ring_end) are kept time-major in a ring buffer of
+    // n_ring frames. the values are log10 energies, normalized per window when they are encoded
+    bool lazy = false;
+
+    const float * samples = nullptr;
+    int n_samples = 0;
+    int fft_step  = 0;
+    bool speed_up = false;
+
+    const struct whisper_fft_plan * fft_plan = nullptr;
+
+    std::vector<float> ring;
+
+    int n_ring     = 0;
+    int ring_begin = 0;
+    int ring_end   = 0;
 };
 
 struct whisper_filters {
@@ -374,6 +437,13 @@ struct whisper_filters {
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // the non-zero bins of each filter, computed at load time
+    // filter j covers bins [start[j], start[j] + len[j]) with weights starting at weights[offset[j]]
+    std::vector<int32_t> start;
+    std::vector<int32_t> len;
+    std::vector<int32_t> offset;
+    std::vector<float>   weights;
 };
 
 struct whisper_vocab {
@@ -398,6 +468,12 @@ struct whisper_vocab {
     id token_not        = 50362; // no timestamps
     id token_beg        = 50363; // begin timestamps
 
+    // looked up once after loading, see whisper_vocab_init_suppress()
+    id token_space = -1; // " ", -1 if the vocab has no such token
+
+    // ids suppressed by params.suppress_non_speech_tokens
+    std::vector<id> token_non_speech;
+
     bool is_multilingual() const {
         return n_vocab == 51865;
     }
@@ -539,6 +615,17 @@ struct whisper_kv_cache {
     std::vector<uint8_t> buf;
 
     int n; // number of tokens currently in the cache
+
+    // self-attention: id of the content of each block of WHISPER_KV_BLOCK positions, -1 if unknown
+    std::vector<int32_t> blocks;
+};
+
+// read-only mapping of a model file
+struct whisper_mmap {
+    const uint8_t * addr = nullptr;
+
+    size_t size = 0;
+    size_t pos  = 0; // read position of the model loader
 };
 
 struct whisper_model {
@@ -581,6 +668,11 @@ struct whisper_model {
     // the model memory buffer is read-only and can be shared between processors
     std::vector<uint8_t> * buf;
 
+    // the model file, when it is memory-mapped. buf then only holds the tensor objects, the tensors
+    // that are aligned in the file point into the mapping and the others are copied to buf_copy
+    whisper_mmap * mapping = nullptr;
+    std::vector<uint8_t> buf_copy;
+
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
@@ -618,7 +710,6 @@ struct whisper_decoder {
     std::vector<float> logits;
     std::vector<float> logprobs;
 
-    std::vector<whisper_token> tokens_tmp; // used for whisper_decode calls
 };
 
 struct whisper_state {
@@ -633,6 +724,15 @@ struct whisper_state {
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
 
+    int64_t n_encode_ctx = 0; // number of encoder positions evaluated, over all encoder calls
+    int32_t n_fail_ctx   = 0; // number of windows decoded again with the full audio context
+
+    int32_t n_encode_ahead      = 0; // number of windows encoded ahead
+    int32_t n_encode_ahead_used = 0; // number of those that were used
+
+    int32_t kv_block_id   = 0; // next id for the blocks of the self-attention KV caches
+    int64_t n_kv_block_cp = 0; // number of blocks copied between self-attention KV caches
+
     // cross-attention KV cache for the decoders
     // shared between all decoders
     whisper_kv_cache kv_cross;
@@ -660,6 +760,11 @@ struct whisper_state {
 
     int lang_id = 0; // english by default
 
+    int seek = 0; // audio offset (in 10 ms frames) where the last whisper_full call stopped
+
+    // encodes the next window while this state decodes the current one (n_threads_ahead > 0)
+    whisper_state * state_ahead = nullptr;
+
     std::string path_model; // populated by whisper_init_from_file()
 #ifdef WHISPER_USE_COREML
     whisper_coreml_context * ctx_coreml = nullptr;
@@ -710,6 +815,28 @@ struct whisper_state {
     }
 };
 
+struct whisper_encode_step;
+struct whisper_decode_step;
+
+// batches the encoder and decoder steps of the states that run concurrently on a context
+// see whisper_set_encode_batching(), whisper_set_decode_batching(), whisper_encode_sched_step()
+// and whisper_decode_sched_step()
+struct whisper_sched {
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    int  encode_wait_us = 0;     // 0 - batching is disabled
+    int  n_active       = 0;     // states in whisper_full_with_state() with encode batching
+    bool encode_busy    = false; // an encoder batch is being evaluated
+
+    int  decode_wait_us = 0;     // 0 - batching is disabled
+    int  n_decoding     = 0;     // states in their token loop
+    bool decode_busy    = false; // a decoder batch is being evaluated
+
+    std::vector<whisper_encode_step *> encode_pending;
+    std::vector<whisper_decode_step *> decode_pending;
+};
+
 struct whisper_context {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
@@ -721,6 +848,12 @@ struct whisper_context {
     whisper_vocab vocab;
     whisper_state * state = nullptr;
 
+    // idle states, see whisper_state_acquire()
+    std::mutex state_pool_mutex;
+    std::vector<whisper_state *> state_pool;
+
+    whisper_sched sched;
+
     std::string path_model; // populated by whisper_init_from_file()
 };
 
@@ -745,6 +878,117 @@ static void read_safe(whisper_model_loader * loader, T & dest) {
     BYTESWAP_VALUE(dest);
 }
 
+static whisper_mmap * whisper_mmap_open(const char * path) {
+#ifdef WHISPER_USE_MMAP
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    // shared with the page cache: all processes that map the same model use one copy of the weights,
+    // and the pages are only read from disk when they are first used
+    void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        log("%s: mmap of '%s' failed\n", __func__, path);
+        return nullptr;
+    }
+
+    whisper_mmap * mapping = new whisper_mmap;
+
+    mapping->addr = (const uint8_t *) addr;
+    mapping->size = st.st_size;
+
+    return mapping;
+#else
+    (void) path;
+    return nullptr;
+#endif
+}
+
+static void whisper_mmap_free(whisper_mmap * mapping) {
+    if (mapping == nullptr) {
+        return;
+    }
+
+#ifdef WHISPER_USE_MMAP
+    munmap((void *) mapping->addr, mapping->size);
+#endif
+
+    delete mapping;
+}
+
+// the pages in [pos0, pos1) are no longer needed by this process, e.g. because the data was copied
+static void whisper_mmap_drop(const whisper_mmap & mapping, size_t pos0, size_t pos1) {
+#ifdef WHISPER_USE_MMAP
+    const size_t page = sysconf(_SC_PAGESIZE);
+
+    pos0 = ((pos0 + page - 1)/page)*page;
+    pos1 = (pos1/page)*page;
+
+    if (pos0 < pos1) {
+        madvise((void *) (mapping.addr + pos0), pos1 - pos0, MADV_DONTNEED);
+    }
+#else
+    (void) mapping;
+    (void) pos0;
+    (void) pos1;
+#endif
+}
+
+// walk the tensor headers of a mapped model file from the current read position, without moving it
+// returns the number of tensors. n_copy is set to the memory needed for the tensors that are not aligned
+static int whisper_mmap_scan(const whisper_mmap & mapping, size_t & n_copy) {
+    size_t pos = mapping.pos;
+
+    int n_tensors = 0;
+
+    n_copy = 0;
+
+    while (pos + 3*sizeof(int32_t) <= mapping.size) {
+        int32_t header[3]; // n_dims, length, ttype
+        memcpy(header, mapping.addr + pos, sizeof(header));
+        pos += sizeof(header);
+
+        const int32_t n_dims = header[0];
+        const int32_t length = header[1];
+        const int32_t ttype  = header[2];
+
+        if (n_dims < 1 || n_dims > 4 || length < 0 || ttype < 0 || ttype >= GGML_TYPE_COUNT ||
+            ggml_blck_size(ggml_type(ttype)) == 0 || pos + n_dims*sizeof(int32_t) + length > mapping.size) {
+            break;
+        }
+
+        int64_t nelements = 1;
+        for (int i = 0; i < n_dims; ++i) {
+            int32_t ne;
+            memcpy(&ne, mapping.addr + pos, sizeof(ne));
+            pos += sizeof(ne);
+            nelements *= ne;
+        }
+
+        pos += length;
+
+        const size_t nbytes = (nelements*ggml_type_size(ggml_type(ttype)))/ggml_blck_size(ggml_type(ttype));
+
+        if (pos % WHISPER_MMAP_ALIGN != 0) {
+            n_copy += nbytes + WHISPER_MMAP_ALIGN;
+        }
+
+        pos += nbytes;
+        n_tensors++;
+    }
+
+    return n_tensors;
+}
+
 static bool kv_cache_init(
         const struct whisper_hparams & hparams,
         const size_t   mem_bytes,
@@ -815,6 +1059,214 @@ static void kv_cache_free(struct whisper_kv_cache & cache) {
     }
 }
 
+// paged self-attention KV caches
+//
+// the keys and values of each decoder stay in one contiguous buffer, which the attention reads
+// with strided views, but the positions are grouped in blocks of WHISPER_KV_BLOCK. each block is
+// tagged with the id of its content: decoders that have the same id for a block hold the same keys
+// and values in it, e.g. the prompt or the common history of two beams. a decoder that writes to a
+// block gets a new id if the block is shared, and forking a decoder copies only the blocks whose
+// ids differ from its parent, instead of the whole cache
+
+static void kv_cache_blocks_reset(struct whisper_kv_cache & cache) {
+    std::fill(cache.blocks.begin(), cache.blocks.end(), -1);
+}
+
+// positions [n_past, n_past + n_tokens) of the cache of a decoder of wstate have been written
+static void kv_cache_blocks_write(struct whisper_state & wstate, struct whisper_kv_cache & cache, int n_past, int n_tokens) {
+    const int b0 = n_past/WHISPER_KV_BLOCK;
+    const int b1 = (n_past + n_tokens + WHISPER_KV_BLOCK - 1)/WHISPER_KV_BLOCK;
+
+    if ((int) cache.blocks.size() < b1) {
+        cache.blocks.resize(b1, -1);
+    }
+
+    for (int b = b0; b < b1; ++b) {
+        int32_t & id = cache.blocks[b];
+
+        bool shared = id < 0;
+        for (int j = 0; j < WHISPER_MAX_DECODERS && !shared; ++j) {
+            const auto & other = wstate.decoders[j].kv_self;
+            shared = &other != &cache && b < (int) other.blocks.size() && other.blocks[b] == id;
+        }
+
+        if (shared) {
+            id = wstate.kv_block_id++;
+        }
+    }
+}
+
+// call f(is_v, offset, size) for the byte ranges of block b, limited to the first n positions
+template<typename F>
+static void kv_cache_block_ranges(const struct whisper_hparams & hparams, const struct whisper_kv_cache & cache, int b, int n, F && f) {
+    const int n_ctx   = hparams.n_text_ctx;
+    const int n_state = hparams.n_text_state;
+    const int n_layer = hparams.n_text_layer;
+
+    const size_t es = ggml_element_size(cache.k);
+
+    const int p0 = b*WHISPER_KV_BLOCK;
+    const int np = std::min(p0 + WHISPER_KV_BLOCK, n) - p0;
+
+    if (np <= 0) {
+        return;
+    }
+
+    // k: [n_layer][n_ctx][n_state]
+    for (int il = 0; il < n_layer; ++il) {
+        f(false, ((size_t) il*n_ctx + p0)*n_state*es, (size_t) np*n_state*es);
+    }
+
+    // v: [n_layer][n_state][n_ctx]
+    for (int il = 0; il < n_layer; ++il) {
+        for (int i = 0; i < n_state; ++i) {
+            f(true, (((size_t) il*n_state + i)*n_ctx + p0)*es, (size_t) np*es);
+        }
+    }
+}
+
+static size_t kv_cache_block_size(const struct whisper_hparams & hparams, const struct whisper_kv_cache & cache) {
+    return 2*hparams.n_text_layer*hparams.n_text_state*WHISPER_KV_BLOCK*ggml_element_size(cache.k);
+}
+
+// make each decoder j of wstate with parents[j] >= 0 continue the sequence of decoder parents[j]
+// all forks are applied at once, so a decoder can be the parent of one decoder and the child of another
+static void kv_cache_fork(struct whisper_context & wctx, struct whisper_state & wstate, const std::vector<int> & parents, std::vector<uint8_t> & buf) {
+    const auto & hparams = wctx.model.hparams;
+
+    const int n_decoders = parents.size();
+
+    // blocks of parents that are themselves overwritten are saved in buf first
+    struct block_copy {
+        int dst;
+        int src;
+        int b;
+        int32_t id;
+        size_t offs; // in buf, or -1 to copy directly from src
+    };
+
+    std::vector<block_copy> copies;
+
+    size_t n_buf = 0;
+
+    for (int j = 0; j < n_decoders; ++j) {
+        const int p = parents[j];
+        if (p < 0 || p == j) {
+            continue;
+        }
+
+        const auto & src = wstate.decoders[p].kv_self;
+        const auto & dst = wstate.decoders[j].kv_self;
+
+        const bool direct = parents[p] < 0 || parents[p] == p;
+
+        for (int b = 0; b*WHISPER_KV_BLOCK < src.n; ++b) {
+            const int32_t id = b < (int) src.blocks.size() ? src.blocks[b] : -1;
+
+            if (id >= 0 && b < (int) dst.blocks.size() && dst.blocks[b] == id) {
+                continue;
+            }
+
+            copies.push_back({ j, p, b, id, direct ? (size_t) -1 : n_buf });
+
+            if (!direct) {
+                n_buf += kv_cache_block_size(hparams, src);
+            }
+        }
+    }
+
+    if (buf.size() < n_buf) {
+        buf.resize(n_buf);
+    }
+
+    for (const auto & c : copies) {
+        if (c.offs == (size_t) -1) {
+            continue;
+        }
+
+        const auto & src = wstate.decoders[c.src].kv_self;
+
+        uint8_t * out = buf.data() + c.offs;
+        kv_cache_block_ranges(hparams, src, c.b, src.n, [&](bool is_v, size_t offs, size_t size) {
+            memcpy(out, (const uint8_t *) (is_v ? src.v : src.k)->data + offs, size);
+            out += size;
+        });
+    }
+
+    for (const auto & c : copies) {
+        const auto & src = wstate.decoders[c.src].kv_self;
+              auto & dst = wstate.decoders[c.dst].kv_self;
+
+        if (c.offs == (size_t) -1) {
+            kv_cache_block_ranges(hparams, src, c.b, src.n, [&](bool is_v, size_t offs, size_t size) {
+                memcpy((uint8_t *) (is_v ? dst.v : dst.k)->data + offs, (const uint8_t *) (is_v ? src.v : src.k)->data + offs, size);
+            });
+        } else {
+            const uint8_t * in = buf.data() + c.offs;
+            kv_cache_block_ranges(hparams, src, c.b, src.n, [&](bool is_v, size_t offs, size_t size) {
+                memcpy((uint8_t *) (is_v ? dst.v : dst.k)->data + offs, in, size);
+                in += size;
+            });
+        }
+
+        if ((int) dst.blocks.size() <= c.b) {
+            dst.blocks.resize(c.b + 1, -1);
+        }
+        dst.blocks[c.b] = c.id;
+    }
+
+    // the lengths are read before any is set, a parent may be a child in the same fork
+    std::vector<int> n_parent(n_decoders, 0);
+    for (int j = 0; j < n_decoders; ++j) {
+        if (parents[j] >= 0) {
+            n_parent[j] = wstate.decoders[parents[j]].kv_self.n;
+        }
+    }
+    for (int j = 0; j < n_decoders; ++j) {
+        if (parents[j] >= 0) {
+            wstate.decoders[j].kv_self.n = n_parent[j];
+        }
+    }
+
+    wstate.n_kv_block_cp += copies.size();
+}
+
+static const std::vector<std::string> non_speech_tokens = {
+        "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
+        "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
+        "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
+        "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
+};
+
+// resolve the token ids that whisper_process_logits() suppresses, so that sampling does no string lookups
+// ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+static void whisper_vocab_init_suppress(whisper_vocab & vocab) {
+    const auto find = [&vocab](const std::string & token) {
+        const auto it = vocab.token_to_id.find(token);
+        return it == vocab.token_to_id.end() ? -1 : it->second;
+    };
+
+    vocab.token_space = find(" ");
+
+    vocab.token_non_speech.clear();
+    for (const std::string & token : non_speech_tokens) {
+        for (const std::string & suppress_token : { token, " " + token }) {
+            const whisper_vocab::id id = find(suppress_token);
+            if (id >= 0) {
+                vocab.token_non_speech.push_back(id);
+            }
+        }
+    }
+
+    // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+    for (const char * suppress_token : { " -", " '" }) {
+        const whisper_vocab::id id = find(suppress_token);
+        if (id >= 0) {
+            vocab.token_non_speech.push_back(id);
+        }
+    }
+}
+
 // load the model from a ggml file
 //
 // file format:
@@ -826,6 +1278,32 @@ static void kv_cache_free(struct whisper_kv_cache & cache) {
 //
 // see the convert-pt-to-ggml.py script for details
 //
+// each triangular mel filter is non-zero over a few bins only, so only that span is kept
+static void whisper_filters_sparsify(whisper_filters & filters) {
+    filters.start.resize(filters.n_mel);
+    filters.len.resize(filters.n_mel);
+    filters.offset.resize(filters.n_mel);
+    filters.weights.clear();
+
+    for (int j = 0; j < filters.n_mel; ++j) {
+        const float * row = filters.data.data() + (size_t) j*filters.n_fft;
+
+        int k0 = 0;
+        int k1 = filters.n_fft;
+        while (k0 < k1 && row[k0] == 0.0f) {
+            ++k0;
+        }
+        while (k1 > k0 && row[k1 - 1] == 0.0f) {
+            --k1;
+        }
+
+        filters.start[j]  = k0;
+        filters.len[j]    = k1 - k0;
+        filters.offset[j] = filters.weights.size();
+        filters.weights.insert(filters.weights.end(), row + k0, row + k1);
+    }
+}
+
 static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
     log("%s: loading model\n", __func__);
 
@@ -936,7 +1414,6 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         // always have at least one decoder
 
         wctx.model.buf = new std::vector<uint8_t>();
-        wctx.model.buf->resize(scale*MEM_REQ_MODEL.at(wctx.wtype).at(model.type));
 
         // we skip initialization of the state until it is needed
         // because it might be that state will always be provided externally.
@@ -952,6 +1429,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         filters.data.resize(filters.n_mel * filters.n_fft);
         loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
         BYTESWAP_FILTERS(filters);
+
+        whisper_filters_sparsify(filters);
     }
 
     // load vocab
@@ -1029,6 +1508,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 vocab.id_to_token[i] = word;
             }
         }
+
+        whisper_vocab_init_suppress(vocab);
     }
 
     size_t ctx_size = 0;
@@ -1146,12 +1627,31 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         log("%s: model ctx     = %7.2f MB\n", __func__, ctx_size/(1024.0*1024.0));
     }
 
+    // the tensor data of a memory-mapped model is not allocated in the ggml context
+    size_t n_copy = 0;
+    const bool use_mapping = model.mapping && whisper_mmap_scan(*model.mapping, n_copy) > 0;
+
+    uint8_t * copy_cur = nullptr;
+
+    if (use_mapping) {
+        const size_t n_tensors = 15 + 15*model.hparams.n_audio_layer + 24*model.hparams.n_text_layer;
+
+        wctx.model.buf->resize(n_tensors*ggml_tensor_overhead());
+        wctx.model.buf_copy.resize(n_copy);
+
+        copy_cur = wctx.model.buf_copy.data();
+    } else {
+        const size_t scale = model.hparams.ftype ? 1 : 2;
+
+        wctx.model.buf->resize(scale*MEM_REQ_MODEL.at(wctx.wtype).at(model.type));
+    }
+
     // create the ggml context
     {
         struct ggml_init_params params = {
                 /*.mem_size   =*/ wctx.model.buf->size(),
                 /*.mem_buffer =*/ wctx.model.buf->data(),
-                /*.no_alloc   =*/ false,
+                /*.no_alloc   =*/ use_mapping,
         };
 
         model.ctx = ggml_init(params);
@@ -1359,7 +1859,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
     // load weights
     {
-        size_t total_size = 0;
+        size_t total_size  = 0;
+        size_t mapped_size = 0;
 
         model.n_loaded = 0;
 
@@ -1388,6 +1889,9 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
             name.assign(&tmp[0], tmp.size());
 
+            // whisper_model_align() pads the names with zeros
+            name.erase(std::find(name.begin(), name.end(), '\0'), name.end());
+
             if (model.tensors.find(name) == model.tensors.end()) {
                 log("%s: unknown tensor '%s' in model file\n", __func__, name.data());
                 return false;
@@ -1415,8 +1919,31 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 return false;
             }
 
-            loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
-            BYTESWAP_TENSOR(tensor);
+            if (use_mapping) {
+                auto & mapping = *model.mapping;
+
+                if (mapping.pos + ggml_nbytes(tensor) > mapping.size) {
+                    log("%s: tensor '%s' is truncated in model file\n", __func__, name.data());
+                    return false;
+                }
+
+                if (mapping.pos % WHISPER_MMAP_ALIGN == 0) {
+                    tensor->data = (void *) (mapping.addr + mapping.pos);
+                    mapping.pos += ggml_nbytes(tensor);
+                    mapped_size += ggml_nbytes(tensor);
+                } else {
+                    copy_cur = (uint8_t *) ((((uintptr_t) copy_cur) + WHISPER_MMAP_ALIGN - 1) & ~((uintptr_t) WHISPER_MMAP_ALIGN - 1));
+                    tensor->data = copy_cur;
+                    copy_cur += ggml_nbytes(tensor);
+
+                    loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+
+                    whisper_mmap_drop(mapping, mapping.pos - ggml_nbytes(tensor), mapping.pos);
+                }
+            } else {
+                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                BYTESWAP_TENSOR(tensor);
+            }
 
             //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name((ggml_type) ttype), ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += ggml_nbytes(tensor);
@@ -1425,6 +1952,16 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
         log("%s: model size    = %7.2f MB\n", __func__, total_size/1024.0/1024.0);
 
+        if (use_mapping) {
+            log("%s: mapped        = %7.2f MB, copied %7.2f MB\n", __func__, mapped_size/1024.0/1024.0, (total_size - mapped_size)/1024.0/1024.0);
+        }
+
+        // nothing is used in place (e.g. a model file that was not written by whisper_model_align())
+        if (model.mapping && mapped_size == 0) {
+            whisper_mmap_free(model.mapping);
+            model.mapping = nullptr;
+        }
+
         if (model.n_loaded == 0) {
             log("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
         } else if (model.n_loaded != (int) model.tensors.size()) {
@@ -1438,55 +1975,54 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     return true;
 }
 
-// evaluate the encoder with the given state
-//
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
-//
-//   - wctx:      the model
-//   - wstate:     the state of the encoder
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
-//
-static bool whisper_encode_internal(
+static void log_mel_spectrogram_window(whisper_state & wstate, const whisper_filters & filters, int i0, int i1, int n_threads);
+
+// copy the normalized spectrogram of the window at mel_offset to dst [n_mels][2*n_ctx]
+static bool whisper_encode_mel(
         whisper_context & wctx,
         whisper_state & wstate,
         const int   mel_offset,
-        const int   n_threads){
-
-    const int64_t t_start_us = ggml_time_us();
-
+        const int   n_ctx,
+        const int   n_threads,
+        float * dst) {
     const auto & model   = wctx.model;
     const auto & mel_inp = wstate.mel;
-    const auto & hparams = model.hparams;
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state;
-    const int n_head  = hparams.n_audio_head;
-    const int n_layer = hparams.n_audio_layer;
+    const int n_mels = model.hparams.n_mels;
 
-    const int n_mels = hparams.n_mels;
-    assert(mel_inp.n_mel == n_mels);
+    memset(dst, 0, (size_t) n_mels*2*n_ctx*sizeof(float));
 
-    struct ggml_init_params params = {
-            /*.mem_size   =*/ wstate.buf_compute.size(),
-            /*.mem_buffer =*/ wstate.buf_compute.data(),
-            /*.no_alloc   =*/ false,
-    };
+    const int i0 = std::min(mel_offset, mel_inp.n_len);
+    const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    if (mel_inp.lazy) {
+        if (mel_inp.samples == nullptr) {
+            log("%s: the spectrogram of the last whisper_full call is no longer available\n", __func__);
+            return false;
+        }
 
-    wstate.use_buf(ctx0, 0);
+        log_mel_spectrogram_window(wstate, model.filters, i0, i1, n_threads);
 
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    assert(mel->type == GGML_TYPE_F32);
-    {
-        float * dst = (float *) mel->data;
-        memset(dst, 0, ggml_nbytes(mel));
+        // clamping and normalization over the window
+        const int n_ring = mel_inp.n_ring;
+
+        float mmax = -1e20f;
+        for (int i = i0; i < i1; ++i) {
+            const float * src = mel_inp.ring.data() + (size_t) (i % n_ring)*n_mels;
+            for (int j = 0; j < n_mels; ++j) {
+                mmax = std::max(mmax, src[j]);
+            }
+        }
 
-        const int i0 = std::min(mel_offset, mel_inp.n_len);
-        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+        mmax -= 8.0f;
 
+        for (int i = i0; i < i1; ++i) {
+            const float * src = mel_inp.ring.data() + (size_t) (i % n_ring)*n_mels;
+            for (int j = 0; j < n_mels; ++j) {
+                dst[j*2*n_ctx + (i - i0)] = (std::max(src[j], mmax) + 4.0f)/4.0f;
+            }
+        }
+    } else {
         for (int j = 0; j < mel_inp.n_mel; ++j) {
             for (int i = i0; i < i1; ++i) {
                 dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
@@ -1494,11 +2030,142 @@ static bool whisper_encode_internal(
         }
     }
 
-    struct ggml_tensor * cur;
+    return true;
+}
 
-#ifndef WHISPER_USE_COREML
-    const bool use_coreml = false;
-#else
+// check if n_batch windows fit in one encoder graph
+// each window adds its own convolution and self-attention nodes, and the graph is limited to GGML_MAX_NODES
+// the activations of all windows are kept in the scratch buffers, see whisper_encode_batch_reserve()
+static bool whisper_encode_batch_fits(const whisper_hparams & hparams, int n_batch) {
+    if (n_batch > WHISPER_ENCODE_BATCH_MAX) {
+        return false;
+    }
+
+#if !defined(WHISPER_USE_SCRATCH)
+    if (n_batch > 1) {
+        return false;
+    }
+#endif
+
+    const int n_nodes_layer  = 48; // nodes per layer that do not depend on the batch
+    const int n_nodes_window = 16; // self-attention nodes per layer and window
+
+    const int n_nodes = 64 + 16*n_batch + hparams.n_audio_layer*(n_nodes_layer + n_batch*n_nodes_window);
+
+    return n_nodes <= GGML_MAX_NODES;
+}
+
+// grow the buffers of the state to hold the activations of n_batch windows of n_ctx positions
+// the attention matrix is evaluated one window at a time, so only the other activations scale with the batch
+static void whisper_encode_batch_reserve(whisper_context & wctx, whisper_state & wstate, int n_batch, int n_ctx) {
+    if (n_batch <= 1) {
+        return;
+    }
+
+    const auto & hparams = wctx.model.hparams;
+
+    const size_t n_act = (size_t) hparams.n_audio_state*n_ctx*sizeof(float);
+    const size_t n_mel = (size_t) hparams.n_mels*2*n_ctx*sizeof(float);
+
+    // activations of one window per scratch buffer, in addition to the buffers of a single window
+    const size_t n_act_buf[4] = { 6, 10, 2, 2 };
+
+    const size_t size_buf[4] = {
+        MEM_REQ_SCRATCH0.at(wctx.model.type),
+        MEM_REQ_SCRATCH1.at(wctx.model.type),
+        MEM_REQ_SCRATCH2.at(wctx.model.type),
+        MEM_REQ_SCRATCH3.at(wctx.model.type),
+    };
+
+    for (int i = 0; i < 4; ++i) {
+        const size_t size = size_buf[i] + (n_batch - 1)*n_act_buf[i]*n_act;
+        if (wstate.buf_scratch[i].size() < size) {
+            wstate.buf_scratch[i].resize(size);
+        }
+    }
+
+    // the compute buffer holds the spectrograms and the work buffers of the matrix multiplications,
+    // whose F16 copies of the activations grow with the batch
+    const size_t scale = hparams.ftype ? 1 : 2;
+
+    const size_t size_compute = scale*std::max(MEM_REQ_ENCODE.at(wctx.model.type), MEM_REQ_DECODE.at(wctx.model.type)) + (n_batch - 1)*(3*n_act + n_mel);
+    if (wstate.buf_compute.size() < size_compute) {
+        wstate.buf_compute.resize(size_compute);
+    }
+}
+
+// evaluate the encoder for a batch of windows
+//
+// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
+// part of the transformer model and returns the encoded features
+// the windows share one graph, so the weights are read once for the whole batch. the convolutions and
+// the self-attention are evaluated per window, everything else on the activations of all windows
+//
+//   - wctx:       the model
+//   - wstate:     the state whose buffers are used to evaluate the graph
+//   - states:     the state of each window. provides the spectrogram and receives the cross-attention cache
+//   - mel_offset: offset of each window in the mel spectrogram of its state (i.e. audio offset)
+//   - n_batch:    number of windows, see whisper_encode_batch_fits(). all states must use the same audio context
+//   - n_threads:  number of threads to use
+//
+static bool whisper_encode_batch_internal(
+        whisper_context & wctx,
+        whisper_state & wstate,
+        whisper_state * const * states,
+        const int * mel_offset,
+        const int   n_batch,
+        const int   n_threads){
+    WHISPER_ASSERT(n_batch >= 1);
+
+    const int64_t t_start_us = ggml_time_us();
+
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_ctx   = states[0]->exp_n_audio_ctx > 0 ? states[0]->exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_layer = hparams.n_audio_layer;
+
+    const int n_mels = hparams.n_mels;
+
+    const int N = n_ctx*n_batch; // positions of the batch, n_ctx per window
+
+    for (int b = 0; b < n_batch; ++b) {
+        assert(states[b]->mel.n_mel == n_mels);
+        WHISPER_ASSERT((states[b]->exp_n_audio_ctx > 0 ? states[b]->exp_n_audio_ctx : hparams.n_audio_ctx) == n_ctx);
+    }
+
+    whisper_encode_batch_reserve(wctx, wstate, n_batch, n_ctx);
+
+    struct ggml_init_params params = {
+            /*.mem_size   =*/ wstate.buf_compute.size(),
+            /*.mem_buffer =*/ wstate.buf_compute.data(),
+            /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    // the spectrograms must outlive the scratch buffers of the convolutions of the other windows
+    wstate.use_buf(ctx0, n_batch > 1 ? -1 : 0);
+
+    std::vector<struct ggml_tensor *> mels(n_batch);
+
+    for (int b = 0; b < n_batch; ++b) {
+        mels[b] = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
+        assert(mels[b]->type == GGML_TYPE_F32);
+
+        if (!whisper_encode_mel(wctx, *states[b], mel_offset[b], n_ctx, n_threads, (float *) mels[b]->data)) {
+            ggml_free(ctx0);
+            return false;
+        }
+    }
+
+    struct ggml_tensor * cur = nullptr;
+
+#ifndef WHISPER_USE_COREML
+    const bool use_coreml = false;
+#else
     const bool use_coreml = wstate.ctx_coreml != nullptr;
 #endif
 
@@ -1508,61 +2175,75 @@ static bool whisper_encode_internal(
     const bool use_openvino = wstate.ctx_openvino != nullptr;
 #endif
 
+    WHISPER_ASSERT(n_batch == 1 || (!use_coreml && !use_openvino));
+
     if (!use_coreml && !use_openvino) {
-        // convolution + gelu
-        {
-            wstate.use_buf(ctx0, 1);
+        struct ggml_cgraph gf = {};
+        gf.n_threads = n_threads;
 
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
-            cur = ggml_add(ctx0,
-                           ggml_repeat(ctx0,
-                                       model.e_conv_1_b,
-                                       cur),
-                           cur);
+        // the first n_ctx positions, when audio_ctx is reduced
+        const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
 
-            cur = ggml_gelu(ctx0, cur);
+        struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, 0);
 
-            wstate.use_buf(ctx0, 0);
+        // the input of each window is copied to its columns of inp_all
+        wstate.use_buf(ctx0, 3);
 
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
-            cur = ggml_add(ctx0,
-                           ggml_repeat(ctx0,
-                                       model.e_conv_2_b,
-                                       cur),
-                           cur);
+        struct ggml_tensor * inp_all = n_batch > 1 ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N) : nullptr;
 
-            cur = ggml_gelu(ctx0, cur);
-        }
+        for (int b = 0; b < n_batch; ++b) {
+            // convolution + gelu
+            {
+                wstate.use_buf(ctx0, 1);
 
-        wstate.use_buf(ctx0, 3);
+                cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mels[b], 1, 1);
+                cur = ggml_add(ctx0,
+                               ggml_repeat(ctx0,
+                                           model.e_conv_1_b,
+                                           cur),
+                               cur);
 
-        // ===================================================================
-        // NOTE: experimenting with partial evaluation of the encoder (ignore)
-        //static int iter = -1;
-        //const int n_iter = 1500/n_ctx;
+                cur = ggml_gelu(ctx0, cur);
 
-        //iter = (iter + 1) % n_iter;
+                wstate.use_buf(ctx0, 0);
 
-        //if (iter == 0) {
-        //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
-        //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
-        //}
+                cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
+                cur = ggml_add(ctx0,
+                               ggml_repeat(ctx0,
+                                           model.e_conv_2_b,
+                                           cur),
+                               cur);
 
-        static int iter = 0;
+                cur = ggml_gelu(ctx0, cur);
+            }
 
-        const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
-        const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
+            wstate.use_buf(ctx0, n_batch > 1 ? 1 : 3);
+
+            // ===================================================================
+            // NOTE: experimenting with partial evaluation of the encoder (ignore)
+            //static int iter = -1;
+            //const int n_iter = 1500/n_ctx;
 
-        struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+            //iter = (iter + 1) % n_iter;
 
-        cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
+            //if (iter == 0) {
+            //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
+            //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
+            //}
 
-        // ===================================================================
+            cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
 
-        // original:
-        //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+            // ===================================================================
 
-        struct ggml_tensor * inpL = cur;
+            // original:
+            //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+
+            if (n_batch > 1) {
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, cur, ggml_view_2d(ctx0, inp_all, n_state, n_ctx, inp_all->nb[1], b*n_ctx*inp_all->nb[1])));
+            }
+        }
+
+        struct ggml_tensor * inpL = n_batch > 1 ? inp_all : cur;
 
         for (int il = 0; il < n_layer; ++il) {
             const auto & layer = model.layers_encoder[il];
@@ -1614,80 +2295,108 @@ static bool whisper_encode_internal(
                                             Vcur),
                                 Vcur);
 
-                // ------
+                // the attention output of each window is copied to its columns of KQV_all
+                // Q, K and V are evaluated first, so that the windows can reuse the same scratch memory
+                struct ggml_tensor * KQV_all = nullptr;
 
-                wstate.use_buf(ctx0, 0);
+                if (n_batch > 1) {
+                    KQV_all = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N);
 
-#ifdef WHISPER_USE_FLASH_ATTN
-                struct ggml_tensor * Q =
-                    ggml_permute(ctx0,
-                            ggml_cpy(ctx0,
-                                Qcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
-                            0, 2, 1, 3);
+                    ggml_build_forward_expand(&gf, Qcur);
+                    ggml_build_forward_expand(&gf, Kcur);
+                    ggml_build_forward_expand(&gf, Vcur);
+                }
 
-                struct ggml_tensor * K =
-                    ggml_permute(ctx0,
-                            ggml_cpy(ctx0,
-                                Kcur,
-                                ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
-                            0, 2, 1, 3);
+                for (int b = 0; b < n_batch; ++b) {
+                    // ------
 
-                struct ggml_tensor * V =
-                    ggml_cpy(ctx0,
-                            ggml_permute(ctx0,
-                                ggml_reshape_3d(ctx0,
-                                    Vcur,
-                                    n_state/n_head, n_head, n_ctx),
-                                1, 2, 0, 3),
-                            ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head));
+                    wstate.use_buf(ctx0, 0);
 
-                struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, false);
-#else
-                struct ggml_tensor * Q =
+                    struct ggml_tensor * Qcur_b = n_batch > 1 ? ggml_view_2d(ctx0, Qcur, n_state, n_ctx, Qcur->nb[1], b*n_ctx*Qcur->nb[1]) : Qcur;
+                    struct ggml_tensor * Kcur_b = n_batch > 1 ? ggml_view_2d(ctx0, Kcur, n_state, n_ctx, Kcur->nb[1], b*n_ctx*Kcur->nb[1]) : Kcur;
+                    struct ggml_tensor * Vcur_b = n_batch > 1 ? ggml_view_2d(ctx0, Vcur, n_state, n_ctx, Vcur->nb[1], b*n_ctx*Vcur->nb[1]) : Vcur;
+
+#ifdef WHISPER_USE_FLASH_ATTN
+                    struct ggml_tensor * Q =
                         ggml_permute(ctx0,
-                                     ggml_cpy(ctx0,
-                                              Qcur,
-                                              ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
-                                     0, 2, 1, 3);
+                                ggml_cpy(ctx0,
+                                    Qcur_b,
+                                    ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                                0, 2, 1, 3);
 
-                struct ggml_tensor * K =
+                    struct ggml_tensor * K =
                         ggml_permute(ctx0,
-                                     ggml_cpy(ctx0,
-                                              Kcur,
-                                              ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
-                                     0, 2, 1, 3);
+                                ggml_cpy(ctx0,
+                                    Kcur_b,
+                                    ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                                0, 2, 1, 3);
 
-                // K * Q
-                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                    struct ggml_tensor * V =
+                        ggml_cpy(ctx0,
+                                ggml_permute(ctx0,
+                                    ggml_reshape_3d(ctx0,
+                                        Vcur_b,
+                                        n_state/n_head, n_head, n_ctx),
+                                    1, 2, 0, 3),
+                                ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head));
+
+                    struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, false);
+#else
+                    struct ggml_tensor * Q =
+                            ggml_permute(ctx0,
+                                         ggml_cpy(ctx0,
+                                                  Qcur_b,
+                                                  ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
+                                         0, 2, 1, 3);
 
-                struct ggml_tensor * KQ_scaled =
-                        ggml_scale_inplace(ctx0,
-                                           KQ,
-                                           ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-                        );
+                    struct ggml_tensor * K =
+                            ggml_permute(ctx0,
+                                         ggml_cpy(ctx0,
+                                                  Kcur_b,
+                                                  ggml_new_tensor_3d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx)),
+                                         0, 2, 1, 3);
 
-                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_scaled);
+                    // K * Q
+                    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-                struct ggml_tensor * V =
-                        ggml_cpy(ctx0,
-                                 ggml_permute(ctx0,
-                                              ggml_reshape_3d(ctx0,
-                                                              Vcur,
-                                                              n_state/n_head, n_head, n_ctx),
-                                              1, 2, 0, 3),
-                                 ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head)
-                        );
+                    struct ggml_tensor * KQ_scaled =
+                            ggml_scale_inplace(ctx0,
+                                               KQ,
+                                               ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+                            );
 
-                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_scaled);
+
+                    struct ggml_tensor * V =
+                            ggml_cpy(ctx0,
+                                     ggml_permute(ctx0,
+                                                  ggml_reshape_3d(ctx0,
+                                                                  Vcur_b,
+                                                                  n_state/n_head, n_head, n_ctx),
+                                                  1, 2, 0, 3),
+                                     ggml_new_tensor_3d(ctx0, wctx.itype, n_ctx, n_state/n_head, n_head)
+                            );
+
+                    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 #endif
-                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                    struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-                wstate.use_buf(ctx0, 1);
+                    if (n_batch > 1) {
+                        ggml_build_forward_expand(&gf, ggml_cpy(ctx0,
+                                    KQV_merged,
+                                    ggml_view_2d(ctx0, KQV_all, n_state, n_ctx, KQV_all->nb[1], b*n_ctx*KQV_all->nb[1])));
+                    } else {
+                        wstate.use_buf(ctx0, 1);
+
+                        cur = ggml_cpy(ctx0,
+                                       KQV_merged,
+                                       ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx));
+                    }
+                }
 
-                cur = ggml_cpy(ctx0,
-                               KQV_merged,
-                               ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx));
+                if (n_batch > 1) {
+                    cur = KQV_all;
+                }
             }
 
             // projection
@@ -1734,7 +2443,7 @@ static bool whisper_encode_internal(
                 wstate.use_buf(ctx0, 0);
 
                 cur = ggml_flash_ff(ctx0,
-                        ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.itype, n_state, n_ctx)),
+                        ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.itype, n_state, N)),
                         layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
 #else
                 wstate.use_buf(ctx0, 0);
@@ -1797,9 +2506,6 @@ static bool whisper_encode_internal(
 
         // run the computation
         {
-            struct ggml_cgraph gf = {};
-            gf.n_threads = n_threads;
-
             ggml_build_forward_expand(&gf, cur);
             ggml_graph_compute(ctx0, &gf);
 
@@ -1812,7 +2518,7 @@ static bool whisper_encode_internal(
 
         cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
 
-        whisper_coreml_encode(wstate.ctx_coreml, (float *) mel->data, (float *) cur->data);
+        whisper_coreml_encode(wstate.ctx_coreml, (float *) mels[0]->data, (float *) cur->data);
     }
 #endif
 #ifdef WHISPER_USE_OPENVINO
@@ -1821,7 +2527,7 @@ static bool whisper_encode_internal(
 
         cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
 
-        if (!whisper_openvino_encode(wstate.ctx_openvino, mel, cur)) {
+        if (!whisper_openvino_encode(wstate.ctx_openvino, mels[0], cur)) {
             return false;
         }
     }
@@ -1841,7 +2547,7 @@ static bool whisper_encode_internal(
     //    printf("\n");
     //}
 
-    // pre-compute cross-attention memory
+    // pre-compute cross-attention memory of each window
     {
         struct ggml_cgraph gf = {};
         gf.n_threads = n_threads;
@@ -1876,15 +2582,22 @@ static bool whisper_encode_internal(
 
             wstate.use_buf(ctx0, -1);
 
-            Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
+            for (int b = 0; b < n_batch; ++b) {
+                auto & kv_cross = states[b]->kv_cross;
+
+                struct ggml_tensor * Kcross_b = ggml_view_1d(ctx0, Kcross, n_state*n_ctx, b*n_state*n_ctx*ggml_element_size(Kcross));
+                struct ggml_tensor * Vcross_b = ggml_view_1d(ctx0, Vcross, n_state*n_ctx, b*n_state*n_ctx*ggml_element_size(Vcross));
 
-            struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx, (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
-            struct ggml_tensor * v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                                                  (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
-                                                  (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
+                Vcross_b = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross_b, n_state, n_ctx));
 
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross, k));
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross, v));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx, (ggml_element_size(kv_cross.k)*n_state)*(il*n_ctx));
+                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_cross.v, n_ctx, n_state,
+                                                      (   n_ctx)*ggml_element_size(kv_cross.v),
+                                                      (il*n_ctx)*ggml_element_size(kv_cross.v)*n_state);
+
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross_b, k));
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross_b, v));
+            }
         }
 
         ggml_graph_compute(ctx0, &gf);
@@ -1902,40 +2615,259 @@ static bool whisper_encode_internal(
 
     ggml_free(ctx0);
 
-    wstate.t_encode_us += ggml_time_us() - t_start_us;
-    wstate.n_encode++;
+    for (int b = 0; b < n_batch; ++b) {
+        states[b]->t_encode_us += ggml_time_us() - t_start_us;
+        states[b]->n_encode++;
+        states[b]->n_encode_ctx += n_ctx;
+    }
 
     return true;
 }
 
-// evaluate the decoder
+// evaluate the encoder with the given state
 //
-// given text prompt + audio features -> computes the logits for the next token
+//   - wctx:      the model
+//   - wstate:     the state of the encoder
+//   - n_threads:  number of threads to use
+//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+//
+static bool whisper_encode_internal(
+        whisper_context & wctx,
+        whisper_state & wstate,
+        const int   mel_offset,
+        const int   n_threads){
+    whisper_state * states[1] = { &wstate };
+
+    return whisper_encode_batch_internal(wctx, wstate, states, &mel_offset, 1, n_threads);
+}
+
+// the Core ML and OpenVINO encoders evaluate one window at a time
+static bool whisper_encode_batch_supported(const whisper_state & wstate) {
+#ifdef WHISPER_USE_COREML
+    if (wstate.ctx_coreml != nullptr) {
+        return false;
+    }
+#endif
+#ifdef WHISPER_USE_OPENVINO
+    if (wstate.ctx_openvino != nullptr) {
+        return false;
+    }
+#endif
+    (void) wstate;
+
+    return true;
+}
+
+// a window of one state, waiting to be encoded by whisper_encode_sched_step()
+struct whisper_encode_step {
+    whisper_state * state;
+
+    int mel_offset;
+    int n_ctx;
+
+    int64_t t_submit_us;
+
+    bool done;
+    bool ok;
+};
+
+// register a state that enters whisper_full_with_state()
+// returns false if encode batching is disabled for the context
+static bool whisper_encode_sched_enter(whisper_context & wctx) {
+    auto & sched = wctx.sched;
+
+    std::lock_guard<std::mutex> lock(sched.mutex);
+
+    if (sched.encode_wait_us <= 0) {
+        return false;
+    }
+
+    sched.n_active++;
+
+    return true;
+}
+
+static void whisper_encode_sched_leave(whisper_context & wctx) {
+    auto & sched = wctx.sched;
+
+    {
+        std::lock_guard<std::mutex> lock(sched.mutex);
+        sched.n_active--;
+    }
+
+    // the pending windows may no longer wait for this state
+    sched.cv.notify_all();
+}
+
+// encode a window of a state together with the windows of the other states that run concurrently
+// on the same context
+//
+// the window waits until every active state that is not in its token loop has submitted a window,
+// or for at most wait_us. one of the waiting threads then encodes the oldest windows with the same
+// audio context that fit in one graph, using the buffers of its own state, and the others wait for
+// the result
+//
+static bool whisper_encode_sched_step(
+        whisper_context & wctx,
+        whisper_state & wstate,
+        const int   mel_offset,
+        const int   n_threads) {
+    if (!whisper_encode_batch_supported(wstate)) {
+        return whisper_encode_internal(wctx, wstate, mel_offset, n_threads);
+    }
+
+    auto & sched = wctx.sched;
+
+    const auto & hparams = wctx.model.hparams;
+
+    const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    whisper_encode_step step = { &wstate, mel_offset, n_ctx, ggml_time_us(), false, false };
+
+    std::unique_lock<std::mutex> lock(sched.mutex);
+
+    sched.encode_pending.push_back(&step);
+    sched.cv.notify_all();
+
+    while (!step.done) {
+        const bool is_pending = std::find(sched.encode_pending.begin(), sched.encode_pending.end(), &step) != sched.encode_pending.end();
+
+        if (sched.encode_busy || !is_pending) {
+            sched.cv.wait(lock);
+            continue;
+        }
+
+        const int n_expected = sched.n_active - sched.n_decoding;
+
+        const int64_t t_wait_us = sched.encode_pending.front()->t_submit_us + sched.encode_wait_us - ggml_time_us();
+
+        if ((int) sched.encode_pending.size() < n_expected && t_wait_us > 0) {
+            sched.cv.wait_for(lock, std::chrono::microseconds(t_wait_us));
+            continue;
+        }
+
+        // take the oldest windows with the audio context of the oldest one
+        std::vector<whisper_encode_step *> batch;
+        std::vector<whisper_state *>       batch_states;
+        std::vector<int>                   batch_offsets;
+
+        const int n_ctx_batch = sched.encode_pending.front()->n_ctx;
+
+        for (auto it = sched.encode_pending.begin(); it != sched.encode_pending.end() && whisper_encode_batch_fits(hparams, batch.size() + 1); ) {
+            if ((*it)->n_ctx != n_ctx_batch) {
+                ++it;
+                continue;
+            }
+
+            batch.push_back(*it);
+            batch_states.push_back((*it)->state);
+            batch_offsets.push_back((*it)->mel_offset);
+
+            it = sched.encode_pending.erase(it);
+        }
+
+        sched.encode_busy = true;
+        lock.unlock();
+
+        const bool ok = whisper_encode_batch_internal(wctx, wstate, batch_states.data(), batch_offsets.data(), batch.size(), n_threads);
+
+        lock.lock();
+        sched.encode_busy = false;
+
+        for (auto * cur : batch) {
+            cur->ok   = ok;
+            cur->done = true;
+        }
+
+        sched.cv.notify_all();
+    }
+
+    return step.ok;
+}
+
+// a decoder evaluated by whisper_decode_batch_internal()
+struct whisper_batch_item {
+    whisper_state   * state;   // provides the cross-attention cache and receives the logits
+    whisper_decoder * decoder; // provides the self-attention cache
+    int               n_past;
+};
+
+// upper bound of the nodes of a decoder graph with n_decoders decoders of n_states different states
+// each decoder adds its own self-attention nodes, and each state its own cross-attention nodes
+// in every layer. the counts are those of the graph built by whisper_decode_batch_internal(),
+// which checks that the bound holds
+static int whisper_decode_batch_n_nodes(const whisper_hparams & hparams, int n_decoders, int n_states) {
+    const int n_nodes_model   = 10; // embeddings, final norm and logits
+    const int n_nodes_layer   = 44; // nodes per layer that do not depend on the batch
+    const int n_nodes_decoder = 22; // self-attention nodes per layer and decoder, 21 without the causal mask of a prompt
+    const int n_nodes_state   = 13; // cross-attention nodes per layer and state
+
+    return n_nodes_model + hparams.n_text_layer*(n_nodes_layer + n_decoders*n_nodes_decoder + n_states*n_nodes_state);
+}
+
+// check if n_decoders decoders of n_states different states fit in one decoder graph
+// the graph is limited to GGML_MAX_NODES nodes and leafs, and has fewer leafs (weights, inputs
+// and view parameters) than nodes. with 4096 nodes, a graph holds up to 3 decoders of one state,
+// or one decoder each of 2 states, for the large model, 5 and 3 for medium and 12 and 8 for small.
+// tiny and base are limited by WHISPER_MAX_DECODERS instead
+static bool whisper_decode_batch_fits(const whisper_hparams & hparams, int n_decoders, int n_states) {
+    return whisper_decode_batch_n_nodes(hparams, n_decoders, n_states) <= GGML_MAX_NODES;
+}
+
+// maximum number of decoders of a single state evaluated in one graph
+static int whisper_decode_batch_max(const whisper_hparams & hparams) {
+    int n_batch = 1;
+    while (n_batch < WHISPER_MAX_DECODERS && whisper_decode_batch_fits(hparams, n_batch + 1, 1)) {
+        ++n_batch;
+    }
+
+    return n_batch;
+}
+
+// evaluate the decoder for a batch of decoders
+//
+// given text prompt + audio features -> computes the logits for the next token of each decoder
+// the decoders share one graph, so the weights are read once for the whole batch. the
+// self-attention is evaluated per decoder, on the decoder's own KV cache, and the
+// cross-attention per state, on the state's encoder output
 //
 //   - model:      the model
+//   - wstate:     the state whose buffers are used to evaluate the graph
 //   - n_threads:  number of threads to use
-//   - tokens:     text prompt
-//   - n_tokens:   number of tokens in the prompt
-//   - n_past:     number of past tokens to prefix the prompt with
+//   - items:      the decoders to evaluate. items of the same state must be adjacent
+//   - n_batch:    number of items, see whisper_decode_batch_fits()
+//   - tokens:     n_tokens tokens for each item
+//   - n_tokens:   number of tokens per item. more than 1 only with a single item
 //
-static bool whisper_decode_internal(
+// the logits of the i-th item of a state are stored at state.logits[i*n_vocab]
+//
+static bool whisper_decode_batch_internal(
         whisper_context & wctx,
         whisper_state & wstate,
-        whisper_decoder & decoder,
+        const whisper_batch_item * items,
+        const int   n_batch,
         const whisper_token * tokens,
         const int   n_tokens,
-        const int   n_past,
         const int   n_threads) {
     const int64_t t_start_us = ggml_time_us();
 
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    auto & kv_self = decoder.kv_self;
+    WHISPER_ASSERT(n_batch >= 1 && (n_batch == 1 || n_tokens == 1));
 
-    WHISPER_ASSERT(!!kv_self.ctx);
+    for (int b = 0; b < n_batch; ++b) {
+        WHISPER_ASSERT(!!items[b].decoder->kv_self.ctx);
+    }
 
-    auto & logits_out = wstate.logits;
+    // ranges of adjacent items that share a state
+    std::vector<std::pair<int, int>> groups;
+    for (int b = 0; b < n_batch; ++b) {
+        if (b == 0 || items[b].state != items[b - 1].state) {
+            groups.push_back({ b, b });
+        }
+        groups.back().second = b + 1;
+    }
 
     const int n_vocab = hparams.n_vocab;
 
@@ -1944,10 +2876,9 @@ static bool whisper_decode_internal(
     const int n_head  = hparams.n_text_head;
     const int n_layer = hparams.n_text_layer;
 
-    const int N = n_tokens;
-    const int M = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int N = n_tokens*n_batch; // columns of the batch, n_tokens per item
 
-    //WHISPER_PRINT_DEBUG("%s: n_past = %d, N = %d, M = %d, n_ctx = %d\n", __func__, n_past, N, M, n_ctx);
+    //WHISPER_PRINT_DEBUG("%s: n_batch = %d, N = %d, n_ctx = %d\n", __func__, n_batch, N, n_ctx);
 
     struct ggml_init_params params = {
             /*.mem_size   =*/ wstate.buf_compute.size(),
@@ -1964,8 +2895,10 @@ static bool whisper_decode_internal(
     memcpy(embd->data, tokens, N*ggml_element_size(embd));
 
     struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    for (int i = 0; i < N; ++i) {
-        ((int32_t *) position->data)[i] = n_past + i;
+    for (int b = 0; b < n_batch; ++b) {
+        for (int i = 0; i < n_tokens; ++i) {
+            ((int32_t *) position->data)[b*n_tokens + i] = items[b].n_past + i;
+        }
     }
 
     wstate.use_buf(ctx0, 3);
@@ -2016,76 +2949,91 @@ static bool whisper_decode_internal(
 
             Kcur = ggml_scale_inplace(ctx0, Kcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
-            // store key and value to memory
-            {
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
-                                                         layer.attn_v_w,
-                                                         cur);
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                                                     layer.attn_v_w,
+                                                     cur);
 
-                Vcur = ggml_add(ctx0,
-                                ggml_repeat(ctx0,
-                                            layer.attn_v_b,
-                                            Vcur),
-                                Vcur);
+            Vcur = ggml_add(ctx0,
+                            ggml_repeat(ctx0,
+                                        layer.attn_v_b,
+                                        Vcur),
+                            Vcur);
+
+            // store key and value to the memory of each decoder
+            for (int b = 0; b < n_batch; ++b) {
+                const auto & kv_self = items[b].decoder->kv_self;
+
+                struct ggml_tensor * Kcur_b = ggml_view_1d(ctx0, Kcur, n_tokens*n_state, b*n_tokens*n_state*ggml_element_size(Kcur));
+                struct ggml_tensor * Vcur_b = ggml_view_1d(ctx0, Vcur, n_tokens*n_state, b*n_tokens*n_state*ggml_element_size(Vcur));
 
-                Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, N));
+                Vcur_b = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur_b, n_state, n_tokens));
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_state,
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + items[b].n_past));
+                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
                                                       (   n_ctx)*ggml_element_size(kv_self.v),
-                                                      (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + n_past*ggml_element_size(kv_self.v));
+                                                      (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + items[b].n_past*ggml_element_size(kv_self.v));
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur_b, k));
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur_b, v));
             }
 
             // ------
 
-            wstate.use_buf(ctx0, 0);
+            wstate.use_buf(ctx0, 1);
 
-            struct ggml_tensor * Q =
-                    ggml_permute(ctx0,
-                                 ggml_cpy(ctx0,
-                                          Qcur,
-                                          ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
-                                 0, 2, 1, 3);
+            // the attention output of each decoder is copied to its columns of KQV_all
+            struct ggml_tensor * KQV_all = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N);
 
-            struct ggml_tensor * K =
-                    ggml_permute(ctx0,
-                                 ggml_reshape_3d(ctx0,
-                                                 ggml_view_1d(ctx0, kv_self.k, (n_past + N)*n_state, il*n_ctx*ggml_element_size(kv_self.k)*n_state),
-                                                 n_state/n_head, n_head, n_past + N),
-                                 0, 2, 1, 3);
+            for (int b = 0; b < n_batch; ++b) {
+                const auto & kv_self = items[b].decoder->kv_self;
 
-            wstate.use_buf(ctx0, 1);
+                const int n_kv = items[b].n_past + n_tokens;
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                struct ggml_tensor * Q =
+                        ggml_permute(ctx0,
+                                     ggml_reshape_3d(ctx0,
+                                                     ggml_view_1d(ctx0, Qcur, n_tokens*n_state, b*n_tokens*n_state*ggml_element_size(Qcur)),
+                                                     n_state/n_head, n_head, n_tokens),
+                                     0, 2, 1, 3);
 
-            //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale_inplace(ctx0,
-            //            KQ,
-            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
+                struct ggml_tensor * K =
+                        ggml_permute(ctx0,
+                                     ggml_reshape_3d(ctx0,
+                                                     ggml_view_1d(ctx0, kv_self.k, n_kv*n_state, il*n_ctx*ggml_element_size(kv_self.k)*n_state),
+                                                     n_state/n_head, n_head, n_kv),
+                                     0, 2, 1, 3);
+
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ, n_past);
+                //struct ggml_tensor * KQ_scaled =
+                //    ggml_scale_inplace(ctx0,
+                //            KQ,
+                //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
+                //            );
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+                // a single new token attends to all positions
+                struct ggml_tensor * KQ_masked = n_tokens > 1 ? ggml_diag_mask_inf_inplace(ctx0, KQ, items[b].n_past) : KQ;
 
-            struct ggml_tensor * V =
-                    ggml_view_3d(ctx0, kv_self.v,
-                                 n_past + N, n_state/n_head, n_head,
-                                 n_ctx*ggml_element_size(kv_self.v),
-                                 n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
-                                 il*n_ctx*ggml_element_size(kv_self.v)*n_state);
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_self.v,
+                                     n_kv, n_state/n_head, n_head,
+                                     n_ctx*ggml_element_size(kv_self.v),
+                                     n_ctx*ggml_element_size(kv_self.v)*n_state/n_head,
+                                     il*n_ctx*ggml_element_size(kv_self.v)*n_state);
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 
-            cur = ggml_cpy(ctx0,
-                           KQV_merged,
-                           ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0,
+                            KQV_merged,
+                            ggml_view_2d(ctx0, KQV_all, n_state, n_tokens, KQV_all->nb[1], b*n_tokens*KQV_all->nb[1])));
+            }
+
+            cur = KQV_all;
         }
 
         // projection
@@ -2136,62 +3084,57 @@ static bool whisper_decode_internal(
 
             Qcur = ggml_scale_inplace(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
-            // Kcross is already scaled
-            struct ggml_tensor * Kcross =
-                    ggml_reshape_3d(ctx0,
-                                    ggml_view_1d(ctx0, wstate.kv_cross.k, M*n_state, il*M*ggml_element_size(wstate.kv_cross.k)*n_state),
-                                    n_state/n_head, n_head, M);
-
-            //struct ggml_tensor * Vcross =
-            //    ggml_reshape_3d(ctx0,
-            //            ggml_view_1d(ctx0, wstate.kv_cross.v, M*n_state, il*M*ggml_element_size(wstate.kv_cross.v)*n_state),
-            //            n_state/n_head, n_head, M);
-
-            //struct ggml_tensor * V_trans =
-            //    ggml_cpy(ctx0,
-            //            ggml_permute(ctx0, Vcross, 1, 2, 0, 3),
-            //            ggml_new_tensor_3d(ctx0, Vcross->type, M, n_state/n_head, n_head));
-
-            struct ggml_tensor * V =
-                    ggml_view_3d(ctx0, wstate.kv_cross.v,
-                                 M, n_state/n_head, n_head,
-                                 M*ggml_element_size(wstate.kv_cross.v),
-                                 M*ggml_element_size(wstate.kv_cross.v)*n_state/n_head,
-                                 il*M*ggml_element_size(wstate.kv_cross.v)*n_state);
-
             // ------
 
-            struct ggml_tensor * Q =
-                    ggml_permute(ctx0,
-                                 ggml_cpy(ctx0,
-                                          Qcur,
-                                          ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
-                                 0, 2, 1, 3);
+            wstate.use_buf(ctx0, 1);
+
+            // the attention output of each state is copied to its columns of KQV_all
+            struct ggml_tensor * KQV_all = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N);
+
+            for (const auto & group : groups) {
+                const auto & kv_cross = items[group.first].state->kv_cross;
 
-            struct ggml_tensor * K = ggml_permute(ctx0, Kcross, 0, 2, 1, 3);
+                const int M  = items[group.first].state->exp_n_audio_ctx > 0 ? items[group.first].state->exp_n_audio_ctx : hparams.n_audio_ctx;
+                const int Ng = (group.second - group.first)*n_tokens;
 
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                // Kcross is already scaled
+                struct ggml_tensor * Kcross =
+                        ggml_reshape_3d(ctx0,
+                                        ggml_view_1d(ctx0, kv_cross.k, M*n_state, il*M*ggml_element_size(kv_cross.k)*n_state),
+                                        n_state/n_head, n_head, M);
 
-            //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale_inplace(ctx0,
-            //            KQ,
-            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
-            //            );
+                struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_cross.v,
+                                     M, n_state/n_head, n_head,
+                                     M*ggml_element_size(kv_cross.v),
+                                     M*ggml_element_size(kv_cross.v)*n_state/n_head,
+                                     il*M*ggml_element_size(kv_cross.v)*n_state);
+
+                struct ggml_tensor * Q =
+                        ggml_permute(ctx0,
+                                     ggml_reshape_3d(ctx0,
+                                                     ggml_view_1d(ctx0, Qcur, Ng*n_state, group.first*n_tokens*n_state*ggml_element_size(Qcur)),
+                                                     n_state/n_head, n_head, Ng),
+                                     0, 2, 1, 3);
 
-            // no masking for cross-attention
-            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
+                struct ggml_tensor * K = ggml_permute(ctx0, Kcross, 0, 2, 1, 3);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ);
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                // no masking for cross-attention
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ);
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 
-            // cur = KQV_merged.contiguous().view(n_state, N)
-            cur = ggml_cpy(ctx0,
-                           KQV_merged,
-                           ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0,
+                            KQV_merged,
+                            ggml_view_2d(ctx0, KQV_all, n_state, Ng, KQV_all->nb[1], group.first*n_tokens*KQV_all->nb[1])));
+            }
+
+            cur = KQV_all;
         }
 
         // projection
@@ -2290,205 +3233,693 @@ static bool whisper_decode_internal(
 
     wstate.use_buf(ctx0, 0);
 
-    // compute logits only for the last token
+    // compute logits only for the last token of each decoder
     // comment this line to compute logits for all N tokens
     // might be useful in the future
-    cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    if (n_tokens > 1) {
+        cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    }
 
     struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
 
-    wstate.use_buf(ctx0, -1);
+    wstate.use_buf(ctx0, -1);
+
+    // run the computation
+    {
+        ggml_build_forward_expand(&gf, logits);
+
+        // the batches are sized with this bound, see whisper_decode_batch_fits()
+        WHISPER_ASSERT(gf.n_nodes <= whisper_decode_batch_n_nodes(hparams, n_batch, groups.size()));
+
+        ggml_graph_compute       (ctx0, &gf);
+    }
+
+    for (int b = 0; b < n_batch; ++b) {
+        kv_cache_blocks_write(*items[b].state, items[b].decoder->kv_self, items[b].n_past, n_tokens);
+    }
+
+    // extract logits for all N tokens
+    //logits_out.resize(N*n_vocab);
+    //memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*N*n_vocab);
+
+    // extract logits only for the last token of each item, into the logits of its state
+    for (const auto & group : groups) {
+        auto & logits_out = items[group.first].state->logits;
+
+        logits_out.resize((group.second - group.first)*n_vocab);
+        memcpy(logits_out.data(), (float *) ggml_get_data(logits) + group.first*n_vocab, sizeof(float)*logits_out.size());
+    }
+
+    if (N > 1) {
+        //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
+        //        ggml_used_mem(ctx0)/1024.0/1024.0,
+        //        wstate.get_buf_max_mem(0)/1024.0/1024.0,
+        //        wstate.get_buf_max_mem(1)/1024.0/1024.0,
+        //        wstate.get_buf_max_mem(2)/1024.0/1024.0,
+        //        wstate.get_buf_max_mem(3)/1024.0/1024.0);
+    }
+
+    ggml_free(ctx0);
+
+    for (const auto & group : groups) {
+        items[group.first].state->t_decode_us += ggml_time_us() - t_start_us;
+        items[group.first].state->n_decode++;
+    }
+
+    return true;
+}
+
+// evaluate a single decoder
+//
+// given text prompt + audio features -> computes the logits for the next token
+//
+//   - model:      the model
+//   - n_threads:  number of threads to use
+//   - tokens:     text prompt
+//   - n_tokens:   number of tokens in the prompt
+//   - n_past:     number of past tokens to prefix the prompt with
+//
+static bool whisper_decode_internal(
+        whisper_context & wctx,
+        whisper_state & wstate,
+        whisper_decoder & decoder,
+        const whisper_token * tokens,
+        const int   n_tokens,
+        const int   n_past,
+        const int   n_threads) {
+    const whisper_batch_item item = { &wstate, &decoder, n_past };
+
+    return whisper_decode_batch_internal(wctx, wstate, &item, 1, tokens, n_tokens, n_threads);
+}
+
+// a next-token step of one state, waiting to be evaluated by whisper_decode_sched_step()
+struct whisper_decode_step {
+    whisper_state * state;
+
+    const whisper_batch_item * items;
+    const whisper_token      * tokens;
+    int n_items;
+
+    int64_t t_submit_us;
+
+    bool done;
+    bool ok;
+};
+
+// register a state that enters its token loop
+// returns false if decode batching is disabled for the context
+static bool whisper_decode_sched_enter(whisper_context & wctx) {
+    auto & sched = wctx.sched;
+
+    std::lock_guard<std::mutex> lock(sched.mutex);
+
+    sched.n_decoding++;
+
+    return sched.decode_wait_us > 0;
+}
+
+static void whisper_decode_sched_leave(whisper_context & wctx) {
+    auto & sched = wctx.sched;
+
+    {
+        std::lock_guard<std::mutex> lock(sched.mutex);
+        sched.n_decoding--;
+    }
+
+    // the pending steps may no longer wait for this state
+    sched.cv.notify_all();
+}
+
+// evaluate the next-token step of a state together with the steps of the other states that decode
+// concurrently on the same context
+//
+// the step waits until every decoding state has submitted its step, or for at most wait_us.
+// one of the waiting threads then evaluates the oldest steps that fit in one graph, using the
+// buffers of its own state, and the others wait for the result. the logits of each step are
+// stored in the logits of its state, as with whisper_decode_batch_internal()
+//
+static bool whisper_decode_sched_step(
+        whisper_context & wctx,
+        whisper_state & wstate,
+        const whisper_batch_item * items,
+        const int   n_items,
+        const whisper_token * tokens,
+        const int   n_threads) {
+    auto & sched = wctx.sched;
+
+    const auto & hparams = wctx.model.hparams;
+
+    whisper_decode_step step = { &wstate, items, tokens, n_items, ggml_time_us(), false, false };
+
+    std::unique_lock<std::mutex> lock(sched.mutex);
+
+    sched.decode_pending.push_back(&step);
+    sched.cv.notify_all();
+
+    while (!step.done) {
+        const bool is_pending = std::find(sched.decode_pending.begin(), sched.decode_pending.end(), &step) != sched.decode_pending.end();
+
+        if (sched.decode_busy || !is_pending) {
+            sched.cv.wait(lock);
+            continue;
+        }
+
+        const int64_t t_wait_us = sched.decode_pending.front()->t_submit_us + sched.decode_wait_us - ggml_time_us();
+
+        if ((int) sched.decode_pending.size() < sched.n_decoding && t_wait_us > 0) {
+            sched.cv.wait_for(lock, std::chrono::microseconds(t_wait_us));
+            continue;
+        }
+
+        // take the oldest steps that fit in one graph
+        std::vector<whisper_decode_step *> batch;
+        std::vector<whisper_batch_item>    batch_items;
+        std::vector<whisper_token>         batch_tokens;
+
+        while (!sched.decode_pending.empty()) {
+            whisper_decode_step * cur = sched.decode_pending.front();
+
+            if (!batch.empty() && !whisper_decode_batch_fits(hparams, batch_items.size() + cur->n_items, batch.size() + 1)) {
+                break;
+            }
+
+            batch.push_back(cur);
+            batch_items.insert(batch_items.end(), cur->items, cur->items + cur->n_items);
+            batch_tokens.insert(batch_tokens.end(), cur->tokens, cur->tokens + cur->n_items);
+
+            sched.decode_pending.erase(sched.decode_pending.begin());
+        }
+
+        sched.decode_busy = true;
+        lock.unlock();
+
+        const bool ok = whisper_decode_batch_internal(wctx, wstate, batch_items.data(), batch_items.size(), batch_tokens.data(), 1, n_threads);
+
+        lock.lock();
+        sched.decode_busy = false;
+
+        for (auto * cur : batch) {
+            cur->ok   = ok;
+            cur->done = true;
+        }
+
+        sched.cv.notify_all();
+    }
+
+    return step.ok;
+}
+
+//  500 -> 00:05.000
+// 6000 -> 01:00.000
+static std::string to_timestamp(int64_t t, bool comma = false) {
+    int64_t msec = t * 10;
+    int64_t hr = msec / (1000 * 60 * 60);
+    msec = msec - hr * (1000 * 60 * 60);
+    int64_t min = msec / (1000 * 60);
+    msec = msec - min * (1000 * 60);
+    int64_t sec = msec / 1000;
+    msec = msec - sec * 1000;
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+
+    return std::string(buf);
+}
+
+// FFT
+//
+// a real-input transform of size n is computed as a complex FFT of size n/2 over the packed
+// even/odd samples, followed by a split step that also applies the power spectrum. the complex
+// FFT is an in-place mixed-radix decimation in time with radix 4, 2, 5 and 3 butterflies (other
+// prime factors use a generic DFT butterfly). the digit reversal and the Hann window are applied
+// while loading the input, and the twiddles are computed once per size
+//
+// WHISPER_FFT_LANES frames are transformed together, one per SIMD lane, so that every butterfly
+// is a vector operation regardless of the size of the transform. the lanes fill one native vector
+// register, wider vectors would be split by the compiler and change the ABI of the helpers below
+
+#if defined(__GNUC__)
+#if defined(__AVX__)
+#define WHISPER_FFT_LANES 8
+#else
+#define WHISPER_FFT_LANES 4
+#endif
+typedef float whisper_fft_vec __attribute__((vector_size(WHISPER_FFT_LANES*sizeof(float))));
+#else
+#define WHISPER_FFT_LANES 1
+typedef float whisper_fft_vec;
+#endif
+
+// n vectors of scratch in buf, aligned for whisper_fft_vec
+static whisper_fft_vec * whisper_fft_scratch(std::vector<float> & buf, size_t n) {
+    buf.resize((n + 1)*WHISPER_FFT_LANES);
+
+    const uintptr_t align = sizeof(whisper_fft_vec);
+    return (whisper_fft_vec *) (((uintptr_t) buf.data() + align - 1)/align*align);
+}
+
+#if WHISPER_FFT_LANES > 1
+typedef int32_t whisper_fft_ivec __attribute__((vector_size(WHISPER_FFT_LANES*sizeof(int32_t))));
+
+static whisper_fft_vec whisper_fft_select(whisper_fft_ivec mask, whisper_fft_vec a, whisper_fft_vec b) {
+    return (whisper_fft_vec) (((whisper_fft_ivec) a & mask) | ((whisper_fft_ivec) b & ~mask));
+}
+
+// log10(max(x, 1e-10)) in every lane, accurate to about 1 ulp (cephes log10f)
+static whisper_fft_vec whisper_fft_log10(whisper_fft_vec x) {
+    x = whisper_fft_select(x < 1e-10f, x*0.0f + 1e-10f, x);
+
+    // x = m*2^e with m in [0.5, 1)
+    const whisper_fft_ivec bits = (whisper_fft_ivec) x;
+
+    whisper_fft_ivec e = ((bits >> 23) & 0xff) - 126;
+    whisper_fft_vec  m = (whisper_fft_vec) ((bits & 0x807fffff) | 0x3f000000);
+
+    // m in [sqrt(0.5), sqrt(2)), m - 1 is the argument of the polynomial
+    const whisper_fft_ivec small = m < 0.70710678f;
+    e += small;
+    m = m - 1.0f + whisper_fft_select(small, m, m*0.0f);
+
+    const whisper_fft_vec z = m*m;
+
+    whisper_fft_vec y = m*7.0376836292e-2f - 1.1514610310e-1f;
+    y = y*m + 1.1676998740e-1f;
+    y = y*m - 1.2420140846e-1f;
+    y = y*m + 1.4249322787e-1f;
+    y = y*m - 1.6668057665e-1f;
+    y = y*m + 2.0000714765e-1f;
+    y = y*m - 2.4999993993e-1f;
+    y = y*m + 3.3333331174e-1f;
+    y = y*m*z - z*0.5f;
+
+    whisper_fft_vec fe;
+    for (int l = 0; l < WHISPER_FFT_LANES; l++) {
+        fe[l] = (float) e[l];
+    }
+
+    // log10(e) and log10(2) are split into two parts for accuracy
+    whisper_fft_vec r = y*7.00731903251827651129e-4f;
+    r += m*7.00731903251827651129e-4f;
+    r += fe*2.48745663981195213739e-4f;
+    r += y*4.3359375e-1f;
+    r += m*4.3359375e-1f;
+    r += fe*3.0078125e-1f;
+
+    return r;
+}
+#else
+static whisper_fft_vec whisper_fft_log10(whisper_fft_vec x) {
+    return log10f(std::max(x, 1e-10f));
+}
+#endif
+
+struct whisper_fft_plan {
+    int n = 0; // real transform size
+    int m = 0; // complex transform size (n/2)
+
+    std::vector<int> radix;     // per stage, first stage first
+    std::vector<int> tw_offset; // per stage, into tw_re/tw_im
+    std::vector<float> tw_re;   // W_L^(j*q) for j < L/radix, q = 1 .. radix - 1
+    std::vector<float> tw_im;
+
+    std::vector<int> perm;      // input index of each position after the digit reversal
+
+    std::vector<float> split_re; // W_n^k for k = 0 .. m
+    std::vector<float> split_im;
+
+    std::vector<float> hann;    // periodic Hann window of size n
+};
+
+// position of each input in the decimation-in-time order: the last stage combines the radix
+// sub-sequences x[q + radix*i], each transformed recursively into a contiguous block
+static void whisper_fft_perm(whisper_fft_plan & plan, int stage, int pos, int index, int stride, int len) {
+    if (stage < 0) {
+        plan.perm[pos] = index;
+        return;
+    }
+
+    const int p   = plan.radix[stage];
+    const int sub = len/p;
+
+    for (int q = 0; q < p; q++) {
+        whisper_fft_perm(plan, stage - 1, pos + q*sub, index + q*stride, stride*p, sub);
+    }
+}
+
+static void whisper_fft_plan_init(whisper_fft_plan & plan, int n) {
+    assert(n % 2 == 0);
+
+    plan.n = n;
+    plan.m = n/2;
+
+    int rest = plan.m;
+    for (int p : { 4, 2, 5, 3 }) {
+        while (rest % p == 0) {
+            plan.radix.push_back(p);
+            rest /= p;
+        }
+    }
+    for (int p = 7; rest > 1; p += 2) {
+        while (rest % p == 0) {
+            plan.radix.push_back(p);
+            rest /= p;
+        }
+    }
+
+    int ls = 1;
+    for (int p : plan.radix) {
+        const int l = ls*p;
+
+        plan.tw_offset.push_back(plan.tw_re.size());
+        for (int j = 0; j < ls; j++) {
+            for (int q = 1; q < p; q++) {
+                const double angle = -2.0*M_PI*j*q/l;
+                plan.tw_re.push_back(cos(angle));
+                plan.tw_im.push_back(sin(angle));
+            }
+        }
+
+        ls = l;
+    }
+
+    plan.perm.resize(plan.m);
+    whisper_fft_perm(plan, (int) plan.radix.size() - 1, 0, 0, 1, plan.m);
+
+    for (int k = 0; k <= plan.m; k++) {
+        const double angle = -2.0*M_PI*k/n;
+        plan.split_re.push_back(cos(angle));
+        plan.split_im.push_back(sin(angle));
+    }
+
+    plan.hann.resize(n);
+    for (int i = 0; i < n; i++) {
+        plan.hann[i] = 0.5*(1.0 - cos((2.0*M_PI*i)/(n)));
+    }
+}
+
+static const whisper_fft_plan & whisper_fft_plan_get(int n) {
+    static std::mutex mutex;
+    static std::map<int, std::unique_ptr<whisper_fft_plan>> plans;
+
+    std::lock_guard<std::mutex> lock(mutex);
 
-    // run the computation
-    {
-        ggml_build_forward_expand(&gf, logits);
-        ggml_graph_compute       (ctx0, &gf);
+    auto & plan = plans[n];
+    if (!plan) {
+        plan.reset(new whisper_fft_plan);
+        whisper_fft_plan_init(*plan, n);
     }
 
-    // extract logits for all N tokens
-    //logits_out.resize(N*n_vocab);
-    //memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*N*n_vocab);
+    return *plan;
+}
 
-    // extract logits only for the last token
-    logits_out.resize(n_vocab);
-    memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*n_vocab);
+// x[q*s] *= w[q - 1] for q = 1 .. p - 1
+static inline void whisper_fft_twiddle(whisper_fft_vec * xr, whisper_fft_vec * xi, int s, int p, const float * wr, const float * wi) {
+    for (int q = 1; q < p; q++) {
+        const whisper_fft_vec ar = xr[q*s];
+        const whisper_fft_vec ai = xi[q*s];
 
-    if (N > 1) {
-        //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-        //        ggml_used_mem(ctx0)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(0)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(1)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(2)/1024.0/1024.0,
-        //        wstate.get_buf_max_mem(3)/1024.0/1024.0);
+        xr[q*s] = ar*wr[q - 1] - ai*wi[q - 1];
+        xi[q*s] = ar*wi[q - 1] + ai*wr[q - 1];
     }
+}
 
-    ggml_free(ctx0);
+static inline void whisper_fft_radix2(whisper_fft_vec * xr, whisper_fft_vec * xi, int s) {
+    const whisper_fft_vec ar = xr[0], ai = xi[0];
+    const whisper_fft_vec br = xr[s], bi = xi[s];
 
-    wstate.t_decode_us += ggml_time_us() - t_start_us;
-    wstate.n_decode++;
+    xr[0] = ar + br; xi[0] = ai + bi;
+    xr[s] = ar - br; xi[s] = ai - bi;
+}
 
-    return true;
+static inline void whisper_fft_radix4(whisper_fft_vec * xr, whisper_fft_vec * xi, int s) {
+    const whisper_fft_vec t0r = xr[0] + xr[2*s], t0i = xi[0] + xi[2*s];
+    const whisper_fft_vec t1r = xr[0] - xr[2*s], t1i = xi[0] - xi[2*s];
+    const whisper_fft_vec t2r = xr[s] + xr[3*s], t2i = xi[s] + xi[3*s];
+    const whisper_fft_vec t3r = xr[s] - xr[3*s], t3i = xi[s] - xi[3*s];
+
+    // y1 = t1 - i*t3, y3 = t1 + i*t3
+    xr[0]   = t0r + t2r; xi[0]   = t0i + t2i;
+    xr[s]   = t1r + t3i; xi[s]   = t1i - t3r;
+    xr[2*s] = t0r - t2r; xi[2*s] = t0i - t2i;
+    xr[3*s] = t1r - t3i; xi[3*s] = t1i + t3r;
 }
 
-//  500 -> 00:05.000
-// 6000 -> 01:00.000
-static std::string to_timestamp(int64_t t, bool comma = false) {
-    int64_t msec = t * 10;
-    int64_t hr = msec / (1000 * 60 * 60);
-    msec = msec - hr * (1000 * 60 * 60);
-    int64_t min = msec / (1000 * 60);
-    msec = msec - min * (1000 * 60);
-    int64_t sec = msec / 1000;
-    msec = msec - sec * 1000;
+static inline void whisper_fft_radix3(whisper_fft_vec * xr, whisper_fft_vec * xi, int s) {
+    const float c = -0.5f;
+    const float d = -0.86602540378443864676f; // -sin(2*pi/3)
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+    const whisper_fft_vec br = xr[s] + xr[2*s], bi = xi[s] + xi[2*s];
+    const whisper_fft_vec dr = xr[s] - xr[2*s], di = xi[s] - xi[2*s];
 
-    return std::string(buf);
+    const whisper_fft_vec rr = xr[0] + br*c, ri = xi[0] + bi*c;
+
+    xr[0]   = xr[0] + br; xi[0] = xi[0] + bi;
+    xr[s]   = rr - di*d;  xi[s]   = ri + dr*d;
+    xr[2*s] = rr + di*d;  xi[2*s] = ri - dr*d;
 }
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const std::vector<float> & in, std::vector<float> & out) {
-    int N = in.size();
+static inline void whisper_fft_radix5(whisper_fft_vec * xr, whisper_fft_vec * xi, int s) {
+    const float c1 =  0.30901699437494742410f; // cos(2*pi/5)
+    const float c2 = -0.80901699437494742410f; // cos(4*pi/5)
+    const float s1 =  0.95105651629515357212f; // sin(2*pi/5)
+    const float s2 =  0.58778525229247312917f; // sin(4*pi/5)
 
-    out.resize(N*2);
+    const whisper_fft_vec ar = xr[0], ai = xi[0];
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+    const whisper_fft_vec b1r = xr[s]   + xr[4*s], b1i = xi[s]   + xi[4*s];
+    const whisper_fft_vec b2r = xr[2*s] + xr[3*s], b2i = xi[2*s] + xi[3*s];
+    const whisper_fft_vec d1r = xr[s]   - xr[4*s], d1i = xi[s]   - xi[4*s];
+    const whisper_fft_vec d2r = xr[2*s] - xr[3*s], d2i = xi[2*s] - xi[3*s];
 
-        for (int n = 0; n < N; n++) {
-            float angle = 2*M_PI*k*n/N;
-            re += in[n]*cos(angle);
-            im -= in[n]*sin(angle);
-        }
+    const whisper_fft_vec r1r = ar + b1r*c1 + b2r*c2, r1i = ai + b1i*c1 + b2i*c2;
+    const whisper_fft_vec r2r = ar + b1r*c2 + b2r*c1, r2i = ai + b1i*c2 + b2i*c1;
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
-    }
-}
+    const whisper_fft_vec i1r = d1r*s1 + d2r*s2, i1i = d1i*s1 + d2i*s2;
+    const whisper_fft_vec i2r = d1r*s2 - d2r*s1, i2i = d1i*s2 - d2i*s1;
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(const std::vector<float> & in, std::vector<float> & out) {
-    out.resize(in.size()*2);
+    // y1 = r1 - i*i1, y4 = r1 + i*i1, y2 = r2 - i*i2, y3 = r2 + i*i2
+    xr[0]   = ar + b1r + b2r; xi[0]   = ai + b1i + b2i;
+    xr[s]   = r1r + i1i;      xi[s]   = r1i - i1r;
+    xr[4*s] = r1r - i1i;      xi[4*s] = r1i + i1r;
+    xr[2*s] = r2r + i2i;      xi[2*s] = r2i - i2r;
+    xr[3*s] = r2r - i2i;      xi[3*s] = r2i + i2r;
+}
 
-    int N = in.size();
+// plain DFT of the p elements x[q*s], for prime radices without a dedicated butterfly
+static void whisper_fft_radixp(whisper_fft_vec * xr, whisper_fft_vec * xi, int s, int p, whisper_fft_vec * tmp) {
+    for (int k = 0; k < p; k++) {
+        whisper_fft_vec yr = xr[0];
+        whisper_fft_vec yi = xi[0];
+        for (int q = 1; q < p; q++) {
+            const double angle = -2.0*M_PI*((q*k) % p)/p;
+            const float wr = cos(angle);
+            const float wi = sin(angle);
 
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
+            yr += xr[q*s]*wr - xi[q*s]*wi;
+            yi += xr[q*s]*wi + xi[q*s]*wr;
+        }
+        tmp[2*k + 0] = yr;
+        tmp[2*k + 1] = yi;
     }
-
-    if (N%2 == 1) {
-        dft(in, out);
-        return;
+    for (int k = 0; k < p; k++) {
+        xr[k*s] = tmp[2*k + 0];
+        xi[k*s] = tmp[2*k + 1];
     }
+}
+
+// windowed power spectrum of WHISPER_FFT_LANES frames; lane l reads the plan.n samples starting
+// at offsets[l] (-1 for an unused lane), samples past n_samples are zeros
+//
+// power[k] (k = 0 .. n/2 + 1) matches the reference implementation: |X_k|^2 + |X_(n-k)|^2 for
+// 0 < k < n/2, and |X_k|^2 for k = 0, n/2 and n/2 + 1
+//
+// re, im and tmp are scratch buffers of plan.m, plan.m and 2*max(radix) vectors
+static void whisper_fft_power(
+        const whisper_fft_plan & plan,
+        const float * samples,
+        int n_samples,
+        const int * offsets,
+        whisper_fft_vec * re,
+        whisper_fft_vec * im,
+        whisper_fft_vec * tmp,
+        whisper_fft_vec * power) {
+    const int m = plan.m;
+
+    // load the packed even/odd samples in digit-reversed order, applying the window
+    {
+        float * zr = (float *) re;
+        float * zi = (float *) im;
 
-    std::vector<float> even;
-    std::vector<float> odd;
+        for (int l = 0; l < WHISPER_FFT_LANES; l++) {
+            const int offset = offsets[l];
 
-    even.reserve(N/2);
-    odd.reserve(N/2);
+            for (int pos = 0; pos < m; pos++) {
+                const int j = 2*plan.perm[pos];
+                const int i = offset + j;
 
-    for (int i = 0; i < N; i++) {
-        if (i % 2 == 0) {
-            even.push_back(in[i]);
-        } else {
-            odd.push_back(in[i]);
+                zr[pos*WHISPER_FFT_LANES + l] = offset >= 0 && i     < n_samples ? plan.hann[j    ]*samples[i    ] : 0.0f;
+                zi[pos*WHISPER_FFT_LANES + l] = offset >= 0 && i + 1 < n_samples ? plan.hann[j + 1]*samples[i + 1] : 0.0f;
+            }
         }
     }
 
-    std::vector<float> even_fft;
-    std::vector<float> odd_fft;
+    // complex FFT of size m
+    int ls = 1;
+    for (size_t t = 0; t < plan.radix.size(); t++) {
+        const int p = plan.radix[t];
+        const int l = ls*p;
+
+        const float * tw_re = plan.tw_re.data() + plan.tw_offset[t];
+        const float * tw_im = plan.tw_im.data() + plan.tw_offset[t];
+
+        for (int b = 0; b < m; b += l) {
+            for (int j = 0; j < ls; j++) {
+                whisper_fft_vec * xr = re + b + j;
+                whisper_fft_vec * xi = im + b + j;
+
+                if (j > 0) {
+                    whisper_fft_twiddle(xr, xi, ls, p, tw_re + j*(p - 1), tw_im + j*(p - 1));
+                }
+
+                switch (p) {
+                    case 2:  whisper_fft_radix2(xr, xi, ls); break;
+                    case 3:  whisper_fft_radix3(xr, xi, ls); break;
+                    case 4:  whisper_fft_radix4(xr, xi, ls); break;
+                    case 5:  whisper_fft_radix5(xr, xi, ls); break;
+                    default: whisper_fft_radixp(xr, xi, ls, p, tmp); break;
+                }
+            }
+        }
 
-    fft(even, even_fft);
-    fft(odd, odd_fft);
+        ls = l;
+    }
 
-    for (int k = 0; k < N/2; k++) {
-        float theta = 2*M_PI*k/N;
+    // split into the spectrum of the real input and take the power
+    for (int k = 0; k <= m; k++) {
+        const int k0 = k % m;
+        const int k1 = (m - k) % m;
 
-        float re = cos(theta);
-        float im = -sin(theta);
+        // E = (Z_k + conj(Z_(m-k)))/2, O = (Z_k - conj(Z_(m-k)))/(2i), X_k = E + W_n^k*O
+        const whisper_fft_vec er = (re[k0] + re[k1])*0.5f;
+        const whisper_fft_vec ei = (im[k0] - im[k1])*0.5f;
+        const whisper_fft_vec or_ = (im[k0] + im[k1])*0.5f;
+        const whisper_fft_vec oi = (re[k1] - re[k0])*0.5f;
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+        const float wr = plan.split_re[k];
+        const float wi = plan.split_im[k];
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+        const whisper_fft_vec xr = er + or_*wr - oi*wi;
+        const whisper_fft_vec xi = ei + or_*wi + oi*wr;
 
-        out[2*(k + N/2) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + N/2) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+        power[k] = xr*xr + xi*xi;
+        if (k > 0 && k < m) {
+            power[k] = power[k]*2.0f;
+        }
     }
+
+    // |X_(n/2+1)|^2 = |X_(n/2-1)|^2
+    power[m + 1] = m > 1 ? power[m - 1]*0.5f : power[0];
 }
 
-static void log_mel_spectrogram_worker_thread(int ith, const std::vector<float> &hann, const float *samples,
-                                              int n_samples, int fft_size, int fft_step, int n_threads,
-                                              const whisper_filters &filters, bool speed_up, whisper_mel &mel) {
-    std::vector<float> fft_in(fft_size, 0.0);
-    std::vector<float> fft_out(2 * fft_size);
-    int n_fft = 1 + (speed_up ? fft_size / 4 : fft_size / 2);
+// compute the log10 mel energies of frames [i0, i1)
+// frame i is written to out[(i - i0)*stride_frame + j*stride_mel] for mel band j
+// samples past n_samples are treated as zeros
+static void log_mel_spectrogram_worker_thread(int ith, const whisper_fft_plan &plan, const float *samples,
+                                              int n_samples, int fft_step, int n_threads,
+                                              const whisper_filters &filters, bool speed_up, int n_mel,
+                                              int i0, int i1, float *out, int stride_frame, int stride_mel) {
+    const int fft_size = plan.n;
+    const int n_fft = 1 + (speed_up ? fft_size / 4 : fft_size / 2);
 
-    for (int i = ith; i < mel.n_len; i += n_threads) {
-        const int offset = i * fft_step;
+    int max_radix = 0;
+    for (int p : plan.radix) {
+        max_radix = std::max(max_radix, p);
+    }
 
-        // apply Hanning window
-        for (int j = 0; j < fft_size; j++) {
-            if (offset + j < n_samples) {
-                fft_in[j] = hann[j] * samples[offset + j];
-            } else {
-                fft_in[j] = 0.0;
-            }
-        }
+    // per-thread scratch, reused for every group of frames
+    std::vector<float> buf_re, buf_im, buf_tmp, buf_power;
+    whisper_fft_vec * fft_re    = whisper_fft_scratch(buf_re, plan.m);
+    whisper_fft_vec * fft_im    = whisper_fft_scratch(buf_im, plan.m);
+    whisper_fft_vec * fft_tmp   = whisper_fft_scratch(buf_tmp, 2 * max_radix);
+    whisper_fft_vec * fft_power = whisper_fft_scratch(buf_power, plan.m + 2);
 
-        // FFT -> mag^2
-        fft(fft_in, fft_out);
+    std::vector<float> buf_mel;
+    whisper_fft_vec * fft_mel = whisper_fft_scratch(buf_mel, n_mel);
 
-        for (int j = 0; j < fft_size; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
-        for (int j = 1; j < fft_size / 2; j++) {
-            fft_out[j] += fft_out[fft_size - j];
+    for (int ig = i0 + ith * WHISPER_FFT_LANES; ig < i1; ig += n_threads * WHISPER_FFT_LANES) {
+        int offsets[WHISPER_FFT_LANES];
+        for (int l = 0; l < WHISPER_FFT_LANES; l++) {
+            offsets[l] = ig + l < i1 ? (ig + l) * fft_step : -1;
         }
 
+        // Hanning window -> FFT -> mag^2
+        whisper_fft_power(plan, samples, n_samples, offsets, fft_re, fft_im, fft_tmp, fft_power);
+
         if (speed_up) {
             // scale down in the frequency domain results in a speed up in the time domain
             for (int j = 0; j < n_fft; j++) {
-                fft_out[j] = 0.5 * (fft_out[2 * j] + fft_out[2 * j + 1]);
+                fft_power[j] = (fft_power[2 * j] + fft_power[2 * j + 1])*0.5f;
             }
         }
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
+        // mel spectrogram, over the non-zero bins of each filter only
+        for (int j = 0; j < n_mel; j++) {
+            const whisper_fft_vec * power = fft_power + filters.start[j];
+            const float * weights = filters.weights.data() + filters.offset[j];
 
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j*n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j*n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j*n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j*n_fft + k + 3];
+            whisper_fft_vec sum = {};
+            for (int k = 0; k < filters.len[j]; k++) {
+                sum += power[k]*weights[k];
             }
 
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
+            fft_mel[j] = whisper_fft_log10(sum);
+        }
 
-            sum = log10(std::max(sum, 1e-10));
+        for (int l = 0; l < WHISPER_FFT_LANES && ig + l < i1; l++) {
+            const float * mel = (const float *) fft_mel;
 
-            mel.data[j * mel.n_len + i] = sum;
+            float * dst = out + (size_t) (ig + l - i0)*stride_frame;
+            for (int j = 0; j < n_mel; j++) {
+                dst[(size_t) j*stride_mel] = mel[j * WHISPER_FFT_LANES + l];
+            }
         }
     }
 }
 
+static void log_mel_spectrogram_frames(const whisper_fft_plan &plan, const float *samples, int n_samples,
+                                       int fft_step, int n_threads, const whisper_filters &filters,
+                                       bool speed_up, int n_mel, int i0, int i1, float *out, int stride_frame, int stride_mel) {
+    const int n_groups = (i1 - i0 + WHISPER_FFT_LANES - 1) / WHISPER_FFT_LANES;
+
+    n_threads = std::max(1, std::min(n_threads, n_groups));
+
+    std::vector<std::thread> workers(n_threads - 1);
+    for (int iw = 0; iw < n_threads - 1; ++iw) {
+        workers[iw] = std::thread(
+                log_mel_spectrogram_worker_thread, iw + 1, std::cref(plan), samples,
+                n_samples, fft_step, n_threads,
+                std::cref(filters), speed_up, n_mel, i0, i1, out, stride_frame, stride_mel);
+    }
+
+    // main thread
+    log_mel_spectrogram_worker_thread(0, plan, samples, n_samples, fft_step, n_threads, filters, speed_up, n_mel, i0, i1, out, stride_frame, stride_mel);
+
+    for (int iw = 0; iw < n_threads - 1; ++iw) {
+        workers[iw].join();
+    }
+}
+
+// number of frames of the padded spectrogram: at least one extra chunk of zeros
+static int log_mel_padded_len(int n_len) {
+    const int pad = (100*WHISPER_CHUNK_SIZE)/2;
+
+    if (n_len % pad != 0) {
+        n_len = (n_len/pad + 1)*pad;
+    }
+
+    return n_len + pad;
+}
+
 // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L92-L124
 static bool log_mel_spectrogram(
         whisper_state & wstate,
@@ -2504,56 +3935,20 @@ static bool log_mel_spectrogram(
         whisper_mel & mel) {
     const int64_t t_start_us = ggml_time_us();
 
-    // Hanning window
-    std::vector<float> hann;
-    hann.resize(fft_size);
-    for (int i = 0; i < fft_size; i++) {
-        hann[i] = 0.5*(1.0 - cos((2.0*M_PI*i)/(fft_size)));
-    }
+    const whisper_fft_plan & plan = whisper_fft_plan_get(fft_size);
 
+    mel.lazy      = false;
     mel.n_mel     = n_mel;
-    mel.n_len     = n_samples/fft_step;
-    mel.n_len_org = mel.n_len;
-
-    std::vector<float> samples_padded;
-
-    // pad audio with at least one extra chunk of zeros
-    {
-        const int pad = (100*WHISPER_CHUNK_SIZE)/2;
-
-        if (mel.n_len % pad != 0) {
-            mel.n_len = (mel.n_len/pad + 1)*pad;
-        }
-        mel.n_len += pad;
-
-        samples_padded.resize(mel.n_len*fft_step);
-        memcpy(samples_padded.data(), samples, n_samples*sizeof(float));
-        memset(samples_padded.data() + n_samples, 0, (mel.n_len*fft_step - n_samples)*sizeof(float));
-
-        samples = samples_padded.data();
-    }
+    mel.n_len_org = n_samples/fft_step;
+    mel.n_len     = log_mel_padded_len(mel.n_len_org);
 
     mel.data.resize(mel.n_mel*mel.n_len);
 
     //printf("%s: n_samples = %d, n_len = %d\n", __func__, n_samples, mel.n_len);
     //printf("%s: recording length: %f s\n", __func__, (float) n_samples/sample_rate);
 
-    {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, std::cref(hann), samples,
-                    n_samples, fft_size, fft_step, n_threads,
-                    std::cref(filters), speed_up, std::ref(mel));
-        }
-
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples, n_samples, fft_size, fft_step, n_threads, filters, speed_up, mel);
-
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
-        }
-    }
+    log_mel_spectrogram_frames(plan, samples, n_samples, fft_step, n_threads, filters, speed_up, n_mel,
+                               0, mel.n_len, mel.data.data(), 1, mel.n_len);
 
     // clamping and normalization
     double mmax = -1e20;
@@ -2581,6 +3976,69 @@ static bool log_mel_spectrogram(
     return true;
 }
 
+// prepare a spectrogram that is computed window by window in whisper_encode_internal instead of
+// for the whole input up front. samples must stay valid while the state encodes from them
+static void log_mel_spectrogram_lazy(
+        const float * samples,
+        const int   n_samples,
+        const int   fft_size,
+        const int   fft_step,
+        const int   n_mel,
+        const int   n_ring,
+        const bool   speed_up,
+        whisper_mel & mel) {
+    mel.lazy      = true;
+    mel.samples   = samples;
+    mel.n_samples = n_samples;
+    mel.fft_plan  = &whisper_fft_plan_get(fft_size);
+    mel.fft_step  = fft_step;
+    mel.speed_up  = speed_up;
+
+    mel.n_mel     = n_mel;
+    mel.n_len_org = n_samples/fft_step;
+    mel.n_len     = log_mel_padded_len(mel.n_len_org);
+
+    mel.data.clear();
+    mel.data.shrink_to_fit();
+
+    mel.n_ring     = n_ring;
+    mel.ring_begin = 0;
+    mel.ring_end   = 0;
+    mel.ring.resize((size_t) n_ring*n_mel);
+}
+
+// make frames [i0, i1) of a lazy spectrogram available in the ring buffer, computing only the
+// frames that the previous window did not already cover
+static void log_mel_spectrogram_window(whisper_state & wstate, const whisper_filters & filters, int i0, int i1, int n_threads) {
+    auto & mel = wstate.mel;
+
+    assert(i1 - i0 <= mel.n_ring);
+
+    const int64_t t_start_us = ggml_time_us();
+
+    // keep the overlap with the previous window, drop everything else
+    if (i0 < mel.ring_begin || i0 > mel.ring_end) {
+        mel.ring_begin = i0;
+        mel.ring_end   = i0;
+    } else {
+        mel.ring_begin = i0;
+    }
+
+    while (mel.ring_end < i1) {
+        // contiguous run of slots up to the end of the ring
+        const int pos = mel.ring_end % mel.n_ring;
+        const int end = std::min(i1, mel.ring_end + (mel.n_ring - pos));
+
+        log_mel_spectrogram_frames(*mel.fft_plan, mel.samples, mel.n_samples, mel.fft_step, n_threads,
+                                   filters, mel.speed_up, mel.n_mel, mel.ring_end, end,
+                                   mel.ring.data() + (size_t) pos*mel.n_mel, mel.n_mel, 1);
+
+        mel.ring_end = end;
+    }
+
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
+}
+
 // split text into tokens
 //
 // ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
@@ -2759,6 +4217,99 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     return state;
 }
 
+// bring a used state back to the condition of a new one, keeping its allocations
+static void whisper_state_reset(struct whisper_state * state) {
+    state->t_sample_us = 0;
+    state->t_encode_us = 0;
+    state->t_decode_us = 0;
+    state->t_mel_us    = 0;
+
+    state->n_sample = 0;
+    state->n_encode = 0;
+    state->n_decode = 0;
+    state->n_fail_p = 0;
+    state->n_fail_h = 0;
+
+    state->n_encode_ctx = 0;
+    state->n_fail_ctx   = 0;
+
+    state->n_encode_ahead      = 0;
+    state->n_encode_ahead_used = 0;
+
+    // block ids restart from 0, so no block may keep an id from before
+    state->kv_block_id   = 0;
+    state->n_kv_block_cp = 0;
+
+    for (int j = 0; j < WHISPER_MAX_DECODERS; ++j) {
+        kv_cache_blocks_reset(state->decoders[j].kv_self);
+    }
+
+    state->mel.lazy      = false;
+    state->mel.samples   = nullptr;
+    state->mel.n_samples = 0;
+
+    state->result_all.clear();
+    state->prompt_past.clear();
+    state->energy.clear();
+
+    state->rng = std::mt19937(0);
+
+    state->lang_id = 0;
+    state->seek    = 0;
+
+    state->t_beg  = 0;
+    state->t_last = 0;
+
+    state->exp_n_audio_ctx = 0;
+
+    if (state->state_ahead) {
+        whisper_state_reset(state->state_ahead);
+    }
+}
+
+struct whisper_state * whisper_state_acquire(struct whisper_context * ctx) {
+    {
+        std::lock_guard<std::mutex> lock(ctx->state_pool_mutex);
+
+        if (!ctx->state_pool.empty()) {
+            whisper_state * state = ctx->state_pool.back();
+            ctx->state_pool.pop_back();
+
+            whisper_state_reset(state);
+
+            return state;
+        }
+    }
+
+    return whisper_init_state(ctx);
+}
+
+void whisper_state_release(struct whisper_context * ctx, struct whisper_state * state) {
+    if (state == nullptr) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(ctx->state_pool_mutex);
+    ctx->state_pool.push_back(state);
+}
+
+int whisper_state_pool_n_idle(struct whisper_context * ctx) {
+    std::lock_guard<std::mutex> lock(ctx->state_pool_mutex);
+    return ctx->state_pool.size();
+}
+
+void whisper_set_encode_batching(struct whisper_context * ctx, int wait_us) {
+    std::lock_guard<std::mutex> lock(ctx->sched.mutex);
+
+    ctx->sched.encode_wait_us = std::max(0, wait_us);
+}
+
+void whisper_set_decode_batching(struct whisper_context * ctx, int wait_us) {
+    std::lock_guard<std::mutex> lock(ctx->sched.mutex);
+
+    ctx->sched.decode_wait_us = std::max(0, wait_us);
+}
+
 int whisper_ctx_init_openvino_encoder(
         struct whisper_context * ctx,
         const char * model_path,
@@ -2812,6 +4363,50 @@ struct whisper_context * whisper_init_from_file_no_state(const char * path_model
 
     log("%s: loading model from '%s'\n", __func__, path_model);
 
+    // read the model through a memory mapping of the file when possible, so that the weights are
+    // shared with the page cache instead of being copied
+    whisper_mmap * mapping = whisper_mmap_open(path_model);
+    if (mapping) {
+        whisper_model_loader loader = {};
+
+        loader.context = mapping;
+
+        loader.read = [](void * ctx, void * output, size_t read_size) {
+            whisper_mmap * mapping = (whisper_mmap *) ctx;
+
+            const size_t size_to_copy = std::min(read_size, mapping->size - mapping->pos);
+
+            memcpy(output, mapping->addr + mapping->pos, size_to_copy);
+            mapping->pos += size_to_copy;
+
+            return size_to_copy;
+        };
+
+        loader.eof = [](void * ctx) {
+            whisper_mmap * mapping = (whisper_mmap *) ctx;
+            return mapping->pos >= mapping->size;
+        };
+
+        loader.close = [](void * /*ctx*/) { };
+
+        ggml_time_init();
+
+        whisper_context * ctx = new whisper_context;
+
+        ctx->model.mapping = mapping;
+
+        if (!whisper_model_load(&loader, *ctx)) {
+            log("%s: failed to load model\n", __func__);
+            whisper_mmap_free(mapping);
+            delete ctx;
+            return nullptr;
+        }
+
+        ctx->path_model = path_model;
+
+        return ctx;
+    }
+
     auto fin = std::ifstream(path_model, std::ios::binary);
     if (!fin) {
         log("%s: failed to open '%s'\n", __func__, path_model);
@@ -2879,26 +4474,173 @@ struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t
         return buf->current_offset >= buf->size;
     };
 
-    loader.close = [](void * /*ctx*/) { };
+    loader.close = [](void * /*ctx*/) { };
+
+    return whisper_init_no_state(&loader);
+}
+
+struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
+    ggml_time_init();
+
+    whisper_context * ctx = new whisper_context;
+
+    if (!whisper_model_load(loader, *ctx)) {
+        loader->close(loader->context);
+        log("%s: failed to load model\n", __func__);
+        delete ctx;
+        return nullptr;
+    }
+
+    loader->close(loader->context);
+
+    return ctx;
+}
+
+int whisper_model_align(const char * path_model, const char * path_aligned) {
+    std::ifstream fin(path_model, std::ios::binary);
+    if (!fin) {
+        log("%s: failed to open '%s'\n", __func__, path_model);
+        return 1;
+    }
+
+    // the aligned file is not readable by other whisper.cpp versions, never replace the original
+#ifdef WHISPER_USE_MMAP
+    struct stat st_model;
+    struct stat st_aligned;
+    const bool same = stat(path_model, &st_model) == 0 && stat(path_aligned, &st_aligned) == 0 &&
+        st_model.st_dev == st_aligned.st_dev && st_model.st_ino == st_aligned.st_ino;
+#else
+    const bool same = strcmp(path_model, path_aligned) == 0;
+#endif
+    if (same) {
+        log("%s: '%s' would overwrite the original model\n", __func__, path_aligned);
+        return 1;
+    }
+
+    // written next to the output and renamed when complete, so a failure leaves no partial model behind
+    const std::string path_tmp = std::string(path_aligned) + ".tmp";
+
+    std::ofstream fout(path_tmp, std::ios::binary);
+    if (!fout) {
+        log("%s: failed to open '%s' for writing\n", __func__, path_tmp.c_str());
+        return 1;
+    }
+
+    std::vector<char> tmp;
+
+    auto copy = [&](size_t n) {
+        tmp.resize(std::min<size_t>(n, 1 << 20));
+        while (n > 0 && fin) {
+            const size_t n_cur = std::min(n, tmp.size());
+            fin.read(tmp.data(), n_cur);
+            fout.write(tmp.data(), n_cur);
+            n -= n_cur;
+        }
+    };
+
+    auto copy_i32 = [&]() -> int32_t {
+        int32_t value = 0;
+        fin.read((char *) &value, sizeof(value));
+        fout.write((const char *) &value, sizeof(value));
+        return value;
+    };
+
+    // magic, hparams
+    {
+        if (copy_i32() != (int32_t) GGML_FILE_MAGIC) {
+            log("%s: invalid model data (bad magic)\n", __func__);
+            fout.close();
+            std::remove(path_tmp.c_str());
+            return 1;
+        }
+
+        for (int i = 0; i < 11; ++i) {
+            copy_i32();
+        }
+    }
+
+    // mel filters
+    {
+        const int32_t n_mel = copy_i32();
+        const int32_t n_fft = copy_i32();
+
+        copy((size_t) n_mel*n_fft*sizeof(float));
+    }
+
+    // vocab
+    {
+        const int32_t n_vocab = copy_i32();
+
+        for (int i = 0; i < n_vocab; ++i) {
+            copy(copy_i32());
+        }
+    }
+
+    // tensors, with the name padded so that the data is aligned
+    int n_tensors = 0;
+
+    while (true) {
+        int32_t header[3]; // n_dims, length, ttype
+        fin.read((char *) header, sizeof(header));
+        if (!fin) {
+            break;
+        }
+
+        const int32_t n_dims = header[0];
+        const int32_t length = header[1];
+        const int32_t ttype  = header[2];
+
+        if (n_dims < 1 || n_dims > 4 || length < 0 || ttype < 0 || ttype >= GGML_TYPE_COUNT || ggml_blck_size(ggml_type(ttype)) == 0) {
+            log("%s: invalid tensor header in '%s'\n", __func__, path_model);
+            fout.close();
+            std::remove(path_tmp.c_str());
+            return 1;
+        }
+
+        int32_t ne[4] = { 1, 1, 1, 1 };
+        fin.read((char *) ne, n_dims*sizeof(int32_t));
+
+        std::vector<char> name(length);
+        fin.read(name.data(), length);
+
+        const size_t pos  = (size_t) fout.tellp() + sizeof(header) + n_dims*sizeof(int32_t) + length;
+        const size_t npad = (WHISPER_MMAP_ALIGN - pos % WHISPER_MMAP_ALIGN) % WHISPER_MMAP_ALIGN;
+
+        name.resize(length + npad, '\0');
+        header[1] = name.size();
+
+        fout.write((const char *) header, sizeof(header));
+        fout.write((const char *) ne, n_dims*sizeof(int32_t));
+        fout.write(name.data(), name.size());
+
+        const int64_t nelements = (int64_t) ne[0]*ne[1]*ne[2]*ne[3];
 
-    return whisper_init_no_state(&loader);
-}
+        copy((nelements*ggml_type_size(ggml_type(ttype)))/ggml_blck_size(ggml_type(ttype)));
 
-struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
-    ggml_time_init();
+        n_tensors++;
+    }
 
-    whisper_context * ctx = new whisper_context;
+    fout.close();
 
-    if (!whisper_model_load(loader, *ctx)) {
-        loader->close(loader->context);
-        log("%s: failed to load model\n", __func__);
-        delete ctx;
-        return nullptr;
+    if (!fout || !fin.eof()) {
+        log("%s: failed to write '%s'\n", __func__, path_tmp.c_str());
+        std::remove(path_tmp.c_str());
+        return 1;
     }
 
-    loader->close(loader->context);
+#ifdef _WIN32
+    // rename() does not replace an existing file on Windows
+    std::remove(path_aligned);
+#endif
+    if (std::rename(path_tmp.c_str(), path_aligned) != 0) {
+        log("%s: failed to rename '%s' to '%s'\n", __func__, path_tmp.c_str(), path_aligned);
+        std::remove(path_tmp.c_str());
+        return 1;
+    }
 
-    return ctx;
+    log("%s: wrote %d tensors to '%s'\n", __func__, n_tensors, path_aligned);
+
+    return 0;
 }
 
 struct whisper_context * whisper_init_from_file(const char * path_model) {
@@ -2949,6 +4691,8 @@ struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
 void whisper_free_state(struct whisper_state * state)
 {
     if (state) {
+        whisper_free_state(state->state_ahead);
+
         kv_cache_free(state->kv_cross);
 
         for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
@@ -2982,8 +4726,14 @@ void whisper_free(struct whisper_context * ctx) {
             delete ctx->model.buf;
         }
 
+        whisper_mmap_free(ctx->model.mapping);
+
         whisper_free_state(ctx->state);
 
+        for (auto state : ctx->state_pool) {
+            whisper_free_state(state);
+        }
+
         delete ctx;
     }
 }
@@ -3033,6 +4783,7 @@ int whisper_set_mel_with_state(
         return -1;
     }
 
+    state->mel.lazy      = false;
     state->mel.n_len     = n_len;
     state->mel.n_len_org = n_len;
     state->mel.n_mel     = n_mel;
@@ -3069,6 +4820,33 @@ int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
     return 0;
 }
 
+int whisper_encode_batch(struct whisper_context * ctx, struct whisper_state ** states, const int * offsets, int n_states, int n_threads) {
+    const auto & hparams = ctx->model.hparams;
+
+    const auto audio_ctx = [&](int i) {
+        return states[i]->exp_n_audio_ctx > 0 ? states[i]->exp_n_audio_ctx : hparams.n_audio_ctx;
+    };
+
+    for (int i0 = 0; i0 < n_states; ) {
+        // the next windows with the same audio context that fit in one graph
+        int i1 = i0 + 1;
+        if (whisper_encode_batch_supported(*states[i0])) {
+            while (i1 < n_states && audio_ctx(i1) == audio_ctx(i0) && whisper_encode_batch_supported(*states[i1]) && whisper_encode_batch_fits(hparams, i1 - i0 + 1)) {
+                ++i1;
+            }
+        }
+
+        if (!whisper_encode_batch_internal(*ctx, *states[i0], states + i0, offsets + i0, i1 - i0, n_threads)) {
+            log("%s: failed to eval\n", __func__);
+            return -1;
+        }
+
+        i0 = i1;
+    }
+
+    return 0;
+}
+
 int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
     const int selected_decoder_id = 0;
 
@@ -3387,7 +5165,18 @@ void whisper_print_timings(struct whisper_context * ctx) {
         log("%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
         log("%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
         log("%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
+        if (ctx->state->n_encode_ctx > 0 && ctx->state->n_encode_ctx < (int64_t) n_encode*ctx->model.hparams.n_audio_ctx) {
+            const double n_ctx_avg = (double) ctx->state->n_encode_ctx / n_encode;
+            log("%s:    encode ctx = %8.1f / %5d per run (%.1fx fewer positions), %d windows with full context fallback\n", __func__,
+                    n_ctx_avg, ctx->model.hparams.n_audio_ctx, ctx->model.hparams.n_audio_ctx/n_ctx_avg, ctx->state->n_fail_ctx);
+        }
+        if (ctx->state->n_encode_ahead > 0) {
+            log("%s:  encode ahead = %5d runs / %5d used\n", __func__, ctx->state->n_encode_ahead, ctx->state->n_encode_ahead_used);
+        }
         log("%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
+        if (ctx->state->n_kv_block_cp > 0) {
+            log("%s:  kv blocks cp = %8lld (%d positions each)\n", __func__, (long long) ctx->state->n_kv_block_cp, WHISPER_KV_BLOCK);
+        }
     }
     log("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
@@ -3517,6 +5306,8 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
             /*.logits_filter_callback           =*/ nullptr,
             /*.logits_filter_callback_user_data =*/ nullptr,
+
+            /*.n_threads_ahead   =*/ 0,
     };
 
     switch (strategy) {
@@ -3609,22 +5400,189 @@ static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_sta
     return res;
 }
 
-static const std::vector<std::string> non_speech_tokens = {
-        "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
-        "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
-        "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
-        "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
-};
+// exp(x) for the log-softmax passes, the arguments are <= 0
+// 2^n*p(r) with n = round(x/ln2), |r| <= ln2/2 and the cephes expf polynomial; within 2 ulp of expf
+// arguments below -87, where expf leaves the normal range, and -INFINITY give 0
+static inline float whisper_exp_neg(float x) {
+    const float xc = x > -87.0f ? x : -87.0f;
+    const float t  = xc*1.44269504f + 12582912.0f; // round to nearest by adding 1.5*2^23
+    const float n  = t - 12582912.0f;
+    const float r  = xc - n*0.693359375f + n*2.12194440e-4f;
+
+    float p = 1.9875691500e-4f;
+    p = p*r + 1.3981999507e-3f;
+    p = p*r + 8.3334519073e-3f;
+    p = p*r + 4.1665795894e-2f;
+    p = p*r + 1.6666665459e-1f;
+    p = p*r + 5.0000001201e-1f;
+    p = p*r*r + r + 1.0f;
+
+    int32_t ti;
+    memcpy(&ti, &t, sizeof(ti));
+    const int32_t si = (ti - 0x4B400000 + 127) << 23;
+    float s;
+    memcpy(&s, &si, sizeof(s));
+
+    return x > -87.0f ? p*s : 0.0f;
+}
+
+#if defined(__AVX2__)
+static inline __m256 whisper_exp_neg_v(__m256 x) {
+    const __m256 xc = _mm256_max_ps(x, _mm256_set1_ps(-87.0f));
+    const __m256 t  = _mm256_add_ps(_mm256_mul_ps(xc, _mm256_set1_ps(1.44269504f)), _mm256_set1_ps(12582912.0f));
+    const __m256 n  = _mm256_sub_ps(t, _mm256_set1_ps(12582912.0f));
+    const __m256 r  = _mm256_add_ps(_mm256_sub_ps(xc, _mm256_mul_ps(n, _mm256_set1_ps(0.693359375f))), _mm256_mul_ps(n, _mm256_set1_ps(2.12194440e-4f)));
+
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(p, r), r), r), _mm256_set1_ps(1.0f));
+
+    const __m256i si = _mm256_slli_epi32(_mm256_sub_epi32(_mm256_castps_si256(t), _mm256_set1_epi32(0x4B400000 - 127)), 23);
+
+    return _mm256_and_ps(_mm256_mul_ps(p, _mm256_castsi256_ps(si)), _mm256_cmp_ps(x, _mm256_set1_ps(-87.0f), _CMP_GT_OQ));
+}
+#elif defined(__SSE2__)
+static inline __m128 whisper_exp_neg_v(__m128 x) {
+    const __m128 xc = _mm_max_ps(x, _mm_set1_ps(-87.0f));
+    const __m128 t  = _mm_add_ps(_mm_mul_ps(xc, _mm_set1_ps(1.44269504f)), _mm_set1_ps(12582912.0f));
+    const __m128 n  = _mm_sub_ps(t, _mm_set1_ps(12582912.0f));
+    const __m128 r  = _mm_add_ps(_mm_sub_ps(xc, _mm_mul_ps(n, _mm_set1_ps(0.693359375f))), _mm_mul_ps(n, _mm_set1_ps(2.12194440e-4f)));
+
+    __m128 p = _mm_set1_ps(1.9875691500e-4f);
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.3981999507e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(8.3334519073e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(4.1665795894e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.6666665459e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(5.0000001201e-1f));
+    p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, r), r), r), _mm_set1_ps(1.0f));
+
+    const __m128i si = _mm_slli_epi32(_mm_sub_epi32(_mm_castps_si128(t), _mm_set1_epi32(0x4B400000 - 127)), 23);
+
+    return _mm_and_ps(_mm_mul_ps(p, _mm_castsi128_ps(si)), _mm_cmpgt_ps(x, _mm_set1_ps(-87.0f)));
+}
+#elif defined(__ARM_NEON)
+static inline float32x4_t whisper_exp_neg_v(float32x4_t x) {
+    const float32x4_t xc = vmaxq_f32(x, vdupq_n_f32(-87.0f));
+    const float32x4_t t  = vaddq_f32(vmulq_f32(xc, vdupq_n_f32(1.44269504f)), vdupq_n_f32(12582912.0f));
+    const float32x4_t n  = vsubq_f32(t, vdupq_n_f32(12582912.0f));
+    const float32x4_t r  = vaddq_f32(vsubq_f32(xc, vmulq_f32(n, vdupq_n_f32(0.693359375f))), vmulq_f32(n, vdupq_n_f32(2.12194440e-4f)));
+
+    float32x4_t p = vdupq_n_f32(1.9875691500e-4f);
+    p = vaddq_f32(vmulq_f32(p, r), vdupq_n_f32(1.3981999507e-3f));
+    p = vaddq_f32(vmulq_f32(p, r), vdupq_n_f32(8.3334519073e-3f));
+    p = vaddq_f32(vmulq_f32(p, r), vdupq_n_f32(4.1665795894e-2f));
+    p = vaddq_f32(vmulq_f32(p, r), vdupq_n_f32(1.6666665459e-1f));
+    p = vaddq_f32(vmulq_f32(p, r), vdupq_n_f32(5.0000001201e-1f));
+    p = vaddq_f32(vaddq_f32(vmulq_f32(vmulq_f32(p, r), r), r), vdupq_n_f32(1.0f));
+
+    const int32x4_t si = vshlq_n_s32(vsubq_s32(vreinterpretq_s32_f32(t), vdupq_n_s32(0x4B400000 - 127)), 23);
+
+    const uint32x4_t e = vreinterpretq_u32_f32(vmulq_f32(p, vreinterpretq_f32_s32(si)));
+    return vreinterpretq_f32_u32(vandq_u32(e, vcgtq_f32(x, vdupq_n_f32(-87.0f))));
+}
+#endif
+
+// max(x[0..n)), -INFINITY for n <= 0
+static float whisper_vec_max(const float * x, int n) {
+    int i = 0;
+    float res = -INFINITY;
+
+#if defined(__AVX2__)
+    __m256 acc = _mm256_set1_ps(-INFINITY);
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_max_ps(acc, _mm256_loadu_ps(x + i));
+    }
+    __m128 acc4 = _mm_max_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_max_ps(acc4, _mm_movehl_ps(acc4, acc4));
+    acc4 = _mm_max_ss(acc4, _mm_shuffle_ps(acc4, acc4, 1));
+    res = _mm_cvtss_f32(acc4);
+#elif defined(__SSE2__)
+    __m128 acc = _mm_set1_ps(-INFINITY);
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_max_ps(acc, _mm_loadu_ps(x + i));
+    }
+    acc = _mm_max_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_max_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    res = _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t acc = vdupq_n_f32(-INFINITY);
+    for (; i + 4 <= n; i += 4) {
+        acc = vmaxq_f32(acc, vld1q_f32(x + i));
+    }
+    const float32x2_t acc2 = vmax_f32(vget_low_f32(acc), vget_high_f32(acc));
+    res = vget_lane_f32(vpmax_f32(acc2, acc2), 0);
+#endif
+
+    for (; i < n; ++i) {
+        res = x[i] > res ? x[i] : res;
+    }
+
+    return res;
+}
+
+// y[i] = exp(x[i] - max), returns the sum of y[0..n)
+static float whisper_vec_exp_sum(const float * x, float * y, int n, float max) {
+    int i = 0;
+    float sum = 0.0f;
+
+#if defined(__AVX2__)
+    const __m256 vmax = _mm256_set1_ps(max);
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        const __m256 e = whisper_exp_neg_v(_mm256_sub_ps(_mm256_loadu_ps(x + i), vmax));
+        _mm256_storeu_ps(y + i, e);
+        acc = _mm256_add_ps(acc, e);
+    }
+    __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_add_ps(acc4, _mm_movehl_ps(acc4, acc4));
+    acc4 = _mm_add_ss(acc4, _mm_shuffle_ps(acc4, acc4, 1));
+    sum = _mm_cvtss_f32(acc4);
+#elif defined(__SSE2__)
+    const __m128 vmax = _mm_set1_ps(max);
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        const __m128 e = whisper_exp_neg_v(_mm_sub_ps(_mm_loadu_ps(x + i), vmax));
+        _mm_storeu_ps(y + i, e);
+        acc = _mm_add_ps(acc, e);
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    sum = _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON)
+    const float32x4_t vmax = vdupq_n_f32(max);
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t e = whisper_exp_neg_v(vsubq_f32(vld1q_f32(x + i), vmax));
+        vst1q_f32(y + i, e);
+        acc = vaddq_f32(acc, e);
+    }
+    const float32x2_t acc2 = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    sum = vget_lane_f32(vpadd_f32(acc2, acc2), 0);
+#endif
+
+    for (; i < n; ++i) {
+        y[i] = whisper_exp_neg(x[i] - max);
+        sum += y[i];
+    }
+
+    return sum;
+}
 
 // process the logits for the selected decoder
 // - applies logit filters
 // - computes logprobs and probs
+// - i_batch: the row of state.logits that holds the logits of the decoder
 static void whisper_process_logits(
         struct whisper_context & ctx,
         struct whisper_state  & state,
         const struct whisper_full_params   params,
         struct whisper_decoder & decoder,
-        float   temperature) {
+        float   temperature,
+        int     i_batch = 0) {
     const auto & vocab      = ctx.vocab;
     const auto & tokens_cur = decoder.sequence.tokens;
 
@@ -3640,12 +5598,16 @@ static void whisper_process_logits(
     auto & logprobs = decoder.logprobs;
     {
         logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + (state.logits.size() - n_logits), n_logits*sizeof(float));
+        WHISPER_ASSERT(state.logits.size() >= (size_t) (i_batch + 1)*n_logits);
+
+        const float * src = state.logits.data() + i_batch*n_logits;
 
         if (temperature > 0.0f) {
             for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
+                logits[i] = src[i]/temperature;
             }
+        } else {
+            memcpy(logits.data(), src, n_logits*sizeof(float));
         }
 
         // will be populated a bit later
@@ -3660,8 +5622,10 @@ static void whisper_process_logits(
         // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
         if (params.suppress_blank) {
             if (is_initial) {
-                logits[vocab.token_eot]           = -INFINITY;
-                logits[vocab.token_to_id.at(" ")] = -INFINITY;
+                logits[vocab.token_eot] = -INFINITY;
+                if (vocab.token_space >= 0) {
+                    logits[vocab.token_space] = -INFINITY;
+                }
             }
         }
 
@@ -3686,24 +5650,10 @@ static void whisper_process_logits(
             params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
         }
 
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+        // suppress non-speech tokens, see whisper_vocab_init_suppress()
         if (params.suppress_non_speech_tokens) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
-
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
+            for (const whisper_token id : vocab.token_non_speech) {
+                logits[id] = -INFINITY;
             }
         }
 
@@ -3717,13 +5667,9 @@ static void whisper_process_logits(
 
             if (last_was_timestamp) {
                 if (penultimate_was_timestamp) {
-                    for (int i = vocab.token_beg; i < n_logits; ++i) {
-                        logits[i] = -INFINITY;
-                    }
+                    std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
                 } else {
-                    for (int i = 0; i < vocab.token_eot; ++i) {
-                        logits[i] = -INFINITY;
-                    }
+                    std::fill(logits.begin(), logits.begin() + vocab.token_eot, -INFINITY);
                 }
             }
         }
@@ -3734,79 +5680,62 @@ static void whisper_process_logits(
             const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
             const int   tid0      = std::round(params.max_initial_ts/precision);
 
-            for (int i = vocab.token_beg + tid0 + 1; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
+            if (vocab.token_beg + tid0 + 1 < n_logits) {
+                std::fill(logits.begin() + vocab.token_beg + tid0 + 1, logits.end(), -INFINITY);
             }
         }
 
         // condition timestamp tokens to be increasing
         // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
         if (decoder.has_ts) {
-            const int tid0 = decoder.seek_delta/2;
+            const int tid0 = std::min(decoder.seek_delta/2, n_logits - vocab.token_beg);
 
-            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
-                logits[i] = -INFINITY;
+            if (tid0 > 0) {
+                std::fill(logits.begin() + vocab.token_beg, logits.begin() + vocab.token_beg + tid0, -INFINITY);
             }
         }
 
-        // populate the logprobs array (log_softmax)
+        // log_softmax, and if sum of probability over timestamps is above any other token, sample timestamp
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
+        //
+        // three passes over the logits: max, exp and sum, log and normalize. text tokens and timestamps are
+        // summed separately, which gives the logsumexp over timestamps without another exp pass
         {
-            const float logit_max = *std::max_element(logits.begin(), logits.end());
-            float logsumexp = 0.0f;
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logsumexp += expf(logits[i] - logit_max);
-                }
-            }
-            logsumexp = logf(logsumexp) + logit_max;
+            const int n_text = vocab.token_beg;
+            const int n_ts   = n_logits - vocab.token_beg;
 
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logprobs[i] = logits[i] - logsumexp;
-                } else {
-                    logprobs[i] = -INFINITY;
-                }
-            }
-        }
+            const float max_text  = whisper_vec_max(logits.data(), n_text);
+            const float max_ts    = whisper_vec_max(logits.data() + n_text, n_ts);
+            const float logit_max = std::max(max_text, max_ts);
 
-        // if sum of probability over timestamps is above any other token, sample timestamp
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
-        {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
+            // probs holds exp(logit - logit_max) until normalized
+            const float sum_text = whisper_vec_exp_sum(logits.data(), probs.data(), n_text, logit_max);
+            const float sum_ts   = whisper_vec_exp_sum(logits.data() + n_text, probs.data() + n_text, n_ts, logit_max);
+            const float sum      = sum_text + sum_ts;
+
+            // sum is 0 only if every token is suppressed, then all logprobs stay -INFINITY
+            const float logsumexp = sum > 0.0f ? logf(sum) + logit_max : 0.0f;
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+            // logsumexp over timestamps, relative to all tokens
+            const float timestamp_logprob      = sum_ts > 0.0f ? logf(sum_ts) + logit_max - logsumexp : -INFINITY;
+            const float max_text_token_logprob = max_text - logsumexp;
 
             //log("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
 
+            int i0 = 0;
             if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
-                }
+                std::fill(logits.begin(),   logits.begin()   + n_text, -INFINITY);
+                std::fill(logprobs.begin(), logprobs.begin() + n_text, -INFINITY);
+                std::fill(probs.begin(),    probs.begin()    + n_text, 0.0f);
+
+                i0 = n_text;
             }
-        }
-    }
 
-    // compute probs
-    {
-        for (int i = 0; i < n_logits; ++i) {
-            if (logits[i] == -INFINITY) {
-                probs[i] = 0.0f;
-            } else {
-                probs[i] = expf(logprobs[i]);
+            // -INFINITY - logsumexp stays -INFINITY, and the probability of a suppressed token is already 0
+            const float scale = sum > 0.0f ? 1.0f/sum : 0.0f;
+            for (int i = i0; i < n_logits; ++i) {
+                logprobs[i] = logits[i] - logsumexp;
+                probs[i]   *= scale;
             }
         }
     }
@@ -4024,6 +5953,16 @@ static void whisper_sequence_score(
     }
 }
 
+// encoder context for n_frames mel frames of remaining audio, with params.audio_ctx = -1
+static int whisper_audio_ctx_auto(struct whisper_context * ctx, int n_frames) {
+    // 2 mel frames per encoder position
+    int n_ctx = (n_frames + 1)/2 + WHISPER_AUDIO_CTX_MARGIN;
+
+    n_ctx = ((n_ctx + WHISPER_AUDIO_CTX_STEP - 1)/WHISPER_AUDIO_CTX_STEP)*WHISPER_AUDIO_CTX_STEP;
+
+    return std::min(whisper_n_audio_ctx(ctx), std::max(WHISPER_AUDIO_CTX_MIN, n_ctx));
+}
+
 int whisper_full_with_state(
         struct whisper_context * ctx,
         struct whisper_state * state,
@@ -4035,17 +5974,95 @@ int whisper_full_with_state(
 
     result_all.clear();
 
-    // compute log mel spectrogram
-    if (params.speed_up) {
-        if (whisper_pcm_to_mel_phase_vocoder_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
-            log("%s: failed to compute log mel spectrogram\n", __func__);
-            return -1;
+    // a state may be reused for unrelated audio - without context carry-over, restart the sampling
+    // sequence so the result does not depend on what the state decoded before
+    if (params.no_context) {
+        state->rng = std::mt19937(0);
+    }
+
+    // [EXPERIMENTAL] pipelining: a second state encodes the window at seek + 30 s on n_threads_ahead
+    // extra threads while this one decodes. its result is used if the decoder ends the current
+    // window at 30 s, and discarded otherwise
+    whisper_state * state_ahead = nullptr;
+    if (params.n_threads_ahead > 0) {
+        if (state->state_ahead == nullptr) {
+            state->state_ahead = whisper_init_state(ctx);
+            if (state->state_ahead == nullptr) {
+                log("%s: failed to allocate the encode-ahead state, encoding serially\n", __func__);
+            }
         }
-    } else {
-        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
-            log("%s: failed to compute log mel spectrogram\n", __func__);
-            return -2;
+        state_ahead = state->state_ahead;
+    }
+
+    // the log mel spectrogram is computed one window at a time by the encoder, so memory use and
+    // the time to the first segment do not grow with the length of the audio
+    for (whisper_state * s : { state, state_ahead }) {
+        if (s == nullptr) {
+            continue;
+        }
+        if (params.speed_up) {
+            log_mel_spectrogram_lazy(samples, n_samples, 2*WHISPER_N_FFT, 2*WHISPER_HOP_LENGTH, WHISPER_N_MEL, 2*whisper_n_audio_ctx(ctx), true, s->mel);
+        } else {
+            log_mel_spectrogram_lazy(samples, n_samples, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, 2*whisper_n_audio_ctx(ctx), false, s->mel);
+        }
+    }
+
+    // the samples are only borrowed for the duration of this call
+    struct mel_release {
+        whisper_state * state;
+        ~mel_release() {
+            for (whisper_state * s : { state, state->state_ahead }) {
+                if (s != nullptr) {
+                    s->mel.samples   = nullptr;
+                    s->mel.n_samples = 0;
+                }
+            }
+        }
+    } release_mel = { state };
+
+    // the window being encoded by state_ahead. declared after release_mel, so that the encoder
+    // is joined before the samples are released
+    struct encode_ahead {
+        std::thread worker;
+        int  seek  = -1; // -1 - none
+        int  n_ctx = 0;
+        bool ok    = false;
+
+        // encoder_begin_callback already allowed the next window, see below
+        bool begun = false;
+
+        void join() {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+
+        ~encode_ahead() {
+            join();
+        }
+    } ahead;
+
+    // with encode batching, the windows of this call are encoded together with those of other states
+    struct encode_batching {
+        whisper_context * ctx;
+        bool enabled;
+
+        ~encode_batching() {
+            if (enabled) {
+                whisper_encode_sched_leave(*ctx);
+            }
         }
+    } encode_batch = { ctx, whisper_encode_sched_enter(*ctx) };
+
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    // (set before the language detection, which encodes too; -1 is resolved per window)
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        log("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = std::max(0, params.audio_ctx);
+    if (state_ahead != nullptr) {
+        state_ahead->exp_n_audio_ctx = std::max(0, params.audio_ctx);
     }
 
     // auto-detect language if not specified
@@ -4159,13 +6176,6 @@ int whisper_full_with_state(
         }
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        log("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
-
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx) };
     if (whisper_is_multilingual(ctx)) {
@@ -4185,12 +6195,8 @@ int whisper_full_with_state(
     prompt.reserve(whisper_n_text_ctx(ctx));
 
     // beam-search helpers
-    struct kv_buf {
-        std::vector<uint8_t> k;
-        std::vector<uint8_t> v;
-    };
-
-    std::vector<kv_buf> kv_bufs;
+    std::vector<int>     kv_parents; // decoder whose KV cache each decoder continues, -1 to keep its own
+    std::vector<uint8_t> kv_buf;     // blocks saved by kv_cache_fork()
 
     struct beam_candidate {
         int decoder_idx;
@@ -4217,17 +6223,70 @@ int whisper_full_with_state(
             break;
         }
 
-        if (params.encoder_begin_callback) {
+        // the callback is asked once per window, possibly already before the window was encoded ahead
+        if (params.encoder_begin_callback && !ahead.begun) {
             if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
                 log("%s: encoder_begin_callback returned false - aborting\n", __func__);
                 break;
             }
         }
+        ahead.begun = false;
+
+        // with an automatic audio_ctx, encode only the audio that is left, plus a margin
+        if (params.audio_ctx < 0) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_auto(ctx, seek_end - seek);
+        }
+
+        // encode audio features starting at offset seek, unless this window was encoded ahead
+        bool encoded = false;
+        if (ahead.seek >= 0) {
+            ahead.join();
+
+            state->t_mel_us    += state_ahead->t_mel_us;
+            state->t_encode_us += state_ahead->t_encode_us;
+            state->n_encode    += state_ahead->n_encode;
+            state_ahead->t_mel_us    = 0;
+            state_ahead->t_encode_us = 0;
+            state_ahead->n_encode    = 0;
+
+            if (ahead.ok && ahead.seek == seek) {
+                std::swap(state->kv_cross, state_ahead->kv_cross);
+                state->exp_n_audio_ctx = ahead.n_ctx;
+                state->n_encode_ahead_used++;
+                encoded = true;
+            }
+            ahead.seek = -1;
+        }
+
+        if (!encoded) {
+            const bool ok = encode_batch.enabled ?
+                whisper_encode_sched_step(*ctx, *state, seek, params.n_threads) :
+                whisper_encode_internal  (*ctx, *state, seek, params.n_threads);
+
+            if (!ok) {
+                log("%s: failed to encode\n", __func__);
+                return -6;
+            }
+        }
 
-        // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads)) {
-            log("%s: failed to encode\n", __func__);
-            return -6;
+        // encode the next window, assuming the decoder will end this one at 30 s. the callback is asked
+        // first, so that no window is encoded past the point where the caller stops. its answer stands
+        // for the next window even if that one starts earlier and the result ahead is discarded
+        if (state_ahead != nullptr && seek + 100*WHISPER_CHUNK_SIZE + 100 < seek_end &&
+            (!params.encoder_begin_callback || params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data))) {
+            const int n_threads_ahead = params.n_threads_ahead;
+
+            ahead.begun = true;
+
+            ahead.seek  = seek + 100*WHISPER_CHUNK_SIZE;
+            ahead.n_ctx = params.audio_ctx < 0 ? whisper_audio_ctx_auto(ctx, seek_end - ahead.seek) : state->exp_n_audio_ctx;
+            ahead.ok    = false;
+
+            state_ahead->exp_n_audio_ctx = ahead.n_ctx;
+            ahead.worker = std::thread([&ahead, ctx, state_ahead, n_threads_ahead]() {
+                ahead.ok = whisper_encode_internal(*ctx, *state_ahead, ahead.seek, n_threads_ahead);
+            });
+            state->n_encode_ahead++;
         }
 
         // if there is a very short audio segment left to process, we remove any past prompt since it tends
@@ -4269,6 +6328,7 @@ int whisper_full_with_state(
                 auto & decoder = state->decoders[j];
 
                 decoder.kv_self.n = 0;
+                kv_cache_blocks_reset(decoder.kv_self);
 
                 decoder.sequence.tokens.clear();
                 decoder.sequence.result_len       = 0;
@@ -4320,13 +6380,14 @@ int whisper_full_with_state(
 
                     state->decoders[0].kv_self.n += prompt.size();
 
-                    for (int j = 1; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                    // the other decoders start from the prompt of decoder 0
+                    kv_parents.assign(n_decoders_cur, 0);
+                    kv_parents[0] = -1;
 
-                        memcpy(decoder.kv_self.k->data, state->decoders[0].kv_self.k->data, ggml_nbytes(decoder.kv_self.k));
-                        memcpy(decoder.kv_self.v->data, state->decoders[0].kv_self.v->data, ggml_nbytes(decoder.kv_self.v));
+                    kv_cache_fork(*ctx, *state, kv_parents, kv_buf);
 
-                        decoder.kv_self.n += prompt.size();
+                    for (int j = 1; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
 
                         memcpy(decoder.probs.data(), state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
                         memcpy(decoder.logits.data(), state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
@@ -4337,26 +6398,13 @@ int whisper_full_with_state(
                 }
             }
 
+            // with decode batching, the steps of this loop are evaluated together with those of other states
+            const bool batching = whisper_decode_sched_enter(*ctx);
+
             for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
                 const int64_t t_start_sample_us = ggml_time_us();
 
-                // store the KV caches of all decoders when doing beam-search
                 if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    kv_bufs.resize(n_decoders_cur);
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
-
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
-
-                        kv_bufs[j].k.resize(ggml_nbytes(decoder.kv_self.k));
-                        kv_bufs[j].v.resize(ggml_nbytes(decoder.kv_self.v));
-
-                        memcpy(kv_bufs[j].k.data(), decoder.kv_self.k->data, kv_bufs[j].k.size());
-                        memcpy(kv_bufs[j].v.data(), decoder.kv_self.v->data, kv_bufs[j].v.size());
-                    }
-
                     beam_candidates.clear();
                 }
 
@@ -4405,6 +6453,8 @@ int whisper_full_with_state(
 
                     uint32_t cur_c = 0;
 
+                    kv_parents.assign(n_decoders_cur, -1);
+
                     for (int j = 0; j < n_decoders_cur; ++j) {
                         auto & decoder = state->decoders[j];
 
@@ -4422,12 +6472,14 @@ int whisper_full_with_state(
                         decoder.seek_delta = cur.seek_delta;
                         decoder.has_ts     = cur.has_ts;
 
-                        memcpy(decoder.kv_self.k->data, kv_bufs[cur.decoder_idx].k.data(), kv_bufs[cur.decoder_idx].k.size());
-                        memcpy(decoder.kv_self.v->data, kv_bufs[cur.decoder_idx].v.data(), kv_bufs[cur.decoder_idx].v.size());
+                        kv_parents[j] = cur.decoder_idx;
 
                         WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
                                             __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
                     }
+
+                    // only the blocks in which the caches of the beams differ are copied
+                    kv_cache_fork(*ctx, *state, kv_parents, kv_buf);
                 }
 
                 // update the decoder state
@@ -4534,35 +6586,60 @@ int whisper_full_with_state(
                 state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
                 // obtain logits for the next token
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+                // the active decoders are evaluated together, n_batch_max at a time
+                {
+                    const int n_batch_max = whisper_decode_batch_max(ctx->model.hparams);
 
-                    if (decoder.failed || decoder.completed) {
-                        continue;
-                    }
+                    whisper_batch_item batch_items [WHISPER_MAX_DECODERS];
+                    whisper_token      batch_tokens[WHISPER_MAX_DECODERS];
+
+                    int n_batch = 0;
+
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.failed || decoder.completed) {
+                            continue;
+                        }
 
-                    decoder.tokens_tmp.resize(1);
-                    decoder.tokens_tmp[0] = decoder.sequence.tokens.back().id;
+                        //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.sequence.tokens.back().id, decoder.kv_self.n, decoder.seek_delta);
 
-                    //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.tokens_tmp[0], decoder.kv_self.n, decoder.seek_delta);
+                        batch_items [n_batch] = { state, &decoder, decoder.kv_self.n };
+                        batch_tokens[n_batch] = decoder.sequence.tokens.back().id;
 
-                    if (!whisper_decode_internal(*ctx, *state, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, params.n_threads)) {
-                        log("%s: failed to decode\n", __func__);
-                        return -8;
+                        ++n_batch;
                     }
 
-                    {
+                    for (int i0 = 0; i0 < n_batch; i0 += n_batch_max) {
+                        const int n_cur = std::min(n_batch_max, n_batch - i0);
+
+                        const bool ok = batching ?
+                            whisper_decode_sched_step    (*ctx, *state, batch_items + i0, n_cur, batch_tokens + i0,    params.n_threads) :
+                            whisper_decode_batch_internal(*ctx, *state, batch_items + i0, n_cur, batch_tokens + i0, 1, params.n_threads);
+
+                        if (!ok) {
+                            log("%s: failed to decode\n", __func__);
+                            whisper_decode_sched_leave(*ctx);
+                            return -8;
+                        }
+
                         const int64_t t_start_sample_us = ggml_time_us();
 
-                        whisper_process_logits(*ctx, *state, params, decoder, t_cur);
+                        for (int b = 0; b < n_cur; ++b) {
+                            auto & decoder = *batch_items[i0 + b].decoder;
 
-                        ++decoder.kv_self.n;
+                            whisper_process_logits(*ctx, *state, params, decoder, t_cur, b);
+
+                            ++decoder.kv_self.n;
+                        }
 
                         state->t_sample_us += ggml_time_us() - t_start_sample_us;
                     }
                 }
             }
 
+            whisper_decode_sched_leave(*ctx);
+
             // rank the resulting sequences and select the best one
             {
                 double best_score = -INFINITY;
@@ -4623,6 +6700,27 @@ int whisper_full_with_state(
                 }
             }
 
+            // a reduced audio context can make the decoder fail where the full one would not:
+            // encode the window again with the full context and start over at the first temperature
+            if (it == 0 && params.audio_ctx < 0 && state->exp_n_audio_ctx > 0 && state->exp_n_audio_ctx < whisper_n_audio_ctx(ctx)) {
+                const auto & decoder = state->decoders[best_decoder_id];
+
+                if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
+                    WHISPER_PRINT_DEBUG("%s: failed to decode with audio_ctx = %d, using the full context\n", __func__, state->exp_n_audio_ctx);
+
+                    state->exp_n_audio_ctx = 0;
+                    state->n_fail_ctx++;
+
+                    if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads)) {
+                        log("%s: failed to encode\n", __func__);
+                        return -6;
+                    }
+
+                    it = -1;
+                    continue;
+                }
+            }
+
             WHISPER_PRINT_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
         }
 
@@ -4759,6 +6857,8 @@ int whisper_full_with_state(
         }
     }
 
+    state->seek = seek;
+
     return 0;
 }
 
@@ -4771,6 +6871,89 @@ int whisper_full(
     return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
 }
 
+// find a quiet point to split the audio near the sample `center`
+// returns the middle of the WHISPER_PARALLEL_QUIET_MS stretch with the lowest energy within
+// n_search samples of `center`, staying inside [i_min, i_max] and [0, n_samples]
+static int whisper_parallel_split(const float * samples, int n_samples, int i_min, int i_max, int center, int n_search) {
+    const int n_quiet = (WHISPER_SAMPLE_RATE*WHISPER_PARALLEL_QUIET_MS)/1000;
+
+    i_min = std::max(i_min, 0);
+    i_max = std::min(i_max, n_samples);
+
+    // no room between the neighbouring splits - stay as close to the previous one as allowed
+    if (i_min > i_max) {
+        return std::min(i_min, n_samples);
+    }
+
+    center = std::max(i_min, std::min(i_max, center));
+
+    // pad the region by half a window on each side, so the window sums are not biased by the edges
+    const int i0 = std::max(0,         std::max(i_min, center - n_search) - n_quiet/2);
+    const int i1 = std::min(n_samples, std::min(i_max, center + n_search) + n_quiet/2);
+
+    if (i1 - i0 <= n_quiet) {
+        return center;
+    }
+
+    // 10 ms resolution, summed over the quiet window below
+    const auto energy = get_signal_energy(samples + i0, i1 - i0, WHISPER_SAMPLE_RATE/200);
+
+    double sum = 0.0;
+    for (int i = 0; i < n_quiet; ++i) {
+        sum += energy[i];
+    }
+
+    int    best     = center;
+    double best_sum = 1e30;
+
+    for (int i = 0; ; ++i) {
+        const int mid = i0 + i + n_quiet/2;
+
+        // on ties (e.g. digital silence), prefer the split closest to the nominal cut
+        if (sum < best_sum || (sum == best_sum && std::abs(mid - center) < std::abs(best - center))) {
+            best     = mid;
+            best_sum = sum;
+        }
+
+        if (i + n_quiet >= i1 - i0) {
+            break;
+        }
+
+        sum += energy[i + n_quiet] - energy[i];
+    }
+
+    return best;
+}
+
+// split the audio in quiet regions near the nominal boundaries, so that words are not cut
+// split[i] is the first sample of chunk i, split[n_processors] is n_samples. the splits are
+// non-decreasing, so no chunk has a negative length
+static std::vector<int> whisper_parallel_splits(const float * samples, int n_samples, int offset_samples, int n_processors) {
+    offset_samples = std::max(0, std::min(offset_samples, n_samples));
+
+    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+
+    // search at most half a nominal chunk away, so the search regions of two splits do not overlap
+    const int n_search = std::min((WHISPER_SAMPLE_RATE*WHISPER_PARALLEL_SEARCH_MS)/1000, n_samples_per_processor/2);
+
+    std::vector<int> split(n_processors + 1);
+    split[0]            = offset_samples;
+    split[n_processors] = n_samples;
+    for (int i = 1; i < n_processors; ++i) {
+        const int center = offset_samples + i*n_samples_per_processor;
+
+        // keep at least half a nominal chunk between two splits
+        const int cur = whisper_parallel_split(samples, n_samples,
+                split[i - 1] + n_samples_per_processor/2,
+                n_samples - n_samples_per_processor/2,
+                center, n_search);
+
+        split[i] = std::max(split[i - 1], std::min(cur, n_samples));
+    }
+
+    return split;
+}
+
 int whisper_full_parallel(
         struct whisper_context * ctx,
         struct whisper_full_params params,
@@ -4782,22 +6965,31 @@ int whisper_full_parallel(
     }
     int ret = 0;
 
-    // prepare separate states for each thread
+    // separate states for each thread, from the pool of the context
     std::vector<whisper_state*> states;
 
     const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
     const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+    const int n_samples_overlap = (WHISPER_SAMPLE_RATE*WHISPER_PARALLEL_OVERLAP_MS)/1000;
+
+    const std::vector<int> split = whisper_parallel_splits(samples, n_samples, offset_samples, n_processors);
+
+    // each chunk also decodes n_samples_overlap samples past its end, so that a segment running
+    // over the split is completed by that chunk. the overlapping segments are de-duplicated below
+    auto chunk_end = [&](int i) {
+        return std::min(n_samples, split[i + 1] + (i == n_processors - 1 ? 0 : n_samples_overlap));
+    };
 
     // the calling thread will process the first chunk
     // while the other threads will process the remaining chunks
 
     std::vector<std::thread> workers(n_processors - 1);
     for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
+        // take a state for each thread
+        states.push_back(whisper_state_acquire(ctx));
 
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+        const int start_samples = split[i + 1];
+        const int n_samples_cur = chunk_end(i + 1) - start_samples;
 
         auto params_cur = params;
 
@@ -4820,32 +7012,80 @@ int whisper_full_parallel(
         // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
         params_cur.print_realtime = false;
 
+        // The segments of the first chunk past the split may still be dropped by the merge,
+        // so new_segment_callback is called for all chunks once they are merged.
+        params_cur.new_segment_callback = nullptr;
+        params_cur.new_segment_callback_user_data = nullptr;
+
         // Run the first transformation using default state but only for the first chunk.
-        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
+        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, chunk_end(0));
     }
 
     for (int i = 0; i < n_processors - 1; ++i) {
         workers[i].join();
     }
 
-    const int64_t offset_t = (int64_t) params.offset_ms/10.0;
+    auto & result_all = ctx->state->result_all;
+
+    // a chunk only keeps the segments that start before its split. the following chunk starts in
+    // a quiet region there, so it has the segments that start after it
+    auto t_split = [&](int i) {
+        return (100*(int64_t) split[i])/WHISPER_SAMPLE_RATE;
+    };
+
+    while (!result_all.empty() && result_all.back().t0 >= t_split(1)) {
+        result_all.pop_back();
+    }
+
+    const int n_segments_first = result_all.size();
+
+    if (params.new_segment_callback && n_segments_first > 0) {
+        params.new_segment_callback(ctx, ctx->state, n_segments_first, params.new_segment_callback_user_data);
+    }
 
     // combine results into result_state->result_all from all other states
     for (int i = 0; i < n_processors - 1; ++i) {
         auto& results_i = states[i]->result_all;
 
+        // timestamp offset of the chunk, in units of 10 ms
+        const int64_t offset_t = t_split(i + 1);
+
+        // end of the audio already covered by the previous chunks
+        const int64_t t_prev = result_all.empty() ? 0 : result_all.back().t1;
+
         for (auto& result : results_i) {
             // correct the segment timestamp taking into account the offset
-            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
+            result.t0 += offset_t;
+            result.t1 += offset_t;
+
+            if (i < n_processors - 2 && result.t0 >= t_split(i + 2)) {
+                break;
+            }
+
+            // the last segment of the previous chunk ran over the split and already contains this one
+            if ((result.t0 + result.t1)/2 < t_prev) {
+                continue;
+            }
+
+            if (!result_all.empty()) {
+                const auto & prev = result_all.back();
+
+                // the same text decoded at the end of the previous chunk
+                if (result.t0 < prev.t1 && result.text == prev.text) {
+                    continue;
+                }
 
+                // make sure that segments are not overlapping
+                result.t0 = std::max(result.t0, prev.t1);
+                result.t1 = std::max(result.t1, result.t0);
+            }
 
-            // make sure that segments are not overlapping
-            if (!ctx->state->result_all.empty()) {
-                result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
+            for (auto& token : result.tokens) {
+                if (token.t0 >= 0) token.t0 += offset_t;
+                if (token.t1 >= 0) token.t1 += offset_t;
             }
 
-            ctx->state->result_all.push_back(std::move(result));
+            result_all.push_back(std::move(result));
 
             // call the new_segment_callback for each segment
             if (params.new_segment_callback) {
@@ -4859,7 +7099,7 @@ int whisper_full_parallel(
         ctx->state->t_encode_us += states[i]->t_encode_us;
         ctx->state->t_decode_us += states[i]->t_decode_us;
 
-        whisper_free_state(states[i]);
+        whisper_state_release(ctx, states[i]);
     }
 
     // average the timings
@@ -4871,10 +7111,11 @@ int whisper_full_parallel(
     // print information about the audio boundaries
     log("\n");
     log("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        log("%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
+    for (int i = 1; i < n_processors; ++i) {
+        log("%s: split %d - %s (nominal %s)\n", __func__, i,
+                to_timestamp(t_split(i)).c_str(),
+                to_timestamp((100*(int64_t) (offset_samples + i*n_samples_per_processor))/WHISPER_SAMPLE_RATE).c_str());
     }
-    log("%s: the transcription quality may be degraded near these boundaries\n", __func__);
 
     return ret;
 }
@@ -4895,6 +7136,10 @@ int whisper_full_lang_id(struct whisper_context * ctx) {
     return ctx->state->lang_id;
 }
 
+int whisper_full_seek_from_state(struct whisper_state * state) {
+    return state->seek;
+}
+
 int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment) {
     return state->result_all[i_segment].t0;
 }
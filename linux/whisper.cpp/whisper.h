@@ -109,8 +109,43 @@ extern "C" {
     WHISPER_API struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size);
     WHISPER_API struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader);
 
+    // whisper_init_from_file() and whisper_init_from_file_no_state() memory-map the model file where
+    // possible. Tensors whose data is suitably aligned in the file are used in place, without a copy,
+    // and the mapping is shared by all processes that load the same file. In standard ggml model files
+    // almost no tensor is aligned, so they are still copied and gain nothing from the mapping.
+    // whisper_model_align() writes a copy of a model file in which all tensors are aligned, by padding
+    // the tensor names with zeros. The aligned format is specific to this build: other versions of
+    // whisper.cpp cannot read it, so keep the original file for them. path_model is never modified,
+    // and path_aligned must name a different file. Returns 0 on success
+    WHISPER_API int whisper_model_align(const char * path_model, const char * path_aligned);
+
     WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
 
+    // Pool of states owned by the context, for callers that run many transcriptions on one model
+    // whisper_state_acquire() returns an idle state from the pool, reset as if it was just created,
+    // or allocates a new one with whisper_init_state() when the pool is empty. Returns NULL on failure
+    // whisper_state_release() returns the state to the pool. Idle states are freed by whisper_free()
+    // Both are thread safe
+    WHISPER_API struct whisper_state * whisper_state_acquire(struct whisper_context * ctx);
+    WHISPER_API void                   whisper_state_release(struct whisper_context * ctx, struct whisper_state * state);
+
+    // Number of idle states in the pool of the context
+    WHISPER_API int whisper_state_pool_n_idle(struct whisper_context * ctx);
+
+    // Batch the encoder windows of concurrent whisper_full_with_state() calls on the context
+    // Each window waits for up to wait_us microseconds for the windows of the other states that are
+    // not decoding, and is then encoded together with them, see whisper_encode_batch()
+    // 0 (the default) disables batching
+    // Thread safe
+    WHISPER_API void whisper_set_encode_batching(struct whisper_context * ctx, int wait_us);
+
+    // Batch the decoder steps of concurrent whisper_full_with_state() calls on the context
+    // Each next-token step waits for up to wait_us microseconds for the steps of the other states
+    // that are decoding, and the steps are then evaluated as one decoder pass, so that the weights
+    // are read once per batch instead of once per state. 0 (the default) disables batching
+    // Thread safe
+    WHISPER_API void whisper_set_decode_batching(struct whisper_context * ctx, int wait_us);
+
     // Given a context, enable use of OpenVINO for encode inference.
     // model_path: Optional path to OpenVINO encoder IR model. If set to nullptr,
     //                      the path will be generated from the ggml model path that was passed
@@ -197,6 +232,19 @@ extern "C" {
                                int   offset,
                                int   n_threads);
 
+    // Run the encoder on one window of each of the n_states states, starting at offsets[i] in the
+    // spectrogram of states[i], and store the encoded features in each state.
+    // The states can belong to different requests or to independent chunks of one recording.
+    // Windows with the same audio context are evaluated together, up to 4 per pass, so that the
+    // encoder weights are read once per pass
+    // Returns 0 on success
+    WHISPER_API int whisper_encode_batch(
+            struct whisper_context * ctx,
+              struct whisper_state ** states,
+                         const int * offsets,
+                               int   n_states,
+                               int   n_threads);
+
     // Run the Whisper decoder to obtain the logits and probabilities for the next token.
     // Make sure to call whisper_encode() first.
     // tokens + n_tokens is the provided context for the decoder.
@@ -375,7 +423,7 @@ extern "C" {
         // [EXPERIMENTAL] speed-up techniques
         // note: these can significantly reduce the quality of the output
         bool speed_up;          // speed-up the audio by 2x using Phase Vocoder
-        int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        int  audio_ctx;         // overwrite the audio context size (0 = use default, -1 = fit each window to the remaining audio)
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
@@ -430,6 +478,10 @@ extern "C" {
         // called by each decoder to filter obtained logits
         whisper_logits_filter_callback logits_filter_callback;
         void * logits_filter_callback_user_data;
+
+        // [EXPERIMENTAL] encode the next window on this many extra threads while the current one is decoded (0 = off)
+        // only used if encoder_begin_callback (if any) allows the next window
+        int n_threads_ahead;
     };
 
     // NOTE: this function allocates memory, and it is the responsibility of the caller to free the pointer - see whisper_free_params()
@@ -456,7 +508,9 @@ extern "C" {
     // Result is stored in the default state of the context
     // Not thread safe if executed in parallel on the same context.
     // It seems this approach can offer some speedup in some cases.
-    // However, the transcription accuracy can be worse at the beginning and end of each chunk.
+    // The chunks are split at the quietest point within 2 s of the equal-length cuts, and each chunk
+    // decodes 1 s past its end. Segments that the previous chunk already covers are dropped.
+    // new_segment_callback is called once all chunks are done.
     WHISPER_API int whisper_full_parallel(
                 struct whisper_context * ctx,
             struct whisper_full_params   params,
@@ -475,6 +529,10 @@ extern "C" {
     // Language id associated with the provided state
     WHISPER_API int whisper_full_lang_id_from_state(struct whisper_state * state);
 
+    // Audio offset (in 10 ms frames, relative to the samples passed to whisper_full) where the
+    // last call stopped decoding, e.g. because encoder_begin_callback returned false
+    WHISPER_API int whisper_full_seek_from_state(struct whisper_state * state);
+
     // Get the start and end time of the specified segment
     WHISPER_API int64_t whisper_full_get_segment_t0           (struct whisper_context * ctx, int i_segment);
     WHISPER_API int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment);
@@ -1,12 +1,33 @@
+#include "whisper_ggml.h"
 #include "whisper.cpp/whisper.h"
+#include "whisper.cpp/ggml.h"
 
 #define DR_WAV_IMPLEMENTATION
 #include "whisper.cpp/examples/dr_wav.h"
 
+#include "whisper_ggml_flac.h"
+#include "whisper_ggml_model_cache.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <cinttypes>
+#include <cstdarg>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <stdio.h>
@@ -22,10 +43,317 @@ char *jsonToChar(json jsonData) noexcept
     return ch;
 }
 
+// Logging
+//
+// Architecture Decision: Lock-free in-memory ring buffer drained by a background thread
+// - Reason: Tracing must stay cheap enough to leave enabled in production; a log call only
+//   formats into a preallocated slot and never touches the file system or takes a lock
+// - Levels: WHISPER_GGML_LOG_MIN_LEVEL removes calls below it at compile time; the runtime level
+//   (WHISPER_GGML_LOG_LEVEL environment variable or whisper_ggml_log_set_level) filters the rest
+// - Sink: stderr by default, a file (WHISPER_GGML_LOG_FILE) or a user callback
+// - whisper.cpp messages are routed through the same buffer via whisper_set_log_callback
+// - Trade-off: When producers outpace the drain thread, records are dropped and counted
+//   instead of blocking the caller
+
+#ifndef WHISPER_GGML_LOG_MIN_LEVEL
+#define WHISPER_GGML_LOG_MIN_LEVEL WHISPER_GGML_LOG_LEVEL_DEBUG
+#endif
+
+class whisper_ggml_logger
+{
+public:
+    static whisper_ggml_logger &instance()
+    {
+        static whisper_ggml_logger logger;
+        return logger;
+    }
+
+    static int parse_level(const std::string &name)
+    {
+        if (name == "debug") return WHISPER_GGML_LOG_LEVEL_DEBUG;
+        if (name == "info") return WHISPER_GGML_LOG_LEVEL_INFO;
+        if (name == "warn") return WHISPER_GGML_LOG_LEVEL_WARN;
+        if (name == "error") return WHISPER_GGML_LOG_LEVEL_ERROR;
+        return WHISPER_GGML_LOG_LEVEL_NONE;
+    }
+
+    bool enabled(int level) const
+    {
+        return level >= min_level.load(std::memory_order_relaxed);
+    }
+
+    void set_level(int level)
+    {
+        min_level.store(level, std::memory_order_relaxed);
+    }
+
+#if defined(__GNUC__)
+    __attribute__((format(printf, 3, 4)))
+#endif
+    void write(int level, const char *fmt, ...)
+    {
+        va_list args;
+        va_start(args, fmt);
+        vwrite(level, fmt, args);
+        va_end(args);
+    }
+
+    void vwrite(int level, const char *fmt, va_list args)
+    {
+        std::call_once(drain_started, [this] { drain_thread = std::thread(&whisper_ggml_logger::drain_loop, this); });
+
+        // claim a slot (bounded MPMC queue with per-slot sequence numbers)
+        size_t pos = tail.load(std::memory_order_relaxed);
+        record *slot;
+        while (true)
+        {
+            slot = &records[pos % WHISPER_GGML_LOG_CAPACITY];
+            const size_t seq = slot->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                n_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            else
+            {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->level = level;
+        slot->time = std::chrono::system_clock::now();
+        slot->thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+        vsnprintf(slot->message, sizeof(slot->message), fmt, args);
+
+        slot->sequence.store(pos + 1, std::memory_order_release);
+
+        if (level >= WHISPER_GGML_LOG_LEVEL_ERROR)
+        {
+            wake.notify_one();
+        }
+    }
+
+    // nullptr restores the default stderr sink
+    void set_file(const char *path)
+    {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+
+        drain_locked();
+        close_file_locked();
+
+        if (path != nullptr && path[0] != '\0')
+        {
+            file = fopen(path, "a");
+        }
+    }
+
+    void set_sink(whisper_ggml_log_sink callback, void *user_data)
+    {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+
+        drain_locked();
+        sink = callback;
+        sink_user_data = user_data;
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(sink_mutex);
+
+        drain_locked();
+    }
+
+    ~whisper_ggml_logger()
+    {
+        whisper_set_log_callback(nullptr);
+
+        {
+            std::lock_guard<std::mutex> lock(sink_mutex);
+            stop = true;
+        }
+        wake.notify_one();
+
+        if (drain_thread.joinable())
+        {
+            drain_thread.join();
+        }
+
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        drain_locked();
+        close_file_locked();
+    }
+
+private:
+    static const size_t WHISPER_GGML_LOG_CAPACITY = 1024;
+
+    struct record
+    {
+        std::atomic<size_t> sequence;
+        int level;
+        std::chrono::system_clock::time_point time;
+        size_t thread;
+        char message[256];
+    };
+
+    whisper_ggml_logger()
+    {
+        for (size_t i = 0; i < WHISPER_GGML_LOG_CAPACITY; ++i)
+        {
+            records[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        const char *level = getenv("WHISPER_GGML_LOG_LEVEL");
+        if (level != nullptr)
+        {
+            min_level = parse_level(level);
+        }
+
+        const char *path = getenv("WHISPER_GGML_LOG_FILE");
+        if (path != nullptr && path[0] != '\0')
+        {
+            file = fopen(path, "a");
+        }
+
+        whisper_set_log_callback(whisper_log_line);
+    }
+
+    static void whisper_log_line(const char *line)
+    {
+        whisper_ggml_logger &logger = instance();
+        if (!logger.enabled(WHISPER_GGML_LOG_LEVEL_INFO))
+        {
+            return;
+        }
+
+        // whisper.cpp lines carry their own newline
+        int n = (int)strlen(line);
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+        {
+            n--;
+        }
+
+        logger.write(WHISPER_GGML_LOG_LEVEL_INFO, "whisper: %.*s", n, line);
+    }
+
+    void drain_loop()
+    {
+        std::unique_lock<std::mutex> lock(sink_mutex);
+
+        while (!stop)
+        {
+            drain_locked();
+            wake.wait_for(lock, std::chrono::milliseconds(50));
+        }
+    }
+
+    // single consumer: only called with sink_mutex held
+    void drain_locked()
+    {
+        static const char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+        bool written = false;
+
+        while (true)
+        {
+            record &slot = records[head % WHISPER_GGML_LOG_CAPACITY];
+            if (slot.sequence.load(std::memory_order_acquire) != head + 1)
+            {
+                break;
+            }
+
+            if (sink != nullptr)
+            {
+                sink((whisper_ggml_log_level)slot.level, slot.message, sink_user_data);
+            }
+            else
+            {
+                const std::time_t t = std::chrono::system_clock::to_time_t(slot.time);
+                const int ms = (int)(std::chrono::duration_cast<std::chrono::milliseconds>(slot.time.time_since_epoch()).count() % 1000);
+
+                std::tm tm;
+                localtime_r(&t, &tm);
+
+                char stamp[32];
+                strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+                fprintf(file ? file : stderr, "%s.%03d %-5s [%zx] %s\n", stamp, ms, level_names[slot.level], slot.thread & 0xffff, slot.message);
+                written = true;
+            }
+
+            slot.sequence.store(head + WHISPER_GGML_LOG_CAPACITY, std::memory_order_release);
+            head++;
+        }
+
+        const uint64_t dropped = n_dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0 && sink == nullptr)
+        {
+            fprintf(file ? file : stderr, "%" PRIu64 " log records dropped\n", dropped);
+            written = true;
+        }
+
+        if (written)
+        {
+            fflush(file ? file : stderr);
+        }
+    }
+
+    void close_file_locked()
+    {
+        if (file != nullptr)
+        {
+            fclose(file);
+            file = nullptr;
+        }
+    }
+
+    record records[WHISPER_GGML_LOG_CAPACITY];
+    std::atomic<size_t> tail{0};
+    size_t head = 0;
+
+    std::atomic<int> min_level{WHISPER_GGML_LOG_LEVEL_WARN};
+    std::atomic<uint64_t> n_dropped{0};
+
+    std::mutex sink_mutex;
+    std::condition_variable wake;
+    std::once_flag drain_started;
+    std::thread drain_thread;
+    bool stop = false;
+
+    FILE *file = nullptr;
+    whisper_ggml_log_sink sink = nullptr;
+    void *sink_user_data = nullptr;
+};
+
+// register the whisper.cpp log callback when the library is loaded
+static whisper_ggml_logger &g_logger = whisper_ggml_logger::instance();
+
+#define WHISPER_GGML_LOG(level, ...)                                                        \
+    do                                                                                      \
+    {                                                                                       \
+        if ((level) >= WHISPER_GGML_LOG_MIN_LEVEL && g_logger.enabled(level))               \
+        {                                                                                   \
+            g_logger.write(level, __VA_ARGS__);                                             \
+        }                                                                                   \
+    } while (0)
+
+#define WHISPER_GGML_LOG_DEBUG(...) WHISPER_GGML_LOG(WHISPER_GGML_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define WHISPER_GGML_LOG_INFO(...)  WHISPER_GGML_LOG(WHISPER_GGML_LOG_LEVEL_INFO, __VA_ARGS__)
+#define WHISPER_GGML_LOG_WARN(...)  WHISPER_GGML_LOG(WHISPER_GGML_LOG_LEVEL_WARN, __VA_ARGS__)
+#define WHISPER_GGML_LOG_ERROR(...) WHISPER_GGML_LOG(WHISPER_GGML_LOG_LEVEL_ERROR, __VA_ARGS__)
+
 struct whisper_params
 {
     int32_t seed = -1; // RNG seed, not used currently
     int32_t n_threads = std::min(4, (int32_t)std::thread::hardware_concurrency());
+    int32_t n_threads_ahead = 0;
 
     int32_t n_processors = 1;
     int32_t offset_t_ms = 0;
@@ -35,6 +363,7 @@ struct whisper_params
     int32_t max_len = 0;
     int32_t best_of = 5;
     int32_t beam_size = -1;
+    int32_t audio_ctx = 0; // 0 = full 30 s window, -1 = fit each window to the remaining audio
 
     float word_thold = 0.01f;
     float entropy_thold = 2.40f;
@@ -54,6 +383,7 @@ struct whisper_params
     bool print_colors = false;
     bool print_progress = false;
     bool no_timestamps = false;
+    bool split_on_word = false;
 
     std::string language = "en";
     std::string model = "models/ggml-base.en.bin";
@@ -64,340 +394,2401 @@ struct whisper_params
     std::vector<std::string> fname_out = {};
 };
 
-bool read_wav(const std::string &fname, std::vector<float> &pcmf32, std::vector<std::vector<float>> &pcmf32s, bool stereo)
-{
-    drwav wav;
-    std::vector<uint8_t> wav_data; // used for pipe input from stdin
+// Audio Conversion
+//
+// Architecture Decision: Convert any PCM WAV to 16 kHz mono float in-process
+// - Reason: Avoids spawning ffmpeg and writing a temporary WAV for common inputs
+// - Formats: dr_wav decodes 8/24/32-bit integer, float and A-law/mu-law samples to float;
+//   16-bit input takes a vectorized int16 -> float path
+// - Channels: Any number of channels is averaged to mono
+// - Rate: Polyphase windowed-sinc resampler with one filter per output phase, so every output
+//   sample is a single dot product over contiguous input samples
+// - SIMD: Explicit SSE/AVX/NEON for the hot loops, scalar fallback otherwise
 
-    if (fname == "-")
-    {
-        {
-            uint8_t buf[1024];
-            while (true)
-            {
-                const size_t n = fread(buf, 1, sizeof(buf), stdin);
-                if (n == 0)
-                {
-                    break;
-                }
-                wav_data.insert(wav_data.end(), buf, buf + n);
-            }
-        }
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-        if (drwav_init_memory(&wav, wav_data.data(), wav_data.size(), nullptr) == false)
-        {
-            fprintf(stderr, "error: failed to open WAV file from stdin\n");
-            return false;
-        }
+static float dot_f32(const float *a, const float *b, size_t n)
+{
+    size_t i = 0;
+    float sum = 0.0f;
 
-        fprintf(stderr, "%s: read %zu bytes from stdin\n", __func__, wav_data.size());
+#if defined(__AVX__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8)
+    {
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
     }
-    else if (drwav_init_file(&wav, fname.c_str(), nullptr) == false)
+    __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_add_ps(acc4, _mm_movehl_ps(acc4, acc4));
+    acc4 = _mm_add_ss(acc4, _mm_shuffle_ps(acc4, acc4, 1));
+    sum = _mm_cvtss_f32(acc4);
+#elif defined(__SSE2__)
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4)
     {
-        fprintf(stderr, "error: failed to open '%s' as WAV file\n", fname.c_str());
-        return false;
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
     }
-
-    if (wav.channels != 1 && wav.channels != 2)
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    sum = _mm_cvtss_f32(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4)
     {
-        fprintf(stderr, "%s: WAV file '%s' must be mono or stereo\n", __func__, fname.c_str());
-        return false;
+        acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
     }
+    float32x2_t acc2 = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    sum = vget_lane_f32(vpadd_f32(acc2, acc2), 0);
+#endif
 
-    if (stereo && wav.channels != 2)
+    for (; i < n; ++i)
     {
-        fprintf(stderr, "%s: WAV file '%s' must be stereo for diarization\n", __func__, fname.c_str());
-        return false;
+        sum += a[i] * b[i];
     }
 
-    if (wav.sampleRate != WHISPER_SAMPLE_RATE)
+    return sum;
+}
+
+static void s16_to_f32(const int16_t *src, float *dst, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    for (; i + 8 <= n; i += 8)
     {
-        fprintf(stderr, "%s: WAV file '%s' must be %i kHz\n", __func__, fname.c_str(), WHISPER_SAMPLE_RATE / 1000);
-        return false;
+        const __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        // sign-extend to 32 bit by placing each sample in the high half and shifting back
+        const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
     }
-
-    if (wav.bitsPerSample != 16)
+#elif defined(__ARM_NEON)
+    const float32x4_t scale = vdupq_n_f32(1.0f / 32768.0f);
+    for (; i + 8 <= n; i += 8)
     {
-        fprintf(stderr, "%s: WAV file '%s' must be 16-bit\n", __func__, fname.c_str());
-        return false;
+        const int16x8_t x = vld1q_s16(src + i);
+        vst1q_f32(dst + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(x))), scale));
+        vst1q_f32(dst + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(x))), scale));
     }
+#endif
 
-    const uint64_t n = wav_data.empty() ? wav.totalPCMFrameCount : wav_data.size() / (wav.channels * wav.bitsPerSample / 8);
-
-    std::vector<int16_t> pcm16;
-    pcm16.resize(n * wav.channels);
-    drwav_read_pcm_frames_s16(&wav, n, pcm16.data());
-    drwav_uninit(&wav);
-
-    // convert to mono, float
-    pcmf32.resize(n);
-    if (wav.channels == 1)
+    for (; i < n; ++i)
     {
-        for (uint64_t i = 0; i < n; i++)
-        {
-            pcmf32[i] = float(pcm16[i]) / 32768.0f;
-        }
+        dst[i] = float(src[i]) / 32768.0f;
     }
-    else
+}
+
+// Average interleaved frames of n_channels samples into one channel
+static void downmix_f32(const float *src, size_t n_frames, int n_channels, float *dst)
+{
+    if (n_channels == 2)
     {
-        for (uint64_t i = 0; i < n; i++)
+        for (size_t i = 0; i < n_frames; ++i)
         {
-            pcmf32[i] = float(pcm16[2 * i] + pcm16[2 * i + 1]) / 65536.0f;
+            dst[i] = 0.5f * (src[2 * i] + src[2 * i + 1]);
         }
+        return;
     }
 
-    if (stereo)
+    const float scale = 1.0f / n_channels;
+    for (size_t i = 0; i < n_frames; ++i)
     {
-        // convert to stereo, float
-        pcmf32s.resize(2);
+        const float *frame = src + i * n_channels;
 
-        pcmf32s[0].resize(n);
-        pcmf32s[1].resize(n);
-        for (uint64_t i = 0; i < n; i++)
+        float sum = 0.0f;
+        for (int c = 0; c < n_channels; ++c)
         {
-            pcmf32s[0][i] = float(pcm16[2 * i]) / 32768.0f;
-            pcmf32s[1][i] = float(pcm16[2 * i + 1]) / 32768.0f;
+            sum += frame[c];
         }
+        dst[i] = sum * scale;
     }
-
-    return true;
 }
 
-// FFI Symbol Export Strategy
-// 
-// Architecture Decision: Single exported function with C linkage
-// - Reason: Dart FFI requires C linkage for symbol resolution
-// - Visibility: Explicit export despite hidden default visibility
-// - Justification: Minimizes symbol pollution while ensuring FFI accessibility
+// Extract one channel of interleaved frames
+static void deinterleave_f32(const float *src, size_t n_frames, int n_channels, int channel, float *dst)
+{
+    for (size_t i = 0; i < n_frames; ++i)
+    {
+        dst[i] = src[i * n_channels + channel];
+    }
+}
 
-extern "C" __attribute__((visibility("default")))
-char* request(char* body)
+class whisper_resampler
 {
-    json requestJson;
-    json responseJson;
+public:
+    whisper_resampler(uint32_t rate_in, uint32_t rate_out)
+    {
+        const uint32_t g = gcd(rate_in, rate_out);
+        up = rate_out / g;
+        down = rate_in / g;
 
-    try {
-        // Debug: Log the incoming request to file
-        FILE* debug_log = fopen("/tmp/whisper_debug.log", "a");
-        if (debug_log) {
-            fprintf(debug_log, "DEBUG: request() called with body: %s\n", body);
-            fflush(debug_log);
-        }
-        
-        requestJson = json::parse(body);
-        std::string action = requestJson["@type"];
-        
-        if (debug_log) {
-            fprintf(debug_log, "DEBUG: action = %s\n", action.c_str());
-            fflush(debug_log);
-        }
-        
-        if (action == "getVersion") {
-            responseJson["@type"] = "getVersion";
-            responseJson["version"] = "1.0.0";
-            if (debug_log) {
-                fprintf(debug_log, "DEBUG: getVersion completed\n");
-                fflush(debug_log);
-            }
-        } else if (action == "getTextFromWavFile") {
-            if (debug_log) {
-                fprintf(debug_log, "DEBUG: Starting transcribe action\n");
-                fflush(debug_log);
-            }
-            // Initialize whisper
-            std::string modelPath = requestJson["model"];
-            if (debug_log) {
-                fprintf(debug_log, "DEBUG: Model path: %s\n", modelPath.c_str());
-                fflush(debug_log);
-            }
-            
-            if (debug_log) {
-                fprintf(debug_log, "DEBUG: About to call whisper_init_from_file\n");
-                fflush(debug_log);
-            }
-            
-            struct whisper_context *ctx = whisper_init_from_file(modelPath.c_str());
-            
-            if (ctx == nullptr) {
-                if (debug_log) {
-                    fprintf(debug_log, "DEBUG: Failed to initialize whisper model\n");
-                    fflush(debug_log);
-                }
-                responseJson["error"] = "Failed to initialize model";
-                return jsonToChar(responseJson);
-            }
-            
-            if (debug_log) {
-                fprintf(debug_log, "DEBUG: Whisper context initialized successfully\n");
-                fflush(debug_log);
-            }
+        // low-pass below the lower of the two Nyquist frequencies, in cycles per input sample
+        const double ratio = std::min(1.0, (double)rate_out / rate_in);
+        const double cutoff = 0.5 * ratio * 0.92;
+        const double zero_crossings = 16.0;
 
-            // Set up parameters
-            whisper_params params;
-            params.fname_inp = requestJson["audio"];
-            params.language = requestJson["language"];
-            params.translate = requestJson["is_translate"];
-            params.no_timestamps = requestJson["is_no_timestamps"];
-            params.n_threads = requestJson["threads"];
-            params.print_special_tokens = requestJson["is_special_tokens"];
+        half_taps = (int)std::ceil(zero_crossings / (2.0 * cutoff));
+        n_taps = 2 * half_taps;
 
-            if (debug_log) {
-                fprintf(debug_log, "DEBUG: Audio file path: %s\n", params.fname_inp.c_str());
-                fflush(debug_log);
-            }
+        // taps[p][j] weights input sample (i - half_taps + 1 + j) for output phase p, where the
+        // output lies p/up input samples after sample i
+        taps.resize((size_t)up * n_taps);
+        for (uint32_t p = 0; p < up; ++p)
+        {
+            float *phase = taps.data() + (size_t)p * n_taps;
 
-            // Read audio
-            std::vector<float> pcmf32;
-            std::vector<std::vector<float>> pcmf32s;
-            
-            if (debug_log) {
-                fprintf(debug_log, "DEBUG: About to read audio file\n");
-                fflush(debug_log);
-            }
-            
-            if (!read_wav(params.fname_inp, pcmf32, pcmf32s, params.diarize)) {
-                if (debug_log) {
-                    fprintf(debug_log, "DEBUG: Failed to read audio file\n");
-                    fflush(debug_log);
-                }
-                whisper_free(ctx);
-                responseJson["error"] = "Failed to read audio file";
-                return jsonToChar(responseJson);
-            }
+            double sum = 0.0;
+            for (int j = 0; j < n_taps; ++j)
+            {
+                const double t = (j - half_taps + 1) - (double)p / up;
+                const double x = 2.0 * cutoff * t;
+                const double sinc = x == 0.0 ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
 
-            if (debug_log) {
-                fprintf(debug_log, "DEBUG: Audio file read successfully, samples: %zu\n", pcmf32.size());
-                fflush(debug_log);
+                // Blackman window over [-half_taps, half_taps]
+                const double w = 0.5 + 0.5 * t / half_taps;
+                const double window = w <= 0.0 || w >= 1.0 ? 0.0 : 0.42 - 0.5 * std::cos(2.0 * M_PI * w) + 0.08 * std::cos(4.0 * M_PI * w);
+
+                phase[j] = (float)(sinc * window);
+                sum += phase[j];
             }
 
-            if (debug_log) {
-                fprintf(debug_log, "DEBUG: Setting up whisper inference parameters\n");
-                fflush(debug_log);
+            // unity gain at DC for every phase
+            for (int j = 0; j < n_taps; ++j)
+            {
+                phase[j] = (float)(phase[j] / sum);
             }
-            
-            // Run inference
-            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-            
-            wparams.print_realtime   = false;
-            wparams.print_progress   = params.print_progress;
-            wparams.print_timestamps = !params.no_timestamps;
-            wparams.print_special    = params.print_special_tokens;
-            wparams.translate        = params.translate;
-            wparams.language         = params.language.c_str();
-            wparams.n_threads        = params.n_threads;
-            wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
-            wparams.offset_ms        = params.offset_t_ms;
-            wparams.duration_ms      = params.duration_ms;
-            
-            wparams.token_timestamps = params.output_wts || params.max_len > 0;
-            wparams.thold_pt         = params.word_thold;
-            wparams.entropy_thold    = params.entropy_thold;
-            wparams.logprob_thold    = params.logprob_thold;
-            wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
+        }
 
-            wparams.speed_up         = params.speed_up;
+        buf.assign(n_taps, 0.0f);
+        buf_start = -n_taps;
+    }
 
-            wparams.greedy.best_of        = params.best_of;
-            wparams.beam_search.beam_size = params.beam_size;
+    // Resample a block of input, appending every output sample whose filter window is complete.
+    // Blocks can have any size; call flush() after the last one.
+    void push(const float *in, size_t n_in, std::vector<float> &out)
+    {
+        buf.insert(buf.end(), in, in + n_in);
+        n_in_total += n_in;
 
-            wparams.prompt_tokens    = nullptr;
-            wparams.prompt_n_tokens  = 0;
+        emit((int64_t)n_in_total - half_taps, out);
+    }
 
-            if (debug_log) {
-                fprintf(debug_log, "DEBUG: About to call whisper_full_parallel\n");
-                fflush(debug_log);
-            }
-            
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
-                if (debug_log) {
-                    fprintf(debug_log, "DEBUG: whisper_full_parallel failed\n");
-                    fflush(debug_log);
-                }
-                whisper_free(ctx);
-                responseJson["error"] = "Failed to process audio";
-                return jsonToChar(responseJson);
-            }
+    // Emit the remaining output, treating the input after the last block as silence
+    void flush(std::vector<float> &out)
+    {
+        const uint64_t n_out = (n_in_total * up + down - 1) / down;
 
-            if (debug_log) {
-                fprintf(debug_log, "DEBUG: whisper_full_parallel completed successfully\n");
-                fflush(debug_log);
-            }
+        buf.insert(buf.end(), n_taps, 0.0f);
+        emit((int64_t)n_in_total, out, n_out);
+    }
 
-            // Get results
-            const int n_segments = whisper_full_n_segments(ctx);
-            
-            if (debug_log) {
-                fprintf(debug_log, "DEBUG: Number of segments: %d\n", n_segments);
-                fflush(debug_log);
-            }
-            
-            responseJson["@type"] = "getTextFromWavFile";
-            responseJson["text"] = "";
-            
-            json segments = json::array();
-            
-            for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-                
-                if (debug_log) {
-                    fprintf(debug_log, "DEBUG: Segment %d: '%s'\n", i, text ? text : "null");
-                    fflush(debug_log);
-                }
-                
-                if (text) {
-                    responseJson["text"] = std::string(responseJson["text"]) + std::string(text);
-                }
-                
-                if (!params.no_timestamps) {
-                    json segment;
-                    segment["text"] = text ? text : "";
-                    segment["start"] = t0 * 10; // Convert to milliseconds
-                    segment["end"] = t1 * 10;
-                    segments.push_back(segment);
-                }
+    // Resample a complete signal
+    void process(const float *in, size_t n_in, std::vector<float> &out)
+    {
+        out.clear();
+        out.reserve((size_t)(((uint64_t)n_in * up + down - 1) / down));
+        push(in, n_in, out);
+        flush(out);
+    }
+
+private:
+    // Compute output samples while their center input sample is below i_end (and k < n_out)
+    void emit(int64_t i_end, std::vector<float> &out, uint64_t n_out = UINT64_MAX)
+    {
+        while (k_next < n_out)
+        {
+            const uint64_t pos = k_next * down;
+            const int64_t i = pos / up;
+            const uint32_t p = pos % up;
+
+            if (i >= i_end)
+            {
+                break;
             }
-            
-            responseJson["segments"] = segments;
-            
-            if (debug_log) {
-                fprintf(debug_log, "DEBUG: Final text: '%s'\n", std::string(responseJson["text"]).c_str());
-                fflush(debug_log);
+
+            const float *x = buf.data() + (i - half_taps + 1 - buf_start);
+            out.push_back(dot_f32(x, taps.data() + (size_t)p * n_taps, n_taps));
+            k_next++;
+        }
+
+        // drop input that no later output can reach
+        const int64_t i_next = (k_next * down) / up;
+        const int64_t n_drop = std::min<int64_t>(i_next - half_taps + 1 - buf_start, buf.size());
+        if (n_drop > 0)
+        {
+            buf.erase(buf.begin(), buf.begin() + n_drop);
+            buf_start += n_drop;
+        }
+    }
+
+    static uint32_t gcd(uint32_t a, uint32_t b)
+    {
+        while (b != 0)
+        {
+            const uint32_t t = a % b;
+            a = b;
+            b = t;
+        }
+        return a;
+    }
+
+    uint32_t up = 1;
+    uint32_t down = 1;
+    int half_taps = 0;
+    int n_taps = 0;
+    std::vector<float> taps; // up phases of n_taps coefficients
+
+    // streaming state: buf[0] holds input sample buf_start, negative indices are silence
+    std::vector<float> buf;
+    int64_t buf_start = 0;
+    uint64_t n_in_total = 0;
+    uint64_t k_next = 0;
+};
+
+// Incremental decoder producing 16 kHz float audio in blocks
+//
+// Architecture Decision: Decode on demand in fixed-size blocks instead of loading the whole file
+// - Reason: Multi-hour recordings would otherwise need the full interleaved PCM, a float copy
+//   and per-channel copies in memory before inference starts
+// - WAV: drwav_read_pcm_frames in blocks of WHISPER_AUDIO_BLOCK_FRAMES; stdin is read through
+//   dr_wav callbacks without buffering the whole stream
+// - FLAC: one frame at a time from whisper_flac_decoder
+// - Offset/duration: WAV seeks to the first frame; FLAC has no seek table support, so frames
+//   before the offset are decoded but never converted
+// - Each block goes through the downmix and the streaming resamplers, so memory use is bounded
+//   by what the caller keeps
+
+static const size_t WHISPER_AUDIO_BLOCK_FRAMES = 4096;
+
+class whisper_audio_reader
+{
+public:
+    whisper_audio_reader() = default;
+
+    ~whisper_audio_reader()
+    {
+        if (wav_open)
+        {
+            drwav_uninit(&wav);
+        }
+    }
+
+    whisper_audio_reader(const whisper_audio_reader &) = delete;
+    whisper_audio_reader &operator=(const whisper_audio_reader &) = delete;
+
+    // Open fname ("-" for a WAV stream on stdin), starting offset_ms into the audio and stopping
+    // after duration_ms (0 = until the end). stereo requires two channels for diarization.
+    bool open(const std::string &fname, int64_t offset_ms, int64_t duration_ms, bool stereo)
+    {
+        this->stereo = stereo;
+
+        if (is_flac_file(fname))
+        {
+            if (!flac.open(fname.c_str()))
+            {
+                WHISPER_GGML_LOG_ERROR("failed to open '%s' as FLAC file", fname.c_str());
+                return false;
+            }
+            is_flac = true;
+            sample_rate = flac.sample_rate;
+            n_channels = flac.channels;
+            bits_per_sample = flac.bits_per_sample;
+            total_frames = flac.total_samples;
+        }
+        else
+        {
+            if (fname == "-")
+            {
+                // sequential: dr_wav stops at the data chunk instead of seeking back to it
+                wav_open = drwav_init_ex(&wav, stdin_read, stdin_seek, nullptr, nullptr, nullptr, DRWAV_SEQUENTIAL, nullptr);
+            }
+            else
+            {
+                wav_open = drwav_init_file(&wav, fname.c_str(), nullptr);
+            }
+
+            if (!wav_open)
+            {
+                WHISPER_GGML_LOG_ERROR("failed to open '%s' as WAV file", fname == "-" ? "stdin" : fname.c_str());
+                return false;
+            }
+            sample_rate = wav.sampleRate;
+            n_channels = wav.channels;
+            bits_per_sample = wav.bitsPerSample;
+            total_frames = wav.totalPCMFrameCount;
+            pcm16 = wav.translatedFormatTag == DR_WAVE_FORMAT_PCM && wav.bitsPerSample == 16;
+        }
+
+        if (n_channels == 0)
+        {
+            WHISPER_GGML_LOG_ERROR("%s: '%s' has no channels", __func__, fname.c_str());
+            return false;
+        }
+
+        if (stereo && n_channels != 2)
+        {
+            WHISPER_GGML_LOG_ERROR("%s: '%s' must be stereo for diarization", __func__, fname.c_str());
+            return false;
+        }
+
+        if (sample_rate == 0)
+        {
+            WHISPER_GGML_LOG_ERROR("%s: '%s' has an invalid sample rate", __func__, fname.c_str());
+            return false;
+        }
+
+        resample = sample_rate != WHISPER_SAMPLE_RATE;
+        if (resample)
+        {
+            WHISPER_GGML_LOG_DEBUG("%s: converting '%s' from %u Hz, %u channel(s), %u-bit", __func__, fname.c_str(), sample_rate, n_channels, bits_per_sample);
+            resamplers.assign(stereo ? 3 : 1, whisper_resampler(sample_rate, WHISPER_SAMPLE_RATE));
+        }
+
+        const uint64_t offset_frames = (uint64_t)std::max<int64_t>(0, offset_ms) * sample_rate / 1000;
+        if (duration_ms > 0)
+        {
+            frames_left = (uint64_t)duration_ms * sample_rate / 1000;
+        }
+
+        if (offset_frames > 0)
+        {
+            if (total_frames > 0 && offset_frames >= total_frames)
+            {
+                frames_left = 0;
+            }
+            else if (is_flac)
+            {
+                frames_skip = offset_frames;
+            }
+            else if (!drwav_seek_to_pcm_frame(&wav, offset_frames))
+            {
+                WHISPER_GGML_LOG_ERROR("%s: failed to seek to %" PRId64 " ms in '%s'", __func__, offset_ms, fname.c_str());
+                return false;
+            }
+        }
+
+        if (total_frames > 0)
+        {
+            const uint64_t n_frames = std::min(frames_left, total_frames - std::min(total_frames, offset_frames));
+            n_expected = (size_t)(n_frames * WHISPER_SAMPLE_RATE / sample_rate) + 1;
+        }
+
+        return true;
+    }
+
+    // Append up to n samples to mono (and to each of the two channels when opened for stereo).
+    // Returns the number of samples appended; fewer than n only at the end of the audio.
+    size_t read(size_t n, std::vector<float> &mono, std::vector<std::vector<float>> *channels)
+    {
+        if (channels != nullptr)
+        {
+            channels->resize(stereo ? 2 : 0);
+        }
+
+        size_t n_read = 0;
+        while (n_read < n)
+        {
+            if (pending_pos == pending[0].size())
+            {
+                for (auto &buffer : pending)
+                {
+                    buffer.clear();
+                }
+                pending_pos = 0;
+
+                if (!decode_block())
+                {
+                    break;
+                }
+                continue;
+            }
+
+            const size_t k = std::min(n - n_read, pending[0].size() - pending_pos);
+            mono.insert(mono.end(), pending[0].begin() + pending_pos, pending[0].begin() + pending_pos + k);
+            if (channels != nullptr)
+            {
+                for (size_t c = 0; c < channels->size(); ++c)
+                {
+                    (*channels)[c].insert((*channels)[c].end(), pending[1 + c].begin() + pending_pos, pending[1 + c].begin() + pending_pos + k);
+                }
+            }
+
+            pending_pos += k;
+            n_read += k;
+        }
+
+        return n_read;
+    }
+
+    // true if decoding stopped on a corrupt block rather than at the end of the audio
+    bool failed() const
+    {
+        return error;
+    }
+
+    // Number of 16 kHz samples the remaining audio converts to, 0 if unknown
+    size_t expected_samples() const
+    {
+        return n_expected;
+    }
+
+private:
+    static bool is_flac_file(const std::string &fname)
+    {
+        if (fname == "-")
+        {
+            return false;
+        }
+
+        char magic[4] = { 0 };
+
+        FILE *f = fopen(fname.c_str(), "rb");
+        if (f == nullptr)
+        {
+            return false;
+        }
+        const size_t n = fread(magic, 1, sizeof(magic), f);
+        fclose(f);
+
+        return n == 4 && (memcmp(magic, "fLaC", 4) == 0 || (memcmp(magic, "ID3", 3) == 0 && whisper_flac_decoder().open(fname.c_str())));
+    }
+
+    static size_t stdin_read(void * /*user_data*/, void *buffer, size_t n)
+    {
+        return fread(buffer, 1, n, stdin);
+    }
+
+    // stdin is not seekable: dr_wav only skips forward over chunks, which is done by reading
+    static drwav_bool32 stdin_seek(void * /*user_data*/, int offset, drwav_seek_origin origin)
+    {
+        if (origin != drwav_seek_origin_current || offset < 0)
+        {
+            return DRWAV_FALSE;
+        }
+
+        char buffer[4096];
+        while (offset > 0)
+        {
+            const size_t n = fread(buffer, 1, std::min<size_t>(offset, sizeof(buffer)), stdin);
+            if (n == 0)
+            {
+                return DRWAV_FALSE;
+            }
+            offset -= n;
+        }
+        return DRWAV_TRUE;
+    }
+
+    // Append a block of samples to pending buffer `index` (0 = mono mix, 1 + c = channel c)
+    void emit(int index, const float *samples, size_t n)
+    {
+        if (resample)
+        {
+            resamplers[index].push(samples, n, pending[index]);
+        }
+        else
+        {
+            pending[index].insert(pending[index].end(), samples, samples + n);
+        }
+    }
+
+    size_t decode_wav_block()
+    {
+        const size_t n_want = (size_t)std::min<uint64_t>(WHISPER_AUDIO_BLOCK_FRAMES, frames_left);
+        if (n_want == 0)
+        {
+            return 0;
+        }
+
+        block.resize(n_want * n_channels);
+
+        size_t n = 0;
+        if (pcm16)
+        {
+            block_s16.resize(n_want * n_channels);
+            n = drwav_read_pcm_frames_s16(&wav, n_want, block_s16.data());
+            s16_to_f32(block_s16.data(), block.data(), n * n_channels);
+        }
+        else
+        {
+            n = drwav_read_pcm_frames_f32(&wav, n_want, block.data());
+        }
+        frames_left -= n;
+
+        if (n_channels == 1)
+        {
+            emit(0, block.data(), n);
+        }
+        else
+        {
+            mix.resize(n);
+            downmix_f32(block.data(), n, n_channels, mix.data());
+            emit(0, mix.data(), n);
+        }
+
+        if (stereo)
+        {
+            channel.resize(n);
+            for (int c = 0; c < 2; ++c)
+            {
+                deinterleave_f32(block.data(), n, n_channels, c, channel.data());
+                emit(1 + c, channel.data(), n);
+            }
+        }
+
+        return n;
+    }
+
+    size_t decode_flac_block()
+    {
+        while (frames_left > 0)
+        {
+            const int n = flac.decode_frame();
+            if (n < 0)
+            {
+                WHISPER_GGML_LOG_ERROR("%s: corrupt frame in FLAC file", __func__);
+                error = true;
+                return 0;
+            }
+            if (n == 0)
+            {
+                return 0;
+            }
+
+            // frames before the offset are decoded to find the next frame, but not converted
+            if ((uint64_t)n <= frames_skip)
+            {
+                frames_skip -= n;
+                continue;
+            }
+            const size_t begin = frames_skip;
+            const size_t count = (size_t)std::min<uint64_t>(n - begin, frames_left);
+            frames_skip = 0;
+            frames_left -= count;
+
+            const float scale = 1.0f / (float)(1u << (flac.frame_bits() - 1));
+
+            mix.assign(count, 0.0f);
+            channel.resize(count);
+            for (uint32_t c = 0; c < n_channels; ++c)
+            {
+                const int32_t *src = flac.channel(c) + begin;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    channel[i] = src[i] * scale;
+                    mix[i] += channel[i];
+                }
+
+                if (stereo)
+                {
+                    emit(1 + c, channel.data(), count);
+                }
+            }
+
+            const float gain = 1.0f / n_channels;
+            for (size_t i = 0; i < count; ++i)
+            {
+                mix[i] *= gain;
+            }
+            emit(0, mix.data(), count);
+
+            return count;
+        }
+
+        return 0;
+    }
+
+    // Decode the next block into the pending buffers; false once nothing is left
+    bool decode_block()
+    {
+        if (eof)
+        {
+            return false;
+        }
+
+        const size_t n = is_flac ? decode_flac_block() : decode_wav_block();
+        if (error)
+        {
+            eof = true;
+            return false;
+        }
+
+        if (n == 0)
+        {
+            eof = true;
+            if (resample)
+            {
+                for (size_t i = 0; i < resamplers.size(); ++i)
+                {
+                    resamplers[i].flush(pending[i]);
+                }
+            }
+            return !pending[0].empty();
+        }
+
+        return true;
+    }
+
+    bool stereo = false;
+    bool is_flac = false;
+    bool wav_open = false;
+    bool pcm16 = false;
+    bool resample = false;
+    bool eof = false;
+    bool error = false;
+
+    drwav wav;
+    whisper_flac_decoder flac;
+
+    uint32_t sample_rate = 0;
+    uint32_t n_channels = 0;
+    uint32_t bits_per_sample = 0;
+    uint64_t total_frames = 0;          // source frames, 0 if unknown
+    uint64_t frames_skip = 0;           // source frames still to drop before the offset
+    uint64_t frames_left = UINT64_MAX;  // source frames still to convert
+    size_t n_expected = 0;
+
+    std::vector<whisper_resampler> resamplers; // mono mix, then one per diarization channel
+
+    std::vector<int16_t> block_s16;
+    std::vector<float> block; // interleaved
+    std::vector<float> mix;
+    std::vector<float> channel;
+
+    // converted 16 kHz samples not yet handed out: mono mix, then the diarization channels
+    std::vector<float> pending[3];
+    size_t pending_pos = 0;
+};
+
+// Read a whole file through whisper_audio_reader
+bool read_audio(const std::string &fname, std::vector<float> &pcmf32, std::vector<std::vector<float>> &pcmf32s, bool stereo, int64_t offset_ms = 0, int64_t duration_ms = 0)
+{
+    whisper_audio_reader reader;
+    if (!reader.open(fname, offset_ms, duration_ms, stereo))
+    {
+        return false;
+    }
+
+    pcmf32.clear();
+    pcmf32s.clear();
+    pcmf32.reserve(reader.expected_samples());
+
+    while (reader.read(WHISPER_SAMPLE_RATE * 60, pcmf32, &pcmf32s) > 0)
+    {
+    }
+
+    return !reader.failed();
+}
+
+// Resident Model Cache (see src/whisper_ggml_model_cache.h)
+//
+// - States: each cached context keeps a pool of whisper_state objects, so requests reuse them
+//   instead of calling whisper_init_state every time; they are freed together with the context
+// - Decode batching: concurrent requests on the same model evaluate their next-token steps as one
+//   decoder pass (whisper_set_decode_batching), so the decoder weights are read once per step for
+//   all of them instead of once per request
+//   Trade-off: a step may wait up to WHISPER_GGML_DECODE_BATCH_US (or "setDecodeBatching") for the
+//   other requests; 0 disables batching
+// - Encode batching: the same for the 30 s windows (whisper_set_encode_batching). Disabled by
+//   default, since the encoder is compute bound and gains little on small models; enable it with
+//   WHISPER_GGML_ENCODE_BATCH_US or "setEncodeBatching" for batch jobs on medium and large models
+
+static const int WHISPER_GGML_DEFAULT_DECODE_BATCH_US = 2000;
+
+struct whisper_ggml_batching
+{
+    std::atomic<int> decode_us{WHISPER_GGML_DEFAULT_DECODE_BATCH_US};
+    std::atomic<int> encode_us{0};
+
+    static whisper_ggml_batching &instance()
+    {
+        static whisper_ggml_batching batching;
+        return batching;
+    }
+
+private:
+    whisper_ggml_batching()
+    {
+        const char *env_decode = getenv("WHISPER_GGML_DECODE_BATCH_US");
+        if (env_decode != nullptr)
+        {
+            decode_us = std::max(0, atoi(env_decode));
+        }
+
+        const char *env_encode = getenv("WHISPER_GGML_ENCODE_BATCH_US");
+        if (env_encode != nullptr)
+        {
+            encode_us = std::max(0, atoi(env_encode));
+        }
+    }
+};
+
+static whisper_model_cache &model_cache()
+{
+    // newly loaded models start with the current batching settings
+    static whisper_model_cache cache([](struct whisper_context *ctx)
+                                     {
+                                         whisper_set_decode_batching(ctx, whisper_ggml_batching::instance().decode_us);
+                                         whisper_set_encode_batching(ctx, whisper_ggml_batching::instance().encode_us);
+                                     });
+    return cache;
+}
+
+static void model_cache_set_decode_batching(int wait_us)
+{
+    whisper_ggml_batching::instance().decode_us = std::max(0, wait_us);
+    model_cache().visit([&](whisper_model_cache_entry &entry)
+                        { whisper_set_decode_batching(entry.ctx, whisper_ggml_batching::instance().decode_us); });
+}
+
+static void model_cache_set_encode_batching(int wait_us)
+{
+    whisper_ggml_batching::instance().encode_us = std::max(0, wait_us);
+    model_cache().visit([&](whisper_model_cache_entry &entry)
+                        { whisper_set_encode_batching(entry.ctx, whisper_ggml_batching::instance().encode_us); });
+}
+
+static json model_cache_stats()
+{
+    json models = json::array();
+    const whisper_model_cache_counters counters = model_cache().visit([&](whisper_model_cache_entry &entry)
+                                                                      {
+                                                                          json model;
+                                                                          model["path"] = entry.path;
+                                                                          model["size_bytes"] = entry.size_bytes;
+                                                                          model["users"] = entry.n_users;
+                                                                          model["idle_states"] = whisper_state_pool_n_idle(entry.ctx);
+                                                                          models.push_back(model);
+                                                                      });
+
+    json result;
+    result["budget_bytes"] = counters.budget_bytes;
+    result["total_bytes"] = counters.total_bytes;
+    result["hits"] = counters.n_hits;
+    result["misses"] = counters.n_misses;
+    result["evictions"] = counters.n_evictions;
+    result["decode_batch_us"] = whisper_ggml_batching::instance().decode_us.load();
+    result["encode_batch_us"] = whisper_ggml_batching::instance().encode_us.load();
+    result["models"] = models;
+
+    return result;
+}
+
+// Transcription Core
+//
+// Architecture Decision: One transcription path shared by request() and the session API
+// - A session pins a cache entry for its lifetime; request() opens a session per call, which is
+//   a cache lookup once the model is resident
+// - Each transcription borrows a whisper_state from the entry's pool and returns it afterwards
+
+struct whisper_ggml_session
+{
+    whisper_model_cache_entry *model = nullptr;
+};
+
+// Scoped loan of a whisper_state from a session's pool
+struct whisper_state_lease
+{
+    whisper_model_cache_entry *model = nullptr;
+    struct whisper_state *state = nullptr;
+
+    explicit whisper_state_lease(whisper_model_cache_entry *model) : model(model)
+    {
+        state = whisper_state_acquire(model->ctx);
+    }
+
+    ~whisper_state_lease()
+    {
+        if (state != nullptr)
+        {
+            whisper_state_release(model->ctx, state);
+        }
+    }
+
+    whisper_state_lease(const whisper_state_lease &) = delete;
+    whisper_state_lease &operator=(const whisper_state_lease &) = delete;
+};
+
+static whisper_full_params whisper_full_params_from(const whisper_params &params)
+{
+    whisper_full_params wparams = whisper_full_default_params(params.beam_size > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
+
+    wparams.print_realtime   = false;
+    wparams.print_progress   = params.print_progress;
+    wparams.print_timestamps = !params.no_timestamps;
+    wparams.print_special    = params.print_special_tokens;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.n_threads        = params.n_threads;
+    wparams.n_threads_ahead  = params.n_threads_ahead;
+    wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
+    wparams.offset_ms        = params.offset_t_ms;
+    wparams.duration_ms      = params.duration_ms;
+
+    wparams.token_timestamps = params.output_wts || params.max_len > 0;
+    wparams.thold_pt         = params.word_thold;
+    wparams.entropy_thold    = params.entropy_thold;
+    wparams.logprob_thold    = params.logprob_thold;
+    wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
+    wparams.split_on_word    = params.split_on_word;
+
+    wparams.speed_up         = params.speed_up;
+    wparams.audio_ctx        = params.audio_ctx;
+
+    wparams.greedy.best_of        = params.best_of;
+    wparams.beam_search.beam_size = params.beam_size;
+
+    wparams.prompt_tokens    = nullptr;
+    wparams.prompt_n_tokens  = 0;
+
+    return wparams;
+}
+
+// Limits the number of 30 s windows one whisper_full call may encode, and stops before the next
+// window once *abort is set
+struct whisper_encode_guard
+{
+    const std::atomic<bool> *abort = nullptr;
+    int n_windows = -1; // -1 = no limit
+};
+
+static bool whisper_ggml_encoder_begin(struct whisper_context * /*ctx*/, struct whisper_state * /*state*/, void *user_data)
+{
+    whisper_encode_guard *guard = (whisper_encode_guard *)user_data;
+    if (guard->abort != nullptr && guard->abort->load())
+    {
+        return false;
+    }
+    if (guard->n_windows == 0)
+    {
+        return false;
+    }
+    if (guard->n_windows > 0)
+    {
+        guard->n_windows--;
+    }
+    return true;
+}
+
+// Segments (and optionally tokens) collected from one or more whisper_full runs, with
+// timestamps in milliseconds from the start of the audio
+struct whisper_transcript
+{
+    bool with_tokens = false;
+    bool with_timestamps = false;
+
+    std::vector<whisper_ggml_result_segment> segments;
+    std::vector<whisper_ggml_result_token> tokens;
+    std::string text; // all segments, concatenated
+};
+
+// Append the state's last result, shifting its timestamps by t_offset_ms
+static void transcript_append(whisper_transcript &transcript, struct whisper_state *state, int64_t t_offset_ms)
+{
+    const int n_segments = whisper_full_n_segments_from_state(state);
+
+    for (int i = 0; i < n_segments; ++i)
+    {
+        const char *text = whisper_full_get_segment_text_from_state(state, i);
+        const size_t n = text ? strlen(text) : 0;
+
+        whisper_ggml_result_segment segment = {};
+        segment.t0_ms = whisper_full_get_segment_t0_from_state(state, i) * 10 + t_offset_ms;
+        segment.t1_ms = whisper_full_get_segment_t1_from_state(state, i) * 10 + t_offset_ms;
+        segment.text_offset = transcript.text.size();
+        segment.text_size = n;
+        segment.token_offset = transcript.tokens.size();
+        segment.n_tokens = 0;
+
+        transcript.text.append(text ? text : "", n);
+
+        if (transcript.with_tokens)
+        {
+            segment.n_tokens = whisper_full_n_tokens_from_state(state, i);
+            for (uint32_t j = 0; j < segment.n_tokens; ++j)
+            {
+                const whisper_token_data data = whisper_full_get_token_data_from_state(state, i, j);
+
+                whisper_ggml_result_token token;
+                token.id = data.id;
+                token.p = data.p;
+                token.t0_ms = transcript.with_timestamps ? data.t0 * 10 + t_offset_ms : -1;
+                token.t1_ms = transcript.with_timestamps ? data.t1 * 10 + t_offset_ms : -1;
+                transcript.tokens.push_back(token);
+            }
+        }
+
+        transcript.segments.push_back(segment);
+    }
+}
+
+// Run whisper_full over caller-owned samples on a state borrowed from the session's pool.
+// Returns an error message, or nullptr on success.
+static const char *run_transcription(whisper_ggml_session *session, const whisper_params &params, const float *samples, int n_samples, const std::atomic<bool> *abort, int64_t t_offset_ms, whisper_transcript &transcript)
+{
+    whisper_state_lease lease(session->model);
+    if (lease.state == nullptr)
+    {
+        return "Failed to initialize state";
+    }
+
+    whisper_full_params wparams = whisper_full_params_from(params);
+    wparams.token_timestamps = wparams.token_timestamps || transcript.with_timestamps;
+
+    whisper_encode_guard guard;
+    guard.abort = abort;
+    wparams.encoder_begin_callback = whisper_ggml_encoder_begin;
+    wparams.encoder_begin_callback_user_data = &guard;
+
+    if (whisper_full_with_state(session->model->ctx, lease.state, wparams, samples, n_samples) != 0)
+    {
+        return "Failed to process audio";
+    }
+
+    transcript_append(transcript, lease.state, t_offset_ms);
+
+    return nullptr;
+}
+
+// Architecture Decision: Feed long recordings to whisper_full one 30 s window at a time
+// - Reason: Only the current window (plus WHISPER_WINDOW_CONTEXT_MS of lookahead for its last
+//   mel frames) is decoded from the file and held in memory, independent of the file length
+// - Each call encodes exactly one window; the next window starts where whisper_full stopped,
+//   which is where it would have placed the next window itself, and continues from the state's
+//   prompt (no_context = false) so context carries across windows as in a single call
+// - The final window is left to whisper_full without a limit
+// - With n_threads_ahead, each call covers WHISPER_WINDOWS_AHEAD windows instead, so that
+//   whisper_full can encode the next window while it decodes the current one
+// - whisper_full normalizes the log-mel spectrogram per window, so a window sees the same
+//   input here as in a single call over the whole recording
+
+static const int64_t WHISPER_WINDOW_CONTEXT_MS = 1000;
+static const int WHISPER_WINDOWS_AHEAD = 4;
+
+static const char *run_transcription(whisper_ggml_session *session, const whisper_params &params, whisper_audio_reader &reader, const std::atomic<bool> *abort, whisper_transcript &transcript)
+{
+    whisper_state_lease lease(session->model);
+    if (lease.state == nullptr)
+    {
+        return "Failed to initialize state";
+    }
+
+    struct whisper_context *ctx = session->model->ctx;
+    struct whisper_state *state = lease.state;
+
+    // offset and duration were applied by the reader
+    whisper_full_params wparams = whisper_full_params_from(params);
+    wparams.token_timestamps = wparams.token_timestamps || transcript.with_timestamps;
+    wparams.offset_ms = 0;
+    wparams.duration_ms = 0;
+
+    whisper_encode_guard guard;
+    guard.abort = abort;
+    wparams.encoder_begin_callback = whisper_ggml_encoder_begin;
+    wparams.encoder_begin_callback_user_data = &guard;
+
+    const int n_chunks = params.n_threads_ahead > 0 ? WHISPER_WINDOWS_AHEAD : 1;
+    const size_t n_window = (size_t)n_chunks * WHISPER_CHUNK_SIZE * WHISPER_SAMPLE_RATE;
+    const size_t n_context = (size_t)WHISPER_WINDOW_CONTEXT_MS * WHISPER_SAMPLE_RATE / 1000;
+
+    std::vector<float> window;
+    window.reserve(n_window + n_context);
+    uint64_t window_start = 0; // in samples from the reader's start
+
+    while (true)
+    {
+        const size_t n_want = n_window + n_context - window.size();
+        const bool last = reader.read(n_want, window, nullptr) < n_want;
+        if (reader.failed())
+        {
+            return "Failed to read audio file";
+        }
+        if (window.empty())
+        {
+            break;
+        }
+
+        guard.n_windows = last ? -1 : n_chunks;
+        if (whisper_full_with_state(ctx, state, wparams, window.data(), window.size()) != 0)
+        {
+            return "Failed to process audio";
+        }
+
+        transcript_append(transcript, state, params.offset_t_ms + (int64_t)(window_start * 1000 / WHISPER_SAMPLE_RATE));
+
+        if (last || (abort != nullptr && abort->load()))
+        {
+            break;
+        }
+
+        // continue where whisper_full stopped; the last segment may end after that point
+        size_t n_advance = std::min(n_window, (size_t)std::max(0, whisper_full_seek_from_state(state)) * WHISPER_SAMPLE_RATE / 100);
+        if (n_advance == 0)
+        {
+            n_advance = n_window;
+        }
+
+        window.erase(window.begin(), window.begin() + n_advance);
+        window_start += n_advance;
+        wparams.no_context = false;
+
+        // detect the language once, on the first window, as a single call would
+        if (params.language.empty() || params.language == "auto")
+        {
+            wparams.language = whisper_lang_str(whisper_full_lang_id_from_state(state));
+        }
+    }
+
+    return nullptr;
+}
+
+static json transcript_json(const whisper_params &params, const whisper_transcript &transcript)
+{
+    json responseJson;
+    json segments = json::array();
+
+    if (!params.no_timestamps)
+    {
+        for (const auto &segment : transcript.segments)
+        {
+            json item;
+            item["text"] = transcript.text.substr(segment.text_offset, segment.text_size);
+            item["start"] = segment.t0_ms;
+            item["end"] = segment.t1_ms;
+            segments.push_back(std::move(item));
+        }
+    }
+
+    responseJson["@type"] = "getTextFromWavFile";
+    responseJson["text"] = transcript.text;
+    responseJson["segments"] = std::move(segments);
+
+    return responseJson;
+}
+
+static json transcribe_pcm(whisper_ggml_session *session, const whisper_params &params, const float *samples, int n_samples, const std::atomic<bool> *abort = nullptr, int64_t t_offset_ms = 0)
+{
+    whisper_transcript transcript;
+
+    const char *error = run_transcription(session, params, samples, n_samples, abort, t_offset_ms, transcript);
+    if (error != nullptr)
+    {
+        json responseJson;
+        responseJson["error"] = error;
+        return responseJson;
+    }
+
+    return transcript_json(params, transcript);
+}
+
+// Binary Result Layout
+//
+// Architecture Decision: One allocation holding header, segment table, token table and text
+// - Reason: Long transcripts with per-token data are expensive to build, serialize and parse
+//   as JSON; the transcript's tables are copied into a single buffer that is read in place
+// - All offsets are relative to the start of the buffer; tables are 8-byte aligned
+
+static size_t align_up(size_t n, size_t alignment)
+{
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+static void *binary_error(const char *message)
+{
+    const size_t text_size = strlen(message);
+    const size_t size = sizeof(whisper_ggml_result_header) + text_size + 1;
+
+    char *buffer = new char[size];
+
+    whisper_ggml_result_header header = {};
+    header.magic = WHISPER_GGML_RESULT_MAGIC;
+    header.version = WHISPER_GGML_RESULT_VERSION;
+    header.error = 1;
+    header.size = size;
+    header.text_offset = sizeof(whisper_ggml_result_header);
+    header.text_size = text_size;
+
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + header.text_offset, message, text_size + 1);
+
+    return buffer;
+}
+
+static void *transcript_binary(const whisper_transcript &transcript, uint32_t flags)
+{
+    const size_t n_segments = transcript.segments.size();
+    const size_t n_tokens = transcript.tokens.size();
+    const size_t text_size = transcript.text.size();
+
+    whisper_ggml_result_header header = {};
+    header.magic = WHISPER_GGML_RESULT_MAGIC;
+    header.version = WHISPER_GGML_RESULT_VERSION;
+    header.flags = flags;
+    header.n_segments = n_segments;
+    header.n_tokens = n_tokens;
+    header.segments_offset = align_up(sizeof(whisper_ggml_result_header), 8);
+    header.tokens_offset = align_up(header.segments_offset + n_segments * sizeof(whisper_ggml_result_segment), 8);
+    header.text_offset = header.tokens_offset + n_tokens * sizeof(whisper_ggml_result_token);
+    header.text_size = text_size;
+    header.size = header.text_offset + text_size + 1;
+
+    char *buffer = new char[header.size];
+    memcpy(buffer, &header, sizeof(header));
+    if (n_segments > 0)
+    {
+        memcpy(buffer + header.segments_offset, transcript.segments.data(), n_segments * sizeof(whisper_ggml_result_segment));
+    }
+    if (n_tokens > 0)
+    {
+        memcpy(buffer + header.tokens_offset, transcript.tokens.data(), n_tokens * sizeof(whisper_ggml_result_token));
+    }
+    memcpy(buffer + header.text_offset, transcript.text.c_str(), text_size + 1);
+
+    return buffer;
+}
+
+static void transcript_init_binary(whisper_transcript &transcript, uint32_t flags)
+{
+    transcript.with_tokens = (flags & (WHISPER_GGML_RESULT_TOKENS | WHISPER_GGML_RESULT_TOKEN_TIMESTAMPS)) != 0;
+    transcript.with_timestamps = (flags & WHISPER_GGML_RESULT_TOKEN_TIMESTAMPS) != 0;
+}
+
+static void *transcribe_pcm_binary(whisper_ggml_session *session, const whisper_params &params, const float *samples, int n_samples, uint32_t flags)
+{
+    whisper_transcript transcript;
+    transcript_init_binary(transcript, flags);
+
+    const char *error = run_transcription(session, params, samples, n_samples, nullptr, 0, transcript);
+
+    return error != nullptr ? binary_error(error) : transcript_binary(transcript, flags);
+}
+
+// Read the whole input, seeking to params.offset_t_ms and stopping after params.duration_ms.
+// Transcribe the result with whisper_params_for_loaded(params).
+static bool load_audio(const whisper_params &params, std::vector<float> &pcmf32)
+{
+    std::vector<std::vector<float>> pcmf32s;
+
+    return read_audio(params.fname_inp, pcmf32, pcmf32s, params.diarize, params.offset_t_ms, params.duration_ms);
+}
+
+// Parameters for audio returned by load_audio, whose offset and duration were already applied
+static whisper_params whisper_params_for_loaded(const whisper_params &params)
+{
+    whisper_params loaded = params;
+    loaded.offset_t_ms = 0;
+    loaded.duration_ms = 0;
+
+    return loaded;
+}
+
+static const char *transcribe_file(whisper_ggml_session *session, const whisper_params &params, const std::atomic<bool> *abort, whisper_transcript &transcript)
+{
+    whisper_audio_reader reader;
+    if (!reader.open(params.fname_inp, params.offset_t_ms, params.duration_ms, params.diarize))
+    {
+        return "Failed to read audio file";
+    }
+
+    return run_transcription(session, params, reader, abort, transcript);
+}
+
+static json transcribe_file(whisper_ggml_session *session, const whisper_params &params, const std::atomic<bool> *abort = nullptr)
+{
+    whisper_transcript transcript;
+
+    const char *error = transcribe_file(session, params, abort, transcript);
+    if (error != nullptr)
+    {
+        json responseJson;
+        responseJson["error"] = error;
+        return responseJson;
+    }
+
+    return transcript_json(params, transcript);
+}
+
+static void *transcribe_file_binary(whisper_ggml_session *session, const whisper_params &params, uint32_t flags)
+{
+    whisper_transcript transcript;
+    transcript_init_binary(transcript, flags);
+
+    const char *error = transcribe_file(session, params, nullptr, transcript);
+
+    return error != nullptr ? binary_error(error) : transcript_binary(transcript, flags);
+}
+
+static whisper_params whisper_params_from(const whisper_ggml_params &cparams)
+{
+    whisper_params params;
+
+    params.n_threads = cparams.n_threads;
+    params.offset_t_ms = cparams.offset_ms;
+    params.duration_ms = cparams.duration_ms;
+    params.max_len = cparams.max_len;
+    params.best_of = cparams.best_of;
+    params.beam_size = cparams.beam_size;
+    params.audio_ctx = cparams.audio_ctx;
+    params.translate = cparams.translate;
+    params.no_timestamps = cparams.no_timestamps;
+    params.print_special_tokens = cparams.special_tokens;
+    params.split_on_word = cparams.split_on_word;
+    params.speed_up = cparams.speed_up;
+    params.language = cparams.language ? cparams.language : "auto";
+    params.n_threads_ahead = cparams.n_threads_ahead;
+
+    return params;
+}
+
+// Streaming Transcription
+//
+// Architecture Decision: Sliding window over a ring buffer of recent PCM
+// - Audio is pushed in small chunks; every step the current window (at most length_ms) is
+//   decoded again as a single segment and reported as a partial result
+// - When the window is full its text becomes final, the last keep_ms of audio is kept as
+//   overlap and the decoded tokens are carried into the next window as prompt_tokens
+// - Only the tail window is ever decoded, with audio_ctx reduced to the window length,
+//   so the cost of a step does not grow with the length of the stream
+// - Trade-off: words spanning a window boundary may be repeated or cut within keep_ms
+
+// Fixed-capacity circular buffer of samples, linearized on read for whisper_full_with_state
+class whisper_pcm_ring
+{
+public:
+    explicit whisper_pcm_ring(size_t capacity) : data(capacity) {}
+
+    size_t size() const { return n; }
+    size_t capacity() const { return data.size(); }
+
+    void push(const float *samples, size_t n_samples)
+    {
+        for (size_t i = 0; i < n_samples; ++i)
+        {
+            data[(head + n) % data.size()] = samples[i];
+            if (n < data.size())
+            {
+                n++;
+            }
+            else
+            {
+                head = (head + 1) % data.size();
+            }
+        }
+    }
+
+    // keep only the newest n_keep samples
+    void keep_tail(size_t n_keep)
+    {
+        n_keep = std::min(n_keep, n);
+        head = (head + n - n_keep) % data.size();
+        n = n_keep;
+    }
+
+    void copy_to(std::vector<float> &out) const
+    {
+        out.resize(n);
+        const size_t n0 = std::min(n, data.size() - head);
+        std::copy(data.begin() + head, data.begin() + head + n0, out.begin());
+        std::copy(data.begin(), data.begin() + (n - n0), out.begin() + n0);
+    }
+
+private:
+    std::vector<float> data;
+    size_t head = 0;
+    size_t n = 0;
+};
+
+struct whisper_ggml_stream
+{
+    whisper_ggml_session *session = nullptr;
+    std::unique_ptr<whisper_state_lease> lease; // one state for the lifetime of the stream
+
+    whisper_params params;
+
+    size_t n_step = 0; // samples
+    size_t n_keep = 0; // samples
+    int32_t audio_ctx = 0;
+    int32_t max_tokens = 0;
+
+    whisper_pcm_ring ring;
+    size_t n_new = 0;       // samples pushed since the last decode
+    int64_t n_pushed = 0;   // total samples pushed
+
+    std::vector<whisper_token> prompt_tokens; // tokens of the last finalized window
+
+    std::vector<float> window;  // linearized ring, reused across steps
+    std::vector<float> scratch; // int16 conversion, reused across pushes
+
+    whisper_ggml_stream(size_t n_window) : ring(n_window) {}
+};
+
+// Decode the current window and append its segments to "partial" or "final"
+static bool stream_decode(whisper_ggml_stream &stream, bool finalize, json &responseJson)
+{
+    struct whisper_context *ctx = stream.session->model->ctx;
+    struct whisper_state *state = stream.lease->state;
+
+    stream.ring.copy_to(stream.window);
+    stream.n_new = 0;
+
+    const int64_t t_window_ms = (stream.n_pushed - (int64_t)stream.window.size()) * 1000 / WHISPER_SAMPLE_RATE;
+    const int64_t window_ms = (int64_t)stream.window.size() * 1000 / WHISPER_SAMPLE_RATE;
+
+    whisper_full_params wparams = whisper_full_params_from(stream.params);
+
+    wparams.print_timestamps = false;
+    wparams.single_segment   = true;
+    wparams.no_context       = true;
+    wparams.audio_ctx        = stream.audio_ctx;
+    wparams.max_tokens       = stream.max_tokens;
+    wparams.prompt_tokens    = stream.prompt_tokens.empty() ? nullptr : stream.prompt_tokens.data();
+    wparams.prompt_n_tokens  = stream.prompt_tokens.size();
+
+    if (whisper_full_with_state(ctx, state, wparams, stream.window.data(), stream.window.size()) != 0)
+    {
+        responseJson["error"] = "Failed to process audio";
+        return false;
+    }
+
+    // only the newest partial is relevant, and it is obsolete once its window is finalized
+    responseJson["partial"] = json::array();
+
+    json &segments = responseJson[finalize ? "final" : "partial"];
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+    for (int i = 0; i < n_segments; ++i)
+    {
+        const char *text = whisper_full_get_segment_text_from_state(state, i);
+
+        json segment;
+        segment["text"] = text ? text : "";
+        // a single segment ends at the end of the 30 s decoder window, past the audio we have
+        segment["start"] = t_window_ms + std::min(whisper_full_get_segment_t0_from_state(state, i) * 10, window_ms);
+        segment["end"] = t_window_ms + std::min(whisper_full_get_segment_t1_from_state(state, i) * 10, window_ms);
+        segments.push_back(segment);
+    }
+
+    if (finalize)
+    {
+        stream.prompt_tokens.clear();
+        for (int i = 0; i < n_segments; ++i)
+        {
+            const int n_tokens = whisper_full_n_tokens_from_state(state, i);
+            for (int j = 0; j < n_tokens; ++j)
+            {
+                const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
+                if (id < whisper_token_eot(ctx))
+                {
+                    stream.prompt_tokens.push_back(id);
+                }
+            }
+        }
+
+        stream.ring.keep_tail(stream.n_keep);
+    }
+
+    return true;
+}
+
+// Append samples, decoding every n_step samples and finalizing whenever the window is full
+static json stream_push(whisper_ggml_stream &stream, const float *samples, size_t n_samples)
+{
+    json responseJson;
+    responseJson["@type"] = "streamUpdate";
+    responseJson["partial"] = json::array();
+    responseJson["final"] = json::array();
+
+    bool decoded = false;
+
+    while (n_samples > 0)
+    {
+        const size_t n = std::min(n_samples, std::min(stream.ring.capacity() - stream.ring.size(), stream.n_step - stream.n_new));
+
+        stream.ring.push(samples, n);
+        stream.n_new += n;
+        stream.n_pushed += n;
+        samples += n;
+        n_samples -= n;
+
+        const bool full = stream.ring.size() == stream.ring.capacity();
+        if (stream.n_new >= stream.n_step || full)
+        {
+            if (!stream_decode(stream, full, responseJson))
+            {
+                return responseJson;
+            }
+            decoded = true;
+        }
+    }
+
+    return decoded ? responseJson : json();
+}
+
+// Batch Transcription
+//
+// Architecture Decision: One loader thread prefetching audio for n_parallel transcription workers
+// - Reason: Large batches of short files are dominated by per-file setup; the model is loaded
+//   once, states are reused from the session's pool, and WAV decoding overlaps with inference
+// - Prefetch: The loader stays at most 2 * n_parallel files ahead to bound memory use
+// - Results: Reported per file as they complete, in completion order; the callback is
+//   serialized so it does not need to be thread-safe
+
+struct batch_audio
+{
+    int32_t index = 0;
+    std::string error; // empty if the audio was loaded
+    std::vector<float> pcmf32;
+};
+
+static json transcribe_batch(whisper_ggml_session *session, const std::vector<std::string> &paths, const whisper_params &params, int32_t n_parallel, const std::function<void(int32_t, json &)> &on_result)
+{
+    const auto t_start = std::chrono::steady_clock::now();
+
+    n_parallel = std::max(1, std::min(n_parallel, (int32_t)paths.size()));
+    const size_t n_prefetch = 2 * n_parallel;
+
+    std::mutex mutex;
+    std::condition_variable loaded;   // audio became available, or loading finished
+    std::condition_variable consumed; // room for more prefetched audio
+    std::deque<batch_audio> ready;
+    bool loading_done = false;
+
+    std::mutex result_mutex;
+    int32_t n_failed = 0;
+    int64_t n_audio_samples = 0;
+
+    std::thread loader([&]
+    {
+        for (size_t i = 0; i < paths.size(); ++i)
+        {
+            batch_audio audio;
+            audio.index = i;
+
+            // an exception escaping this thread would terminate the host process, so it is
+            // reported as the result of the file instead, as request() does
+            try {
+                whisper_params file_params = params;
+                file_params.fname_inp = paths[i];
+                if (!load_audio(file_params, audio.pcmf32))
+                {
+                    audio.error = "Failed to read audio file";
+                }
+            } catch (const std::exception& e) {
+                WHISPER_GGML_LOG_ERROR("batch: loading '%s' failed: %s", paths[i].c_str(), e.what());
+                audio.error = std::string("Exception: ") + e.what();
+            } catch (...) {
+                WHISPER_GGML_LOG_ERROR("batch: loading '%s' failed: unknown exception", paths[i].c_str());
+                audio.error = "Unknown exception occurred";
+            }
+            if (!audio.error.empty())
+            {
+                std::vector<float>().swap(audio.pcmf32);
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            consumed.wait(lock, [&] { return ready.size() < n_prefetch; });
+            ready.push_back(std::move(audio));
+            loaded.notify_one();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        loading_done = true;
+        loaded.notify_all();
+    });
+
+    std::vector<std::thread> workers;
+    for (int32_t w = 0; w < n_parallel; ++w)
+    {
+        workers.emplace_back([&]
+        {
+            while (true)
+            {
+                batch_audio audio;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    loaded.wait(lock, [&] { return !ready.empty() || loading_done; });
+                    if (ready.empty())
+                    {
+                        return;
+                    }
+                    audio = std::move(ready.front());
+                    ready.pop_front();
+                    consumed.notify_one();
+                }
+
+                json responseJson;
+                if (!audio.error.empty())
+                {
+                    responseJson["error"] = audio.error;
+                }
+                else
+                {
+                    try {
+                        responseJson = transcribe_pcm(session, whisper_params_for_loaded(params), audio.pcmf32.data(), audio.pcmf32.size(), nullptr, params.offset_t_ms);
+                    } catch (const std::exception& e) {
+                        responseJson["error"] = std::string("Exception: ") + e.what();
+                    } catch (...) {
+                        responseJson["error"] = "Unknown exception occurred";
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock(result_mutex);
+                if (responseJson.contains("error"))
+                {
+                    n_failed++;
+                }
+                else
+                {
+                    n_audio_samples += audio.pcmf32.size();
+                }
+                on_result(audio.index, responseJson);
+            }
+        });
+    }
+
+    loader.join();
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    const double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+    const double audio_s = (double)n_audio_samples / WHISPER_SAMPLE_RATE;
+
+    json stats;
+    stats["files"] = paths.size();
+    stats["failed"] = n_failed;
+    stats["parallel"] = n_parallel;
+    stats["elapsed_ms"] = (int64_t)(elapsed_s * 1000.0);
+    stats["audio_ms"] = (int64_t)(audio_s * 1000.0);
+    stats["files_per_second"] = elapsed_s > 0.0 ? paths.size() / elapsed_s : 0.0;
+    stats["real_time_factor"] = audio_s > 0.0 ? elapsed_s / audio_s : 0.0;
+
+    WHISPER_GGML_LOG_INFO("batch: %zu files in %.2f s, %.2f files/s, real-time factor %.3f", paths.size(), elapsed_s, stats["files_per_second"].get<double>(), stats["real_time_factor"].get<double>());
+
+    return stats;
+}
+
+// Job Queue
+//
+// Architecture Decision: Fixed pool of worker threads fed from a FIFO of transcription jobs
+// - Reason: Running each request in its own isolate with its own ggml threads oversubscribes
+//   the CPU when several transcriptions are in flight; the pool bounds the number of
+//   concurrent transcriptions to n_workers
+// - States: Each running job borrows a whisper_state from its session's pool, so the pool of a
+//   model settles at n_workers states that the workers keep reusing
+// - Cancellation: Pending jobs are dropped; running jobs stop before their next 30 s window
+// - Completion: Either the job's callback (which takes ownership of the result) or
+//   whisper_ggml_queue_wait()
+
+struct whisper_ggml_job
+{
+    int64_t id = 0;
+    whisper_ggml_session *session = nullptr;
+    whisper_params params;
+
+    whisper_ggml_job_callback callback = nullptr;
+    void *user_data = nullptr;
+
+    std::atomic<bool> cancelled{false};
+    whisper_ggml_job_status status = WHISPER_GGML_JOB_PENDING;
+    char *result = nullptr;
+};
+
+struct whisper_ggml_queue
+{
+    std::mutex mutex;
+    std::condition_variable work;  // signaled when a job is submitted or the queue stops
+    std::condition_variable done;  // signaled when a job completes
+
+    std::deque<std::shared_ptr<whisper_ggml_job>> pending;
+    std::map<int64_t, std::shared_ptr<whisper_ggml_job>> jobs; // pending, running and uncollected jobs
+
+    std::vector<std::thread> workers;
+    int64_t next_id = 1;
+    bool stop = false;
+};
+
+static char *job_cancelled_result()
+{
+    json responseJson;
+    responseJson["error"] = "Job cancelled";
+    return jsonToChar(responseJson);
+}
+
+// Publish a finished job: hand the result to the callback, or keep it for whisper_ggml_queue_wait
+static void job_complete(whisper_ggml_queue &queue, std::unique_lock<std::mutex> &lock, const std::shared_ptr<whisper_ggml_job> &job, whisper_ggml_job_status status, char *result)
+{
+    job->status = status;
+
+    if (job->callback != nullptr)
+    {
+        queue.jobs.erase(job->id);
+
+        lock.unlock();
+        job->callback(job->id, result, job->user_data);
+        lock.lock();
+    }
+    else
+    {
+        job->result = result;
+        queue.done.notify_all();
+    }
+}
+
+static void job_worker(whisper_ggml_queue *queue)
+{
+    std::unique_lock<std::mutex> lock(queue->mutex);
+
+    while (true)
+    {
+        queue->work.wait(lock, [queue] { return queue->stop || !queue->pending.empty(); });
+
+        if (queue->pending.empty())
+        {
+            return;
+        }
+
+        std::shared_ptr<whisper_ggml_job> job = queue->pending.front();
+        queue->pending.pop_front();
+        job->status = WHISPER_GGML_JOB_RUNNING;
+
+        lock.unlock();
+
+        json responseJson;
+        try {
+            responseJson = transcribe_file(job->session, job->params, &job->cancelled);
+        } catch (const std::exception& e) {
+            responseJson["error"] = std::string("Exception: ") + e.what();
+        } catch (...) {
+            // an exception escaping a pool thread would terminate the host process
+            responseJson["error"] = "Unknown exception occurred";
+        }
+
+        lock.lock();
+
+        if (job->cancelled)
+        {
+            job_complete(*queue, lock, job, WHISPER_GGML_JOB_CANCELLED, job_cancelled_result());
+        }
+        else
+        {
+            job_complete(*queue, lock, job, WHISPER_GGML_JOB_DONE, jsonToChar(responseJson));
+        }
+    }
+}
+
+// FFI Symbol Export Strategy
+// 
+// Architecture Decision: C linkage exports declared in whisper_ggml.h
+// - Reason: Dart FFI requires C linkage for symbol resolution
+// - Visibility: Explicit export despite hidden default visibility
+// - Justification: Minimizes symbol pollution while ensuring FFI accessibility
+// - request(): JSON protocol shared with the Android/iOS implementations
+// - whisper_ggml_*(): handle-based session API without JSON parsing on the hot path
+
+extern "C" FUNCTION_ATTRIBUTE
+whisper_ggml_params whisper_ggml_default_params(void)
+{
+    const whisper_params defaults;
+
+    whisper_ggml_params params;
+
+    params.n_threads = defaults.n_threads;
+    params.offset_ms = defaults.offset_t_ms;
+    params.duration_ms = defaults.duration_ms;
+    params.max_len = defaults.max_len;
+    params.best_of = defaults.best_of;
+    params.beam_size = defaults.beam_size;
+    params.audio_ctx = defaults.audio_ctx;
+    params.translate = defaults.translate;
+    params.no_timestamps = defaults.no_timestamps;
+    params.special_tokens = defaults.print_special_tokens;
+    params.split_on_word = defaults.split_on_word;
+    params.speed_up = defaults.speed_up;
+    params.language = "en";
+    params.n_threads_ahead = defaults.n_threads_ahead;
+
+    return params;
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+whisper_ggml_session *whisper_ggml_open(const char *model_path, int32_t n_states)
+{
+    if (model_path == nullptr)
+    {
+        return nullptr;
+    }
+
+    whisper_model_cache_entry *model = model_cache().acquire(model_path);
+    if (model == nullptr)
+    {
+        return nullptr;
+    }
+
+    // pre-allocate the requested number of states so the first transcriptions do not pay for it
+    std::vector<struct whisper_state *> warm;
+    for (int32_t i = 0; i < n_states; ++i)
+    {
+        struct whisper_state *state = whisper_state_acquire(model->ctx);
+        if (state == nullptr)
+        {
+            break;
+        }
+        warm.push_back(state);
+    }
+    for (auto state : warm)
+    {
+        whisper_state_release(model->ctx, state);
+    }
+
+    whisper_ggml_session *session = new whisper_ggml_session;
+    session->model = model;
+
+    return session;
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+char *whisper_ggml_transcribe(whisper_ggml_session *session, const char *audio_path, const whisper_ggml_params *params)
+{
+    json responseJson;
+
+    if (session == nullptr || audio_path == nullptr)
+    {
+        responseJson["error"] = "Invalid session or audio path";
+        return jsonToChar(responseJson);
+    }
+
+    try {
+        whisper_params wparams = whisper_params_from(params ? *params : whisper_ggml_default_params());
+        wparams.fname_inp = audio_path;
+
+        responseJson = transcribe_file(session, wparams);
+    } catch (const std::exception& e) {
+        responseJson["error"] = std::string("Exception: ") + e.what();
+    }
+
+    return jsonToChar(responseJson);
+}
+
+// Shared validation for the PCM entry points; returns false and fills responseJson on error
+static bool check_pcm_input(whisper_ggml_session *session, const void *samples, int32_t n_samples, int32_t sample_rate, json &responseJson)
+{
+    if (session == nullptr || samples == nullptr || n_samples <= 0)
+    {
+        responseJson["error"] = "Invalid session or sample buffer";
+        return false;
+    }
+
+    if (sample_rate != WHISPER_SAMPLE_RATE)
+    {
+        responseJson["error"] = "Unsupported sample rate " + std::to_string(sample_rate) + ", expected " + std::to_string(WHISPER_SAMPLE_RATE);
+        return false;
+    }
+
+    return true;
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+char *whisper_ggml_transcribe_pcm_f32(whisper_ggml_session *session, const float *samples, int32_t n_samples, int32_t sample_rate, const whisper_ggml_params *params)
+{
+    json responseJson;
+
+    if (!check_pcm_input(session, samples, n_samples, sample_rate, responseJson))
+    {
+        return jsonToChar(responseJson);
+    }
+
+    try {
+        const whisper_params wparams = whisper_params_from(params ? *params : whisper_ggml_default_params());
+
+        // the caller's buffer goes straight to whisper_full_with_state
+        responseJson = transcribe_pcm(session, wparams, samples, n_samples);
+    } catch (const std::exception& e) {
+        responseJson["error"] = std::string("Exception: ") + e.what();
+    }
+
+    return jsonToChar(responseJson);
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+char *whisper_ggml_transcribe_pcm_s16(whisper_ggml_session *session, const int16_t *samples, int32_t n_samples, int32_t sample_rate, const whisper_ggml_params *params)
+{
+    json responseJson;
+
+    if (!check_pcm_input(session, samples, n_samples, sample_rate, responseJson))
+    {
+        return jsonToChar(responseJson);
+    }
+
+    try {
+        const whisper_params wparams = whisper_params_from(params ? *params : whisper_ggml_default_params());
+
+        // whisper consumes float samples, so this is the only conversion on this path
+        std::vector<float> pcmf32(n_samples);
+        s16_to_f32(samples, pcmf32.data(), n_samples);
+
+        responseJson = transcribe_pcm(session, wparams, pcmf32.data(), n_samples);
+    } catch (const std::exception& e) {
+        responseJson["error"] = std::string("Exception: ") + e.what();
+    }
+
+    return jsonToChar(responseJson);
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+void *whisper_ggml_transcribe_binary(whisper_ggml_session *session, const char *audio_path, const whisper_ggml_params *params, uint32_t flags)
+{
+    if (session == nullptr || audio_path == nullptr)
+    {
+        return binary_error("Invalid session or audio path");
+    }
+
+    try {
+        whisper_params wparams = whisper_params_from(params ? *params : whisper_ggml_default_params());
+        wparams.fname_inp = audio_path;
+
+        return transcribe_file_binary(session, wparams, flags);
+    } catch (const std::exception& e) {
+        return binary_error(e.what());
+    }
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+void *whisper_ggml_transcribe_pcm_f32_binary(whisper_ggml_session *session, const float *samples, int32_t n_samples, int32_t sample_rate, const whisper_ggml_params *params, uint32_t flags)
+{
+    json responseJson;
+
+    if (!check_pcm_input(session, samples, n_samples, sample_rate, responseJson))
+    {
+        return binary_error(std::string(responseJson["error"]).c_str());
+    }
+
+    try {
+        const whisper_params wparams = whisper_params_from(params ? *params : whisper_ggml_default_params());
+
+        return transcribe_pcm_binary(session, wparams, samples, n_samples, flags);
+    } catch (const std::exception& e) {
+        return binary_error(e.what());
+    }
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+void whisper_ggml_close(whisper_ggml_session *session)
+{
+    if (session == nullptr)
+    {
+        return;
+    }
+
+    model_cache().release(session->model);
+    delete session;
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+whisper_ggml_stream_params whisper_ggml_stream_default_params(void)
+{
+    whisper_ggml_stream_params params;
+
+    params.step_ms = 1000;
+    params.length_ms = 10000;
+    params.keep_ms = 200;
+    params.audio_ctx = 0;
+    params.max_tokens = 0;
+    params.params = whisper_ggml_default_params();
+
+    return params;
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+whisper_ggml_stream *whisper_ggml_stream_open(whisper_ggml_session *session, const whisper_ggml_stream_params *params)
+{
+    if (session == nullptr)
+    {
+        return nullptr;
+    }
+
+    const whisper_ggml_stream_params sparams = params ? *params : whisper_ggml_stream_default_params();
+
+    if (sparams.step_ms <= 0 || sparams.length_ms < sparams.step_ms || sparams.keep_ms < 0 || sparams.keep_ms >= sparams.length_ms)
+    {
+        return nullptr;
+    }
+
+    const size_t n_window = (size_t)sparams.length_ms * WHISPER_SAMPLE_RATE / 1000;
+
+    std::unique_ptr<whisper_ggml_stream> stream(new whisper_ggml_stream(n_window));
+
+    stream->session = session;
+    stream->lease.reset(new whisper_state_lease(session->model));
+    if (stream->lease->state == nullptr)
+    {
+        return nullptr;
+    }
+
+    stream->params = whisper_params_from(sparams.params);
+    stream->n_step = (size_t)sparams.step_ms * WHISPER_SAMPLE_RATE / 1000;
+    stream->n_keep = (size_t)sparams.keep_ms * WHISPER_SAMPLE_RATE / 1000;
+
+    // one encoder position covers 20 ms (2 mel frames of 10 ms), rounded up to a multiple of 64
+    const int32_t n_audio_ctx = whisper_n_audio_ctx(session->model->ctx);
+    stream->audio_ctx = sparams.audio_ctx > 0 ? sparams.audio_ctx : ((sparams.length_ms / 20 + 63) / 64) * 64;
+    stream->audio_ctx = std::min(stream->audio_ctx, n_audio_ctx);
+    stream->max_tokens = sparams.max_tokens;
+
+    return stream.release();
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+char *whisper_ggml_stream_push_f32(whisper_ggml_stream *stream, const float *samples, int32_t n_samples)
+{
+    if (stream == nullptr || samples == nullptr || n_samples <= 0)
+    {
+        return nullptr;
+    }
+
+    json responseJson;
+
+    try {
+        responseJson = stream_push(*stream, samples, n_samples);
+    } catch (const std::exception& e) {
+        responseJson["error"] = std::string("Exception: ") + e.what();
+    }
+
+    return responseJson.is_null() ? nullptr : jsonToChar(responseJson);
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+char *whisper_ggml_stream_push_s16(whisper_ggml_stream *stream, const int16_t *samples, int32_t n_samples)
+{
+    if (stream == nullptr || samples == nullptr || n_samples <= 0)
+    {
+        return nullptr;
+    }
+
+    stream->scratch.resize(n_samples);
+    s16_to_f32(samples, stream->scratch.data(), n_samples);
+
+    return whisper_ggml_stream_push_f32(stream, stream->scratch.data(), n_samples);
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+char *whisper_ggml_stream_finish(whisper_ggml_stream *stream)
+{
+    if (stream == nullptr)
+    {
+        return nullptr;
+    }
+
+    json responseJson;
+    responseJson["@type"] = "streamUpdate";
+    responseJson["partial"] = json::array();
+    responseJson["final"] = json::array();
+
+    try {
+        // finalize whatever has not been finalized yet, unless it is only the overlap already reported
+        if (stream->n_new > 0 || stream->ring.size() > stream->n_keep)
+        {
+            stream_decode(*stream, true, responseJson);
+        }
+        stream->ring.keep_tail(0);
+        stream->prompt_tokens.clear();
+    } catch (const std::exception& e) {
+        responseJson["error"] = std::string("Exception: ") + e.what();
+    }
+
+    return jsonToChar(responseJson);
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+void whisper_ggml_stream_close(whisper_ggml_stream *stream)
+{
+    delete stream;
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+char *whisper_ggml_transcribe_batch(whisper_ggml_session *session, const char *const *audio_paths, int32_t n_files, const whisper_ggml_params *params, int32_t n_parallel, whisper_ggml_batch_callback callback, void *user_data)
+{
+    json responseJson;
+
+    if (session == nullptr || audio_paths == nullptr || n_files <= 0)
+    {
+        responseJson["error"] = "Invalid session or file list";
+        return jsonToChar(responseJson);
+    }
+
+    try {
+        const whisper_params wparams = whisper_params_from(params ? *params : whisper_ggml_default_params());
+        const std::vector<std::string> paths(audio_paths, audio_paths + n_files);
+
+        responseJson["@type"] = "getTextFromWavFiles";
+        responseJson["stats"] = transcribe_batch(session, paths, wparams, n_parallel, [&](int32_t index, json &result)
+        {
+            if (callback != nullptr)
+            {
+                callback(index, jsonToChar(result), user_data);
             }
+        });
+    } catch (const std::exception& e) {
+        responseJson["error"] = std::string("Exception: ") + e.what();
+    }
+
+    return jsonToChar(responseJson);
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+whisper_ggml_queue *whisper_ggml_queue_create(int32_t n_workers)
+{
+    if (n_workers <= 0)
+    {
+        return nullptr;
+    }
+
+    whisper_ggml_queue *queue = new whisper_ggml_queue;
+    for (int32_t i = 0; i < n_workers; ++i)
+    {
+        queue->workers.emplace_back(job_worker, queue);
+    }
+
+    return queue;
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+int64_t whisper_ggml_queue_submit(whisper_ggml_queue *queue, whisper_ggml_session *session, const char *audio_path, const whisper_ggml_params *params, whisper_ggml_job_callback callback, void *user_data)
+{
+    if (queue == nullptr || session == nullptr || audio_path == nullptr)
+    {
+        return -1;
+    }
+
+    std::shared_ptr<whisper_ggml_job> job = std::make_shared<whisper_ggml_job>();
+    job->session = session;
+    job->params = whisper_params_from(params ? *params : whisper_ggml_default_params());
+    job->params.fname_inp = audio_path;
+    job->callback = callback;
+    job->user_data = user_data;
+
+    std::lock_guard<std::mutex> lock(queue->mutex);
+
+    if (queue->stop)
+    {
+        return -1;
+    }
+
+    job->id = queue->next_id++;
+    queue->jobs[job->id] = job;
+    queue->pending.push_back(job);
+    queue->work.notify_one();
+
+    return job->id;
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+whisper_ggml_job_status whisper_ggml_queue_poll(whisper_ggml_queue *queue, int64_t job_id)
+{
+    if (queue == nullptr)
+    {
+        return WHISPER_GGML_JOB_UNKNOWN;
+    }
+
+    std::lock_guard<std::mutex> lock(queue->mutex);
+
+    auto it = queue->jobs.find(job_id);
+    return it == queue->jobs.end() ? WHISPER_GGML_JOB_UNKNOWN : it->second->status;
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+bool whisper_ggml_queue_cancel(whisper_ggml_queue *queue, int64_t job_id)
+{
+    if (queue == nullptr)
+    {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(queue->mutex);
+
+    auto it = queue->jobs.find(job_id);
+    if (it == queue->jobs.end())
+    {
+        return false;
+    }
+
+    std::shared_ptr<whisper_ggml_job> job = it->second;
+
+    if (job->status == WHISPER_GGML_JOB_PENDING)
+    {
+        queue->pending.erase(std::find(queue->pending.begin(), queue->pending.end(), job));
+        job->cancelled = true;
+        job_complete(*queue, lock, job, WHISPER_GGML_JOB_CANCELLED, job_cancelled_result());
+        return true;
+    }
+
+    if (job->status == WHISPER_GGML_JOB_RUNNING)
+    {
+        // the worker completes the job once the transcription returns
+        job->cancelled = true;
+        return true;
+    }
+
+    return false;
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+char *whisper_ggml_queue_wait(whisper_ggml_queue *queue, int64_t job_id)
+{
+    if (queue == nullptr)
+    {
+        return nullptr;
+    }
+
+    std::unique_lock<std::mutex> lock(queue->mutex);
+
+    auto it = queue->jobs.find(job_id);
+    if (it == queue->jobs.end() || it->second->callback != nullptr)
+    {
+        return nullptr;
+    }
+
+    std::shared_ptr<whisper_ggml_job> job = it->second;
+    queue->done.wait(lock, [&job] { return job->status == WHISPER_GGML_JOB_DONE || job->status == WHISPER_GGML_JOB_CANCELLED; });
+
+    char *result = job->result;
+    job->result = nullptr;
+    queue->jobs.erase(job_id);
+
+    return result;
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+void whisper_ggml_queue_destroy(whisper_ggml_queue *queue)
+{
+    if (queue == nullptr)
+    {
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(queue->mutex);
+
+        queue->stop = true;
+
+        while (!queue->pending.empty())
+        {
+            std::shared_ptr<whisper_ggml_job> job = queue->pending.front();
+            queue->pending.pop_front();
+            job->cancelled = true;
+            job_complete(*queue, lock, job, WHISPER_GGML_JOB_CANCELLED, job_cancelled_result());
+        }
+
+        for (auto &it : queue->jobs)
+        {
+            it.second->cancelled = true;
+        }
+
+        queue->work.notify_all();
+    }
+
+    for (auto &worker : queue->workers)
+    {
+        worker.join();
+    }
+
+    for (auto &it : queue->jobs)
+    {
+        delete[] it.second->result;
+    }
+
+    delete queue;
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+void whisper_ggml_free_result(void *result)
+{
+    delete[] (char *)result;
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+void whisper_ggml_set_compute_pool(int32_t n_workers, bool pin)
+{
+    ggml_threadpool_init(n_workers, pin);
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+void whisper_ggml_log_set_level(whisper_ggml_log_level level)
+{
+    g_logger.set_level(level);
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+void whisper_ggml_log_set_file(const char *path)
+{
+    g_logger.set_file(path);
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+void whisper_ggml_log_set_sink(whisper_ggml_log_sink sink, void *user_data)
+{
+    g_logger.set_sink(sink, user_data);
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+void whisper_ggml_log_flush(void)
+{
+    g_logger.flush();
+}
+
+extern "C" FUNCTION_ATTRIBUTE
+char* request(char* body)
+{
+    json requestJson;
+    json responseJson;
+
+    try {
+        WHISPER_GGML_LOG_DEBUG("request: %s", body);
+
+        requestJson = json::parse(body);
+        std::string action = requestJson["@type"];
+
+        if (action == "getVersion") {
+            responseJson["@type"] = "getVersion";
+            responseJson["version"] = "1.0.0";
+        } else if (action == "getTextFromWavFile") {
+            // Initialize whisper
+            std::string modelPath = requestJson["model"];
+
+            // Set up parameters
+            whisper_params params;
+            params.fname_inp = requestJson["audio"];
+            params.language = requestJson["language"];
+            params.translate = requestJson["is_translate"];
+            params.no_timestamps = requestJson["is_no_timestamps"];
+            params.n_threads = requestJson["threads"];
+            params.n_threads_ahead = requestJson.value("threads_ahead", 0);
+            params.audio_ctx = requestJson.value("audio_ctx", 0);
+            params.print_special_tokens = requestJson["is_special_tokens"];
+
+            WHISPER_GGML_LOG_DEBUG("transcribe: model '%s', audio '%s'", modelPath.c_str(), params.fname_inp.c_str());
+
+            whisper_ggml_session *session = whisper_ggml_open(modelPath.c_str(), 0);
             
-            // Clean up
-            whisper_free(ctx);
+            if (session == nullptr) {
+                WHISPER_GGML_LOG_ERROR("failed to load model '%s'", modelPath.c_str());
+                responseJson["error"] = "Failed to initialize model";
+                return jsonToChar(responseJson);
+            }
+
+            try {
+                responseJson = transcribe_file(session, params);
+            } catch (...) {
+                whisper_ggml_close(session);
+                throw;
+            }
+            whisper_ggml_close(session);
+
+            if (responseJson.contains("error")) {
+                WHISPER_GGML_LOG_ERROR("transcription failed: %s", std::string(responseJson["error"]).c_str());
+            } else {
+                WHISPER_GGML_LOG_DEBUG("transcription done: %zu segments", responseJson["segments"].size());
+            }
+        } else if (action == "getTextFromWavFiles") {
+            std::string modelPath = requestJson["model"];
+
+            whisper_params params;
+            params.language = requestJson["language"];
+            params.translate = requestJson["is_translate"];
+            params.no_timestamps = requestJson["is_no_timestamps"];
+            params.n_threads = requestJson["threads"];
+            params.n_threads_ahead = requestJson.value("threads_ahead", 0);
+            params.audio_ctx = requestJson.value("audio_ctx", 0);
+            params.print_special_tokens = requestJson["is_special_tokens"];
+
+            const std::vector<std::string> paths = requestJson["audios"];
+            const int32_t n_parallel = requestJson.value("parallel", 1);
+
+            whisper_ggml_session *session = whisper_ggml_open(modelPath.c_str(), n_parallel);
+
+            if (session == nullptr) {
+                WHISPER_GGML_LOG_ERROR("failed to load model '%s'", modelPath.c_str());
+                responseJson["error"] = "Failed to initialize model";
+                return jsonToChar(responseJson);
+            }
+
+            json results = json::array();
+            results.get_ref<json::array_t &>().resize(paths.size());
+
+            try {
+                responseJson["stats"] = transcribe_batch(session, paths, params, n_parallel, [&](int32_t index, json &result)
+                {
+                    results[index] = std::move(result);
+                });
+            } catch (...) {
+                whisper_ggml_close(session);
+                throw;
+            }
+            whisper_ggml_close(session);
+
+            responseJson["@type"] = "getTextFromWavFiles";
+            responseJson["results"] = std::move(results);
+        } else if (action == "setModelCacheBudget") {
+            const size_t max_bytes = requestJson["max_bytes"];
+            model_cache().set_budget(max_bytes);
+            responseJson["@type"] = "setModelCacheBudget";
+            responseJson["cache"] = model_cache_stats();
+        } else if (action == "setDecodeBatching") {
+            const int32_t wait_us = requestJson["wait_us"];
+            model_cache_set_decode_batching(wait_us);
+            responseJson["@type"] = "setDecodeBatching";
+            responseJson["cache"] = model_cache_stats();
+        } else if (action == "setEncodeBatching") {
+            const int32_t wait_us = requestJson["wait_us"];
+            model_cache_set_encode_batching(wait_us);
+            responseJson["@type"] = "setEncodeBatching";
+            responseJson["cache"] = model_cache_stats();
+        } else if (action == "getModelCacheStats") {
+            responseJson["@type"] = "getModelCacheStats";
+            responseJson["cache"] = model_cache_stats();
+        } else if (action == "setComputePool") {
+            const int32_t n_workers = requestJson["workers"];
+            bool pin = false;
+            if (requestJson.contains("pin")) {
+                pin = requestJson["pin"];
+            }
+            whisper_ggml_set_compute_pool(n_workers, pin);
+            responseJson["@type"] = "setComputePool";
+        } else if (action == "setLogConfig") {
+            if (requestJson.contains("level")) {
+                g_logger.set_level(whisper_ggml_logger::parse_level(requestJson["level"]));
+            }
+            if (requestJson.contains("file")) {
+                const std::string file = requestJson["file"];
+                g_logger.set_file(file.c_str());
+            }
+            responseJson["@type"] = "setLogConfig";
+        } else if (action == "alignModel") {
+            const std::string model = requestJson["model"];
+            const std::string output = requestJson["output"];
+            if (whisper_model_align(model.c_str(), output.c_str()) != 0) {
+                responseJson["error"] = "failed to write aligned model";
+            }
+            responseJson["@type"] = "alignModel";
         } else {
             responseJson["error"] = "Unknown action: " + action;
         }
-        
-        if (debug_log) {
-            fclose(debug_log);
-        }
     } catch (const std::exception& e) {
-        FILE* debug_log = fopen("/tmp/whisper_debug.log", "a");
-        if (debug_log) {
-            fprintf(debug_log, "DEBUG: Exception caught: %s\n", e.what());
-            fflush(debug_log);
-            fclose(debug_log);
-        }
+        WHISPER_GGML_LOG_ERROR("request failed: %s", e.what());
         responseJson["error"] = std::string("Exception: ") + e.what();
     } catch (...) {
-        FILE* debug_log = fopen("/tmp/whisper_debug.log", "a");
-        if (debug_log) {
-            fprintf(debug_log, "DEBUG: Unknown exception caught\n");
-            fflush(debug_log);
-            fclose(debug_log);
-        }
+        WHISPER_GGML_LOG_ERROR("request failed: unknown exception");
         responseJson["error"] = "Unknown exception occurred";
     }
 
-    FILE* debug_log = fopen("/tmp/whisper_debug.log", "a");
-    if (debug_log) {
-        fprintf(debug_log, "DEBUG: Returning response\n");
-        fflush(debug_log);
-        fclose(debug_log);
-    }
     return jsonToChar(responseJson);
-}
\ No newline at end of file
+}
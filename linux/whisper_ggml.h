@@ -0,0 +1,307 @@
+#ifndef WHISPER_GGML_H
+#define WHISPER_GGML_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+// Attributes to prevent 'unused' function from being removed and to make it visible
+#define FUNCTION_ATTRIBUTE __attribute__((visibility("default"))) __attribute__((used))
+#elif defined(_MSC_VER)
+// Marking a function for export
+#define FUNCTION_ATTRIBUTE __declspec(dllexport)
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // JSON request entry point - see README.md for the supported "@type" actions
+    FUNCTION_ATTRIBUTE char *request(char *body);
+
+    //
+    // Session API
+    //
+    // A session is an opaque handle on a resident model. It keeps the model loaded until it is
+    // closed and owns a pool of reusable whisper_state objects, so a transcription only pays for
+    // the inference itself. Sessions are thread-safe: concurrent transcriptions on one session
+    // each borrow their own state from the pool.
+    //
+    //     whisper_ggml_session *session = whisper_ggml_open("/path/to/ggml-base.en.bin", 1);
+    //
+    //     whisper_ggml_params params = whisper_ggml_default_params();
+    //     params.language = "en";
+    //
+    //     char *result = whisper_ggml_transcribe(session, "/path/to/audio.wav", &params);
+    //
+    //     whisper_ggml_close(session);
+    //
+
+    typedef struct whisper_ggml_session whisper_ggml_session;
+
+    typedef struct whisper_ggml_params
+    {
+        int32_t n_threads;
+        int32_t offset_ms;   // start offset in ms
+        int32_t duration_ms; // audio duration to process in ms (0 = until the end)
+        int32_t max_len;     // max segment length in characters (0 = no limit)
+        int32_t best_of;
+        int32_t beam_size;   // > 1 enables beam search
+        int32_t audio_ctx;   // encoder context (0 = full 30 s window, -1 = fit to the remaining audio)
+
+        bool translate;
+        bool no_timestamps;
+        bool special_tokens;
+        bool split_on_word;
+        bool speed_up;
+
+        const char *language; // "auto" or nullptr for auto-detection
+
+        int32_t n_threads_ahead; // extra threads that encode the next 30 s window while the current one is decoded (0 = off)
+    } whisper_ggml_params;
+
+    FUNCTION_ATTRIBUTE whisper_ggml_params whisper_ggml_default_params(void);
+
+    // Load (or reuse from the model cache) the model at model_path and pre-allocate n_states
+    // whisper_state objects. The pool grows on demand beyond n_states.
+    // Returns nullptr if the model cannot be loaded.
+    FUNCTION_ATTRIBUTE whisper_ggml_session *whisper_ggml_open(const char *model_path, int32_t n_states);
+
+    // Transcribe a 16-bit WAV file. Returns the same JSON document as the "getTextFromWavFile"
+    // action of request().
+    FUNCTION_ATTRIBUTE char *whisper_ggml_transcribe(whisper_ggml_session *session, const char *audio_path, const whisper_ggml_params *params);
+
+    // Transcribe a caller-owned buffer of mono PCM samples. The float variant is passed to the
+    // model without copying; the int16 variant is converted to float once. The buffer is only
+    // read during the call. sample_rate must be 16000 (WHISPER_SAMPLE_RATE).
+    // Returns the same JSON document as whisper_ggml_transcribe.
+    FUNCTION_ATTRIBUTE char *whisper_ggml_transcribe_pcm_f32(whisper_ggml_session *session, const float *samples, int32_t n_samples, int32_t sample_rate, const whisper_ggml_params *params);
+    FUNCTION_ATTRIBUTE char *whisper_ggml_transcribe_pcm_s16(whisper_ggml_session *session, const int16_t *samples, int32_t n_samples, int32_t sample_rate, const whisper_ggml_params *params);
+
+    // Release the session. Streams opened on it must be closed first. The model stays in the model cache until it is evicted.
+    FUNCTION_ATTRIBUTE void whisper_ggml_close(whisper_ggml_session *session);
+
+    //
+    // Batch transcription
+    //
+    // Transcribes n_files WAV files with n_parallel concurrent states while the next files are
+    // read in the background. Each file's result (as returned by whisper_ggml_transcribe) is
+    // passed to callback as soon as it completes; calls are serialized, may come from any
+    // thread, and transfer ownership of the result (release it with whisper_ggml_free_result).
+    // Returns {"@type": "getTextFromWavFiles", "stats": {...}} with files, failed, elapsed_ms,
+    // audio_ms, files_per_second and real_time_factor (processing time / audio duration).
+
+    typedef void (*whisper_ggml_batch_callback)(int32_t index, char *result, void *user_data);
+
+    FUNCTION_ATTRIBUTE char *whisper_ggml_transcribe_batch(whisper_ggml_session *session, const char *const *audio_paths, int32_t n_files, const whisper_ggml_params *params, int32_t n_parallel, whisper_ggml_batch_callback callback, void *user_data);
+
+    //
+    // Binary results
+    //
+    // Alternative to the JSON result for large transcripts. The result is a single allocation
+    // that can be read in place (e.g. through Dart FFI structs) and is released with
+    // whisper_ggml_free_result:
+    //
+    //     whisper_ggml_result_header                        at 0
+    //     whisper_ggml_result_segment[n_segments]           at segments_offset
+    //     whisper_ggml_result_token[n_tokens]               at tokens_offset (optional)
+    //     UTF-8 text of all segments, NUL-terminated        at text_offset
+    //
+    // Segment text_offset values are relative to text_offset; token_offset indexes the token
+    // table. On failure, error is non-zero and the text holds the error message.
+
+#define WHISPER_GGML_RESULT_MAGIC 0x52474757 // "WGGR"
+#define WHISPER_GGML_RESULT_VERSION 1
+
+    enum
+    {
+        WHISPER_GGML_RESULT_TOKENS = 1 << 0,           // token ids and probabilities
+        WHISPER_GGML_RESULT_TOKEN_TIMESTAMPS = 1 << 1, // also token timestamps (implies tokens)
+    };
+
+    typedef struct whisper_ggml_result_header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t flags;
+        int32_t error;
+
+        uint32_t n_segments;
+        uint32_t n_tokens;
+
+        uint64_t size; // total size of the result in bytes
+        uint64_t segments_offset;
+        uint64_t tokens_offset;
+        uint64_t text_offset;
+        uint64_t text_size; // excluding the terminating NUL
+    } whisper_ggml_result_header;
+
+    typedef struct whisper_ggml_result_segment
+    {
+        int64_t t0_ms;
+        int64_t t1_ms;
+        uint32_t text_offset;
+        uint32_t text_size;
+        uint32_t token_offset;
+        uint32_t n_tokens;
+    } whisper_ggml_result_segment;
+
+    typedef struct whisper_ggml_result_token
+    {
+        int32_t id;
+        float p;
+        int64_t t0_ms; // -1 without WHISPER_GGML_RESULT_TOKEN_TIMESTAMPS
+        int64_t t1_ms;
+    } whisper_ggml_result_token;
+
+    FUNCTION_ATTRIBUTE void *whisper_ggml_transcribe_binary(whisper_ggml_session *session, const char *audio_path, const whisper_ggml_params *params, uint32_t flags);
+    FUNCTION_ATTRIBUTE void *whisper_ggml_transcribe_pcm_f32_binary(whisper_ggml_session *session, const float *samples, int32_t n_samples, int32_t sample_rate, const whisper_ggml_params *params, uint32_t flags);
+
+    //
+    // Streaming API
+    //
+    // Live transcription of 16 kHz mono audio pushed in small chunks (e.g. 100-500 ms). Every
+    // step_ms the most recent window of at most length_ms is decoded and reported as a partial
+    // segment. When the window is full, its text is reported as final, the last keep_ms of audio
+    // is kept as overlap and its tokens are used as the prompt for the next window.
+    //
+    //     whisper_ggml_stream *stream = whisper_ggml_stream_open(session, NULL);
+    //
+    //     while (capturing) {
+    //         char *update = whisper_ggml_stream_push_s16(stream, chunk, n_chunk);
+    //         if (update) { ...; }
+    //     }
+    //
+    //     char *last = whisper_ggml_stream_finish(stream);
+    //     whisper_ggml_stream_close(stream);
+    //
+    // Updates are JSON documents:
+    //
+    //     {"@type": "streamUpdate", "final": [segments], "partial": [segments]}
+    //
+    // with segments as in "getTextFromWavFile" and timestamps relative to the start of the
+    // stream. A stream is not thread-safe, but separate streams can be used concurrently.
+
+    typedef struct whisper_ggml_stream whisper_ggml_stream;
+
+    typedef struct whisper_ggml_stream_params
+    {
+        int32_t step_ms;   // decode interval
+        int32_t length_ms; // maximum window length, finalized when reached
+        int32_t keep_ms;   // audio kept from the previous window
+        int32_t audio_ctx; // encoder context (0 = derived from length_ms)
+        int32_t max_tokens; // max tokens per decode step, bounds the step latency (0 = no limit)
+
+        whisper_ggml_params params;
+    } whisper_ggml_stream_params;
+
+    FUNCTION_ATTRIBUTE whisper_ggml_stream_params whisper_ggml_stream_default_params(void);
+
+    // Returns nullptr if the parameters are invalid or no state can be allocated.
+    FUNCTION_ATTRIBUTE whisper_ggml_stream *whisper_ggml_stream_open(whisper_ggml_session *session, const whisper_ggml_stream_params *params);
+
+    // Push samples. Returns an update if a decode step ran, nullptr otherwise.
+    FUNCTION_ATTRIBUTE char *whisper_ggml_stream_push_f32(whisper_ggml_stream *stream, const float *samples, int32_t n_samples);
+    FUNCTION_ATTRIBUTE char *whisper_ggml_stream_push_s16(whisper_ggml_stream *stream, const int16_t *samples, int32_t n_samples);
+
+    // Finalize the audio pushed so far. The stream can be reused afterwards.
+    FUNCTION_ATTRIBUTE char *whisper_ggml_stream_finish(whisper_ggml_stream *stream);
+
+    FUNCTION_ATTRIBUTE void whisper_ggml_stream_close(whisper_ggml_stream *stream);
+
+    //
+    // Job Queue
+    //
+    // Runs file transcriptions asynchronously on a fixed pool of worker threads, so at most
+    // n_workers transcriptions (each using params.n_threads threads) run at the same time.
+    // Sessions must stay open until their jobs have completed.
+    //
+    // Completion is reported either through the callback given to submit, which is invoked on a
+    // worker thread and takes ownership of the result (release it with whisper_ggml_free_result),
+    // or through whisper_ggml_queue_wait for jobs submitted without a callback. A Dart
+    // NativeCallable.listener can be used as the callback.
+
+    typedef struct whisper_ggml_queue whisper_ggml_queue;
+
+    typedef enum whisper_ggml_job_status
+    {
+        WHISPER_GGML_JOB_UNKNOWN = -1, // no such job, or already collected
+        WHISPER_GGML_JOB_PENDING = 0,
+        WHISPER_GGML_JOB_RUNNING = 1,
+        WHISPER_GGML_JOB_DONE = 2,
+        WHISPER_GGML_JOB_CANCELLED = 3,
+    } whisper_ggml_job_status;
+
+    typedef void (*whisper_ggml_job_callback)(int64_t job_id, char *result, void *user_data);
+
+    FUNCTION_ATTRIBUTE whisper_ggml_queue *whisper_ggml_queue_create(int32_t n_workers);
+
+    // Returns the job id, or -1 on invalid arguments.
+    FUNCTION_ATTRIBUTE int64_t whisper_ggml_queue_submit(whisper_ggml_queue *queue, whisper_ggml_session *session, const char *audio_path, const whisper_ggml_params *params, whisper_ggml_job_callback callback, void *user_data);
+
+    FUNCTION_ATTRIBUTE whisper_ggml_job_status whisper_ggml_queue_poll(whisper_ggml_queue *queue, int64_t job_id);
+
+    // Pending jobs are cancelled immediately, running jobs before their next 30 s window.
+    // Cancelled jobs complete with {"error": "Job cancelled"}.
+    FUNCTION_ATTRIBUTE bool whisper_ggml_queue_cancel(whisper_ggml_queue *queue, int64_t job_id);
+
+    // Block until a job without callback completes and return its result. Returns nullptr for
+    // unknown jobs, jobs with a callback, and jobs that were already collected.
+    FUNCTION_ATTRIBUTE char *whisper_ggml_queue_wait(whisper_ggml_queue *queue, int64_t job_id);
+
+    // Cancel all jobs and join the workers.
+    FUNCTION_ATTRIBUTE void whisper_ggml_queue_destroy(whisper_ggml_queue *queue);
+
+    // Release a result (JSON or binary) returned by any function of this library, including
+    // request().
+    FUNCTION_ATTRIBUTE void whisper_ggml_free_result(void *result);
+
+    //
+    // Compute threads
+    //
+    // Model evaluation runs on the calling thread plus workers from a process-wide pool, which
+    // are created on first use and reused by every session, so no threads are started per
+    // decoded token. Idle workers sleep instead of spinning.
+
+    // Create n_workers workers up front and never start more (0 = grow on demand). When all
+    // workers are busy, a transcription runs on fewer threads than requested. pin binds each
+    // worker to its own CPU. Waits for running evaluations to release their workers.
+    FUNCTION_ATTRIBUTE void whisper_ggml_set_compute_pool(int32_t n_workers, bool pin);
+
+    //
+    // Logging
+    //
+    // Log calls are buffered in memory and written by a background thread, so they do not block
+    // the transcription. The default level is warn and the default sink is stderr; both can also
+    // be set with the WHISPER_GGML_LOG_LEVEL (debug, info, warn, error, none) and
+    // WHISPER_GGML_LOG_FILE environment variables. whisper.cpp messages are logged at info level.
+
+    typedef enum whisper_ggml_log_level
+    {
+        WHISPER_GGML_LOG_LEVEL_DEBUG = 0,
+        WHISPER_GGML_LOG_LEVEL_INFO = 1,
+        WHISPER_GGML_LOG_LEVEL_WARN = 2,
+        WHISPER_GGML_LOG_LEVEL_ERROR = 3,
+        WHISPER_GGML_LOG_LEVEL_NONE = 4,
+    } whisper_ggml_log_level;
+
+    // Called on the logging thread; message is only valid during the call.
+    typedef void (*whisper_ggml_log_sink)(whisper_ggml_log_level level, const char *message, void *user_data);
+
+    FUNCTION_ATTRIBUTE void whisper_ggml_log_set_level(whisper_ggml_log_level level);
+
+    // Append to the file at path; nullptr writes to stderr again.
+    FUNCTION_ATTRIBUTE void whisper_ggml_log_set_file(const char *path);
+
+    // Deliver records to sink instead of a file; nullptr restores the file/stderr output.
+    FUNCTION_ATTRIBUTE void whisper_ggml_log_set_sink(whisper_ggml_log_sink sink, void *user_data);
+
+    // Write all buffered records before returning.
+    FUNCTION_ATTRIBUTE void whisper_ggml_log_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,543 @@
+#ifndef WHISPER_GGML_FLAC_H
+#define WHISPER_GGML_FLAC_H
+
+// FLAC Decoder
+//
+// Architecture Decision: Minimal single-header FLAC decoder, read frame by frame
+// - Reason: Lets read_audio decode .flac uploads without spawning ffmpeg, and hands each decoded
+//   block to the downmix/resampler stage instead of materializing the whole stream as PCM
+// - Scope: STREAMINFO plus audio frames; other metadata blocks are skipped, CRCs and the MD5
+//   signature are not verified
+// - Input: Buffered reads from a FILE, so memory use is bounded by the largest block
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+class whisper_flac_decoder
+{
+public:
+    uint32_t sample_rate = 0;
+    uint32_t channels = 0;
+    uint32_t bits_per_sample = 0;
+    uint64_t total_samples = 0; // per channel, 0 if unknown
+
+    ~whisper_flac_decoder()
+    {
+        if (file != nullptr)
+        {
+            fclose(file);
+        }
+    }
+
+    // Open the file and parse its metadata; returns false if it is not a FLAC stream
+    bool open(const char *path)
+    {
+        file = fopen(path, "rb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+
+        // tolerate an ID3v2 tag in front of the stream marker
+        uint8_t marker[10];
+        if (!read_bytes(marker, 4))
+        {
+            return false;
+        }
+        if (memcmp(marker, "ID3", 3) == 0)
+        {
+            if (!read_bytes(marker + 4, 6))
+            {
+                return false;
+            }
+            const uint32_t size = (marker[6] & 0x7f) << 21 | (marker[7] & 0x7f) << 14 | (marker[8] & 0x7f) << 7 | (marker[9] & 0x7f);
+            skip_bytes(size + ((marker[5] & 0x10) ? 10 : 0));
+            if (!read_bytes(marker, 4))
+            {
+                return false;
+            }
+        }
+        if (memcmp(marker, "fLaC", 4) != 0)
+        {
+            return false;
+        }
+
+        bool last = false;
+        bool has_streaminfo = false;
+        while (!last)
+        {
+            const uint32_t header = read_bits(32);
+            if (eof)
+            {
+                return false;
+            }
+
+            last = (header >> 31) != 0;
+            const uint32_t type = (header >> 24) & 0x7f;
+            const uint32_t length = header & 0xffffff;
+
+            if (type == 0 && length >= 34)
+            {
+                read_bits(16); // min block size
+                read_bits(16); // max block size
+                read_bits(24); // min frame size
+                read_bits(24); // max frame size
+                sample_rate = read_bits(20);
+                channels = read_bits(3) + 1;
+                bits_per_sample = read_bits(5) + 1;
+                total_samples = (uint64_t)read_bits(4) << 32;
+                total_samples |= read_bits(32);
+                skip_bytes(16 + (length - 34)); // MD5 signature
+                has_streaminfo = true;
+            }
+            else
+            {
+                skip_bytes(length);
+            }
+        }
+
+        return has_streaminfo && !eof && sample_rate > 0;
+    }
+
+    // Decode the next frame. Returns the number of samples per channel, 0 at the end of the
+    // stream and -1 on a corrupt frame
+    int decode_frame()
+    {
+        if (!sync())
+        {
+            return 0;
+        }
+
+        // frame header (the 14-bit sync code and blocking strategy bit are consumed by sync())
+        const uint32_t block_size_code = read_bits(4);
+        const uint32_t sample_rate_code = read_bits(4);
+        const uint32_t channel_assignment = read_bits(4);
+        const uint32_t sample_size_code = read_bits(3);
+        read_bits(1);
+
+        // frame or sample number, UTF-8 style variable length
+        uint32_t first = read_bits(8);
+        int n_extra = 0;
+        while (n_extra < 7 && (first & (0x80 >> n_extra)))
+        {
+            n_extra++;
+        }
+        for (int i = 1; i < n_extra; ++i)
+        {
+            read_bits(8);
+        }
+
+        uint32_t block_size = 0;
+        if (block_size_code == 1)
+        {
+            block_size = 192;
+        }
+        else if (block_size_code >= 2 && block_size_code <= 5)
+        {
+            block_size = 576u << (block_size_code - 2);
+        }
+        else if (block_size_code == 6)
+        {
+            block_size = read_bits(8) + 1;
+        }
+        else if (block_size_code == 7)
+        {
+            block_size = read_bits(16) + 1;
+        }
+        else if (block_size_code >= 8)
+        {
+            block_size = 256u << (block_size_code - 8);
+        }
+
+        if (sample_rate_code == 12)
+        {
+            read_bits(8);
+        }
+        else if (sample_rate_code == 13 || sample_rate_code == 14)
+        {
+            read_bits(16);
+        }
+
+        read_bits(8); // CRC-8
+
+        static const uint32_t sample_sizes[8] = { 0, 8, 12, 0, 16, 20, 24, 32 };
+        const uint32_t bps = sample_size_code == 0 ? bits_per_sample : sample_sizes[sample_size_code];
+
+        const uint32_t n_channels = channel_assignment < 8 ? channel_assignment + 1 : 2;
+
+        if (eof || block_size == 0 || bps == 0 || channel_assignment > 10 || n_channels != channels)
+        {
+            return -1;
+        }
+
+        // the side channel of a 32-bit stream would need 33 bits
+        if (channel_assignment >= 8 && bps + 1 > 32)
+        {
+            return -1;
+        }
+
+        samples.resize(n_channels);
+        for (uint32_t c = 0; c < n_channels; ++c)
+        {
+            // the side channel carries one extra bit
+            const bool side = (channel_assignment == 8 && c == 1) || (channel_assignment == 9 && c == 0) || (channel_assignment == 10 && c == 1);
+
+            samples[c].resize(block_size);
+            if (!decode_subframe(samples[c].data(), block_size, bps + (side ? 1 : 0)))
+            {
+                return -1;
+            }
+        }
+
+        // inter-channel decorrelation
+        if (channel_assignment >= 8)
+        {
+            int32_t *a = samples[0].data();
+            int32_t *b = samples[1].data();
+            for (uint32_t i = 0; i < block_size; ++i)
+            {
+                if (channel_assignment == 8)
+                {
+                    b[i] = a[i] - b[i]; // left, side
+                }
+                else if (channel_assignment == 9)
+                {
+                    a[i] = a[i] + b[i]; // side, right
+                }
+                else
+                {
+                    const int32_t side = b[i]; // mid, side
+                    const int32_t mid = (int32_t)((uint32_t)a[i] << 1) | (side & 1);
+                    a[i] = (mid + side) >> 1;
+                    b[i] = (mid - side) >> 1;
+                }
+            }
+        }
+
+        // byte alignment padding and CRC-16
+        align();
+        read_bits(16);
+
+        frame_bps = bps;
+
+        return eof ? -1 : (int)block_size;
+    }
+
+    // Samples of channel c of the last decoded frame, as signed integers of frame_bits() bits
+    const int32_t *channel(uint32_t c) const
+    {
+        return samples[c].data();
+    }
+
+    uint32_t frame_bits() const
+    {
+        return frame_bps;
+    }
+
+private:
+    bool decode_subframe(int32_t *out, uint32_t block_size, uint32_t bps)
+    {
+        read_bits(1); // zero padding
+        const uint32_t type = read_bits(6);
+
+        uint32_t wasted = 0;
+        if (read_bits(1))
+        {
+            wasted = read_unary() + 1;
+            if (wasted >= bps)
+            {
+                return false;
+            }
+            bps -= wasted;
+        }
+
+        if (type == 0)
+        {
+            // constant
+            const int32_t value = read_signed(bps);
+            for (uint32_t i = 0; i < block_size; ++i)
+            {
+                out[i] = value;
+            }
+        }
+        else if (type == 1)
+        {
+            // verbatim
+            for (uint32_t i = 0; i < block_size; ++i)
+            {
+                out[i] = read_signed(bps);
+            }
+        }
+        else if (type >= 8 && type <= 12)
+        {
+            // fixed predictor
+            const uint32_t order = type - 8;
+            if (order > block_size)
+            {
+                return false;
+            }
+            for (uint32_t i = 0; i < order; ++i)
+            {
+                out[i] = read_signed(bps);
+            }
+            if (!decode_residual(out, block_size, order))
+            {
+                return false;
+            }
+
+            for (uint32_t i = order; i < block_size; ++i)
+            {
+                switch (order)
+                {
+                    case 1: out[i] += out[i - 1]; break;
+                    case 2: out[i] += 2 * out[i - 1] - out[i - 2]; break;
+                    case 3: out[i] += 3 * out[i - 1] - 3 * out[i - 2] + out[i - 3]; break;
+                    case 4: out[i] += 4 * out[i - 1] - 6 * out[i - 2] + 4 * out[i - 3] - out[i - 4]; break;
+                    default: break;
+                }
+            }
+        }
+        else if (type >= 32)
+        {
+            // linear prediction
+            const uint32_t order = (type & 31) + 1;
+            if (order > block_size)
+            {
+                return false;
+            }
+            for (uint32_t i = 0; i < order; ++i)
+            {
+                out[i] = read_signed(bps);
+            }
+
+            const uint32_t precision = read_bits(4) + 1;
+            const int32_t shift = read_signed(5);
+            if (precision == 16 || shift < 0)
+            {
+                return false;
+            }
+
+            int32_t coefs[32];
+            for (uint32_t j = 0; j < order; ++j)
+            {
+                coefs[j] = read_signed(precision);
+            }
+
+            if (!decode_residual(out, block_size, order))
+            {
+                return false;
+            }
+
+            for (uint32_t i = order; i < block_size; ++i)
+            {
+                int64_t sum = 0;
+                for (uint32_t j = 0; j < order; ++j)
+                {
+                    sum += (int64_t)coefs[j] * out[i - j - 1];
+                }
+                out[i] += (int32_t)(sum >> shift);
+            }
+        }
+        else
+        {
+            return false;
+        }
+
+        if (wasted > 0)
+        {
+            for (uint32_t i = 0; i < block_size; ++i)
+            {
+                out[i] = (int32_t)((uint32_t)out[i] << wasted);
+            }
+        }
+
+        return !eof;
+    }
+
+    // Rice-coded residual, written to out[order..block_size)
+    bool decode_residual(int32_t *out, uint32_t block_size, uint32_t order)
+    {
+        const uint32_t method = read_bits(2);
+        if (method > 1)
+        {
+            return false;
+        }
+
+        const uint32_t param_bits = method == 0 ? 4 : 5;
+        const uint32_t escape = method == 0 ? 15 : 31;
+
+        const uint32_t partition_order = read_bits(4);
+        const uint32_t n_partitions = 1u << partition_order;
+        const uint32_t partition_size = block_size >> partition_order;
+        if (partition_size < order || (partition_size << partition_order) != block_size)
+        {
+            return false;
+        }
+
+        uint32_t i = order;
+        for (uint32_t p = 0; p < n_partitions; ++p)
+        {
+            const uint32_t n = p == 0 ? partition_size - order : partition_size;
+            const uint32_t k = read_bits(param_bits);
+
+            if (k == escape)
+            {
+                const uint32_t bits = read_bits(5);
+                for (uint32_t j = 0; j < n; ++j)
+                {
+                    out[i++] = bits == 0 ? 0 : read_signed(bits);
+                }
+            }
+            else
+            {
+                for (uint32_t j = 0; j < n; ++j)
+                {
+                    const uint32_t q = read_unary();
+                    const uint32_t u = (q << k) | (k ? read_bits(k) : 0);
+                    out[i++] = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+                }
+            }
+
+            if (eof)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Find the next frame sync code (0xFFF8 or 0xFFF9) at a byte boundary
+    bool sync()
+    {
+        align();
+
+        uint32_t prev = 0;
+        while (true)
+        {
+            const uint32_t byte = read_bits(8);
+            if (eof)
+            {
+                return false;
+            }
+            if (prev == 0xff && (byte & 0xfe) == 0xf8)
+            {
+                return true;
+            }
+            prev = byte;
+        }
+    }
+
+    // Bit reader
+
+    bool fill_byte()
+    {
+        if (pos == len)
+        {
+            len = fread(buffer, 1, sizeof(buffer), file);
+            pos = 0;
+            if (len == 0)
+            {
+                eof = true;
+                return false;
+            }
+        }
+
+        cache = (cache << 8) | buffer[pos++];
+        n_bits += 8;
+        return true;
+    }
+
+    // n <= 32
+    uint32_t read_bits(uint32_t n)
+    {
+        while (n_bits < n)
+        {
+            if (!fill_byte())
+            {
+                return 0;
+            }
+        }
+
+        n_bits -= n;
+        return (uint32_t)((cache >> n_bits) & ((1ull << n) - 1));
+    }
+
+    int32_t read_signed(uint32_t n)
+    {
+        const uint32_t u = read_bits(n);
+        return n == 32 ? (int32_t)u : (int32_t)(u << (32 - n)) >> (32 - n);
+    }
+
+    // Count zero bits up to the next one bit, which is consumed
+    uint32_t read_unary()
+    {
+        uint32_t count = 0;
+        while (true)
+        {
+            const uint64_t bits = n_bits == 0 ? 0 : cache & ((1ull << n_bits) - 1);
+            if (bits != 0)
+            {
+                const uint32_t msb = 63 - __builtin_clzll(bits);
+                count += n_bits - 1 - msb;
+                n_bits = msb;
+                return count;
+            }
+
+            count += n_bits;
+            n_bits = 0;
+            if (!fill_byte())
+            {
+                return count;
+            }
+        }
+    }
+
+    void align()
+    {
+        n_bits -= n_bits % 8;
+    }
+
+    bool read_bytes(uint8_t *dst, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            dst[i] = (uint8_t)read_bits(8);
+        }
+        return !eof;
+    }
+
+    void skip_bytes(size_t n)
+    {
+        // drop whatever is buffered before seeking past the rest
+        align();
+        while (n > 0 && n_bits > 0)
+        {
+            read_bits(8);
+            n--;
+        }
+        const size_t buffered = std::min(n, len - pos);
+        pos += buffered;
+        n -= buffered;
+        if (n > 0)
+        {
+            fseek(file, (long)n, SEEK_CUR);
+        }
+    }
+
+    FILE *file = nullptr;
+    uint8_t buffer[64 * 1024];
+    size_t pos = 0;
+    size_t len = 0;
+    uint64_t cache = 0;
+    uint32_t n_bits = 0;
+    bool eof = false;
+
+    uint32_t frame_bps = 0;
+    std::vector<std::vector<int32_t>> samples;
+};
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef WHISPER_GGML_MODEL_CACHE_H
+#define WHISPER_GGML_MODEL_CACHE_H
+
+// Resident Model Cache
+//
+// Architecture Decision: Process-wide LRU cache of whisper_context objects keyed by model path
+// - Reason: Loading a model reads and allocates hundreds of MB, which dominates short requests
+// - Sharing: Contexts are loaded without a default state; every request uses its own
+//   whisper_state, so concurrent requests on the same model share one copy of the weights
+// - Eviction: Least recently used models are freed once the cache exceeds its memory budget.
+//   Models that are in use are never freed; they become eligible again when released
+// - Budget: WHISPER_GGML_CACHE_MB environment variable, or the "setModelCacheBudget" action
+// - Platforms: Shared by the Android and Linux plugins, which build against their own copy of
+//   whisper.cpp. Platform specific settings of a newly loaded context go through the load hook,
+//   and each plugin reports the cache in its own JSON through visit()
+
+#include "whisper.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+
+static const size_t WHISPER_GGML_DEFAULT_CACHE_BYTES = 1024ull * 1024ull * 1024ull;
+
+struct whisper_model_cache_entry
+{
+    std::string path;
+    struct whisper_context *ctx = nullptr;
+
+    size_t size_bytes = 0; // approximated by the size of the model file
+    int32_t n_users = 0;
+    bool loading = false;
+};
+
+struct whisper_model_cache_counters
+{
+    size_t budget_bytes = 0;
+    size_t total_bytes = 0;
+
+    uint64_t n_hits = 0;
+    uint64_t n_misses = 0;
+    uint64_t n_evictions = 0;
+};
+
+class whisper_model_cache
+{
+public:
+    // called with the cache locked, once for every context that is loaded
+    typedef std::function<void(struct whisper_context *)> load_hook;
+
+    explicit whisper_model_cache(load_hook on_load = nullptr) : on_load(on_load)
+    {
+        counters.budget_bytes = WHISPER_GGML_DEFAULT_CACHE_BYTES;
+
+        const char *env = getenv("WHISPER_GGML_CACHE_MB");
+        if (env != nullptr)
+        {
+            counters.budget_bytes = (size_t)strtoull(env, nullptr, 10) * 1024ull * 1024ull;
+        }
+    }
+
+    whisper_model_cache(const whisper_model_cache &) = delete;
+    whisper_model_cache &operator=(const whisper_model_cache &) = delete;
+
+    // returns an entry with its user count incremented, or nullptr if the model failed to load
+    whisper_model_cache_entry *acquire(const std::string &path)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true)
+        {
+            auto it = find(path);
+            if (it == entries.end())
+            {
+                break;
+            }
+
+            if (it->loading)
+            {
+                // another thread is loading the same model - wait for it instead of loading twice
+                loaded.wait(lock);
+                continue;
+            }
+
+            it->n_users++;
+            entries.splice(entries.begin(), entries, it); // mark as most recently used
+            counters.n_hits++;
+            return &*it;
+        }
+
+        entries.emplace_front();
+        entries.front().path = path;
+        entries.front().loading = true;
+        counters.n_misses++;
+
+        lock.unlock();
+        struct whisper_context *ctx = whisper_init_from_file_no_state(path.c_str());
+        const size_t size_bytes = file_size(path);
+        lock.lock();
+
+        auto it = find(path);
+        if (ctx == nullptr)
+        {
+            entries.erase(it);
+            loaded.notify_all();
+            return nullptr;
+        }
+
+        if (on_load)
+        {
+            on_load(ctx);
+        }
+
+        it->ctx = ctx;
+        it->size_bytes = size_bytes;
+        it->n_users = 1;
+        it->loading = false;
+        counters.total_bytes += size_bytes;
+
+        evict_locked();
+        loaded.notify_all();
+
+        return &*it;
+    }
+
+    void release(whisper_model_cache_entry *entry)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        entry->n_users--;
+
+        evict_locked();
+    }
+
+    void set_budget(size_t max_bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        counters.budget_bytes = max_bytes;
+        evict_locked();
+    }
+
+    // calls f(entry) for every loaded model with the cache locked, most recently used first,
+    // and returns the counters at that point
+    template <typename F>
+    whisper_model_cache_counters visit(F &&f)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        for (auto &entry : entries)
+        {
+            if (!entry.loading)
+            {
+                f(entry);
+            }
+        }
+
+        return counters;
+    }
+
+private:
+    std::list<whisper_model_cache_entry>::iterator find(const std::string &path)
+    {
+        for (auto it = entries.begin(); it != entries.end(); ++it)
+        {
+            if (it->path == path)
+            {
+                return it;
+            }
+        }
+        return entries.end();
+    }
+
+    // free least recently used models until the budget is met, skipping models that are in use
+    void evict_locked()
+    {
+        auto it = entries.end();
+        while (counters.total_bytes > counters.budget_bytes && it != entries.begin())
+        {
+            --it;
+            if (it->loading || it->n_users > 0)
+            {
+                continue;
+            }
+
+            whisper_free(it->ctx);
+            counters.total_bytes -= it->size_bytes;
+            counters.n_evictions++;
+            it = entries.erase(it);
+        }
+    }
+
+    static size_t file_size(const std::string &path)
+    {
+        std::ifstream fin(path, std::ios::binary | std::ios::ate);
+        return fin ? (size_t)fin.tellg() : 0;
+    }
+
+    load_hook on_load;
+
+    std::mutex mutex;
+    std::condition_variable loaded;
+
+    std::list<whisper_model_cache_entry> entries; // front is the most recently used
+
+    whisper_model_cache_counters counters;
+};
+
+#endif // WHISPER_GGML_MODEL_CACHE_H
@@ -10,6 +10,11 @@ flutter test test/whisper_audio_convert_test.dart
 if [[ "$OSTYPE" == "linux-gnu"* ]]; then
   echo -e "\n=== Running Linux integration tests ==="
   flutter test test/integration/whisper_audio_convert_integration_test.dart
+
+  echo -e "\n=== Running native unit tests ==="
+  cmake -S linux -B build/native_tests -DWHISPER_GGML_BUILD_TESTS=ON && \
+    cmake --build build/native_tests --target kv_cache_fork_test parallel_split_test flac_decoder_test && \
+    ctest --test-dir build/native_tests --output-on-failure
 else
   echo -e "\n=== Skipping Linux integration tests (not on Linux) ==="
 fi